@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+#  Copyright (C) 2019 Gaël PORTAY
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+
+set -e
+
+# Second stage: runs as pid 1 of the new namespaces, sets up a private /run and
+# /lib/tini, and then becomes tini with the remaining options.
+if [ "$1" = "--init" ]
+then
+	shift
+	mount -t tmpfs tmpfs /run
+	mkdir -p /run/bench
+	mkdir -p "$BENCH_TMP/upper" "$BENCH_TMP/work"
+	mount -t overlay overlay \
+	      -o "lowerdir=/lib,upperdir=$BENCH_TMP/upper,workdir=$BENCH_TMP/work" \
+	      /lib
+
+	install -D -m 755 "$BENCH_DIR/rcS.sh" /lib/tini/scripts/rcS
+	install -D -m 755 "$BENCH_DIR/flap.sh" /lib/tini/scripts/flap
+	install -D -m 755 "$BENCH_DIR/uevent.sh" /lib/tini/uevent/script
+
+	exec "$BENCH_DIR/tini" "$@" >>"$BENCH_TMP/tini.log" 2>&1
+fi
+
+BENCH_DIR="$(cd "${0%/*}" && pwd)"
+BENCH_N="${BENCH_N:-100}"
+BENCH_CSV="${BENCH_CSV:-$BENCH_DIR/bench.csv}"
+BENCH_TMP="$(mktemp -d)"
+trap 'rm -Rf "$BENCH_TMP"' 0
+
+mkdir -p "$BENCH_TMP/bin"
+for applet in spawn respawn assassinate status zombize poweroff settle
+do
+	ln -sf "$BENCH_DIR/tini" "$BENCH_TMP/bin/$applet"
+done
+
+PATH="$BENCH_TMP/bin:$PATH"
+export BENCH_DIR BENCH_N BENCH_CSV BENCH_TMP PATH
+
+echo "benchmark,metric,value,unit" >"$BENCH_CSV"
+
+# tini powers off the pid namespace once the benchmarks are done; the init of
+# the namespace is then killed by SIGINT.
+unshare --user --map-root-user --mount --net --pid --fork --mount-proc \
+	"$BENCH_DIR/bench.sh" --init --capture="$BENCH_TMP/uevents" || true
+
+if ! [ -e "$BENCH_TMP/done" ]
+then
+	echo "Error: Benchmarks did not complete!" >&2
+	cat "$BENCH_TMP/tini.log" >&2
+	exit 1
+fi
+
+# Then the uevents captured meanwhile are replayed, at once.
+rm -f "$BENCH_TMP/done"
+TINI_STAGES=1 BENCH_REPLAY=1 unshare --user --map-root-user --mount --net --pid --fork \
+	--mount-proc "$BENCH_DIR/bench.sh" --init \
+	--replay="$BENCH_TMP/uevents" --replay-speed=0 || true
+
+if ! [ -e "$BENCH_TMP/done" ]
+then
+	echo "Error: Replay did not complete!" >&2
+	cat "$BENCH_TMP/tini.log" >&2
+	exit 1
+fi
+
+cat "$BENCH_CSV"
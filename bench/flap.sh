@@ -0,0 +1,21 @@
+#!/bin/sh
+#
+#  Copyright (C) 2019 Gaël PORTAY
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+
+# Logs its start and exit times and exits, so that tini respawns it; until it
+# has been started COUNT times.
+
+log="$1"
+count="$2"
+
+echo "start $(date +%s%N)" >>"$log"
+if [ "$(grep -c '^start ' "$log")" -ge "$count" ]
+then
+	exec sleep 3600
+fi
+
+echo "exit $(date +%s%N)" >>"$log"
+exit 1
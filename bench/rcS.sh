@@ -0,0 +1,180 @@
+#!/bin/sh
+#
+#  Copyright (C) 2019 Gaël PORTAY
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+
+# Runs the benchmarks under tini as pid 1, appends the results to $BENCH_CSV
+# and powers off.
+
+set -e
+
+N="$BENCH_N"
+
+trap poweroff 0
+
+now() {
+	date +%s%N
+}
+
+result() {
+	echo "$1,$2,$3,$4" >>"$BENCH_CSV"
+}
+
+# rate COUNT START END
+rate() {
+	awk -v n="$1" -v s="$2" -v e="$3" \
+	    'BEGIN { printf "%.1f\n", n * 1000000000 / (e - s) }'
+}
+
+# latency COUNT START END
+latency() {
+	awk -v n="$1" -v s="$2" -v e="$3" \
+	    'BEGIN { printf "%.1f\n", (e - s) / n / 1000 }'
+}
+
+# wait_for TIMEOUT COMMAND [ARGUMENT...]
+wait_for() {
+	local timeout
+	timeout="$(($(now) + $1 * 1000000000))"
+	shift
+
+	while ! "$@"
+	do
+		if [ "$(now)" -gt "$timeout" ]
+		then
+			echo "Error: $*: Timed out!" >&2
+			return 1
+		fi
+		sleep 0.01
+	done
+}
+
+zombies() {
+	grep -l '^State:[[:space:]]*Z' /proc/[0-9]*/status 2>/dev/null | wc -l
+}
+
+no_zombies() {
+	[ "$(zombies)" -eq 0 ]
+}
+
+# lines COUNT FILE [PATTERN]
+lines() {
+	[ -e "$2" ] && [ "$(grep -c "${3:-}" "$2")" -ge "$1" ]
+}
+
+# stage NAME: the time tini marked the stage NAME, in nanoseconds
+stage() {
+	awk -v n="$1" '$1 == "tini:" && $2 == "stage" && $3 == n {
+		split($4, t, "."); printf "%d%06d000\n", t[1], t[2]; exit
+	}' "$BENCH_TMP/tini.log"
+}
+
+# replay: dispatch rate of the captured uevents, replayed at once; timed by
+# tini, from the start of the replay until it is handled, as rcS runs after
+if [ -n "${BENCH_REPLAY:-}" ]
+then
+	settle
+	start="$(stage tini/replay)"
+	end="$(stage tini/replayed)"
+	n="$(cat /run/bench/uevent-* | wc -l)"
+	result replay rate "$(rate "$n" "$start" "$end")" events/s
+	touch "$BENCH_TMP/done"
+	exit
+fi
+
+# spawn: launch rate of short-lived processes
+start="$(now)"
+i=0
+while [ "$i" -lt "$N" ]
+do
+	spawn /bin/true
+	i="$((i + 1))"
+done
+end="$(now)"
+result spawn rate "$(rate "$N" "$start" "$end")" launches/s
+
+# respawn: launch rate of supervised processes
+start="$(now)"
+i=0
+while [ "$i" -lt "$N" ]
+do
+	respawn /bin/sleep "$((3600 + i))" >/dev/null
+	i="$((i + 1))"
+done
+end="$(now)"
+result respawn rate "$(rate "$N" "$start" "$end")" launches/s
+
+# status/assassinate: query latency against N pidfiles
+# Note: status and assassinate exit with the number of matching pidfiles.
+pid="$(status /bin/sleep "$((3600 + N / 2))" || :)"
+
+start="$(now)"
+i=0
+while [ "$i" -lt "$N" ]
+do
+	status "$pid" >/dev/null || :
+	i="$((i + 1))"
+done
+end="$(now)"
+result status latency_by_pid "$(latency "$N" "$start" "$end")" us
+
+start="$(now)"
+i=0
+while [ "$i" -lt "$N" ]
+do
+	status /bin/sleep "$((3600 + i))" >/dev/null || :
+	i="$((i + 1))"
+done
+end="$(now)"
+result status latency_by_cmdline "$(latency "$N" "$start" "$end")" us
+
+start="$(now)"
+i=0
+while [ "$i" -lt "$N" ]
+do
+	assassinate /bin/sleep "$((3600 + i))" >/dev/null || :
+	i="$((i + 1))"
+done
+end="$(now)"
+result assassinate latency "$(latency "$N" "$start" "$end")" us
+
+# respawn: latency from exit to respawn
+respawn /lib/tini/scripts/flap /run/bench/flap "$N" >/dev/null
+wait_for 60 lines "$N" /run/bench/flap "^start "
+awk '/^exit / { e = $2 }
+     /^start / && e { t += $2 - e; if ($2 - e > m) m = $2 - e; n++; e = 0 }
+     END { printf "%.1f,%.1f\n", t / n / 1000, m / 1000 }' \
+    /run/bench/flap >/run/bench/flap.csv
+IFS=, read -r mean max </run/bench/flap.csv
+result respawn exit_to_respawn_mean "$mean" us
+result respawn exit_to_respawn_max "$max" us
+
+# reap: throughput under a zombie storm
+start="$(now)"
+i=0
+while [ "$i" -lt "$N" ]
+do
+	zombize /bin/true
+	i="$((i + 1))"
+done
+wait_for 60 no_zombies
+end="$(now)"
+result reap rate "$(rate "$N" "$start" "$end")" reaps/s
+
+# uevent: dispatch rate of injected uevents
+start="$(now)"
+"$BENCH_DIR/uevent-inject" --count "$N"
+wait_for 60 lines "$N" /run/bench/uevent-bench
+end="$(now)"
+result uevent rate "$(rate "$N" "$start" "$end")" events/s
+
+# storm: handlers run for a change storm on a single device, once coalesced
+"$BENCH_DIR/uevent-inject" --subsystem storm --device storm0 --action change \
+			   --count "$N"
+wait_for 60 lines 1 /run/bench/uevent-storm
+sleep 1
+result storm handlers "$(grep -c "" /run/bench/uevent-storm)" handlers
+
+touch "$BENCH_TMP/done"
@@ -0,0 +1 @@
+../src/tini.c
\ No newline at end of file
@@ -0,0 +1,173 @@
+/*
+ *  Copyright (C) 2019 Gaël PORTAY
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <asm/types.h>
+#include <linux/netlink.h>
+
+#ifndef UEVENT_BUFFER_SIZE
+#define UEVENT_BUFFER_SIZE 2048
+#endif
+
+static void usage(FILE * f, char * const arg0)
+{
+	fprintf(f, "Usage: %s [OPTIONS]\n\n"
+		   "Sends synthetic kernel uevents to a netlink port.\n\n"
+		   "Options:\n"
+		   " -n or --count COUNT    Number of uevents to send"
+					  " (default: 1).\n"
+		   " -p or --port PORT      Netlink port to send to"
+					  " (default: 1).\n"
+		   " -s or --subsystem SUB  Subsystem of the uevents"
+					  " (default: bench).\n"
+		   " -a or --action ACTION  Action of the uevents"
+					  " (default: add).\n"
+		   " -d or --device NAME    Send every uevent to the same"
+					  " device.\n"
+		   " -h or --help           Display this message.\n"
+		   "", arg0);
+}
+
+static size_t uevent_append(char *buf, size_t size, size_t len,
+			    const char *fmt, ...)
+{
+	va_list ap;
+	int l;
+
+	if (len >= size)
+		return len;
+
+	va_start(ap, fmt);
+	l = vsnprintf(&buf[len], size - len, fmt, ap);
+	va_end(ap);
+	if (l < 0)
+		return len;
+
+	/* Keep the NUL as field separator */
+	return len + l + 1;
+}
+
+int main(int argc, char * const argv[])
+{
+	static const struct option long_options[] = {
+		{ "count",     required_argument, NULL, 'n' },
+		{ "port",      required_argument, NULL, 'p' },
+		{ "subsystem", required_argument, NULL, 's' },
+		{ "action",    required_argument, NULL, 'a' },
+		{ "device",    required_argument, NULL, 'd' },
+		{ "help",      no_argument,       NULL, 'h' },
+		{ NULL,        no_argument,       NULL, 0   }
+	};
+	const char *subsystem = "bench";
+	const char *action = "add";
+	const char *device = NULL;
+	struct sockaddr_nl addr;
+	int count = 1, port = 1;
+	int fd, i;
+
+	for (;;) {
+		int index;
+		int c = getopt_long(argc, argv, "n:p:s:a:d:h", long_options,
+				    &index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'n':
+			count = strtol(optarg, NULL, 0);
+			break;
+
+		case 'p':
+			port = strtol(optarg, NULL, 0);
+			break;
+
+		case 's':
+			subsystem = optarg;
+			break;
+
+		case 'a':
+			action = optarg;
+			break;
+
+		case 'd':
+			device = optarg;
+			break;
+
+		case 'h':
+			usage(stdout, argv[0]);
+			exit(EXIT_SUCCESS);
+			break;
+
+		default:
+		case '?':
+			usage(stderr, argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_KOBJECT_UEVENT);
+	if (fd == -1) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+
+	(void)memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = port;
+	addr.nl_groups = 0;
+
+	for (i = 0; i < count; i++) {
+		char buf[UEVENT_BUFFER_SIZE];
+		char name[NAME_MAX];
+		size_t len = 0;
+
+		if (device)
+			(void)snprintf(name, sizeof(name), "%s", device);
+		else
+			(void)snprintf(name, sizeof(name), "%s%i", subsystem,
+				       i);
+
+		len = uevent_append(buf, sizeof(buf), len,
+				    "%s@/devices/virtual/%s/%s", action,
+				    subsystem, name);
+		len = uevent_append(buf, sizeof(buf), len, "ACTION=%s",
+				    action);
+		len = uevent_append(buf, sizeof(buf), len,
+				    "DEVPATH=/devices/virtual/%s/%s",
+				    subsystem, name);
+		len = uevent_append(buf, sizeof(buf), len, "SUBSYSTEM=%s",
+				    subsystem);
+		len = uevent_append(buf, sizeof(buf), len, "DEVNAME=%s",
+				    name);
+		len = uevent_append(buf, sizeof(buf), len, "SEQNUM=%i", i + 1);
+		if (len >= sizeof(buf)) {
+			fprintf(stderr, "%s: Message too long!\n", subsystem);
+			exit(EXIT_FAILURE);
+		}
+
+		if (sendto(fd, buf, len, 0, (struct sockaddr *)&addr,
+			   sizeof(addr)) == -1) {
+			perror("sendto");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (close(fd) == -1)
+		perror("close");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,8 @@
+#!/bin/sh
+#
+#  Copyright (C) 2019 Gaël PORTAY
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+
+echo "$SEQNUM" >>"/run/bench/uevent-$SUBSYSTEM"
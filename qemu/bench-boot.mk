@@ -0,0 +1,26 @@
+#
+#  Copyright (C) 2019 Gaël PORTAY
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+
+# Number of boots
+BENCH_BOOT_N ?= 10
+
+# Machine-readable results, and the baseline they are compared to
+BENCH_BOOT_CSV ?= $(CURDIR)/bench-boot.csv
+BENCH_BOOT_BASELINE ?= $(CURDIR)/bench-boot.baseline
+
+# Regression thresholds: percent over the baseline, plus seconds of slack
+BENCH_BOOT_TOLERANCE ?= 10
+BENCH_BOOT_SLACK ?= 0.020
+
+.PHONY: bench-boot
+bench-boot: bzImage initramfs.cpio
+	BENCH_BOOT_N=$(BENCH_BOOT_N) BENCH_BOOT_CSV=$(BENCH_BOOT_CSV) \
+	BENCH_BOOT_BASELINE=$(BENCH_BOOT_BASELINE) \
+	BENCH_BOOT_TOLERANCE=$(BENCH_BOOT_TOLERANCE) \
+	BENCH_BOOT_SLACK=$(BENCH_BOOT_SLACK) \
+	./bench-boot.sh
+
+# ex: filetype=make
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+#  Copyright (C) 2019 Gaël PORTAY
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+
+set -e
+
+BENCH_BOOT_N="${BENCH_BOOT_N:-10}"
+BENCH_BOOT_CSV="${BENCH_BOOT_CSV:-$PWD/bench-boot.csv}"
+BENCH_BOOT_BASELINE="${BENCH_BOOT_BASELINE:-$PWD/bench-boot.baseline}"
+BENCH_BOOT_TOLERANCE="${BENCH_BOOT_TOLERANCE:-10}"
+BENCH_BOOT_SLACK="${BENCH_BOOT_SLACK:-0.020}"
+BENCH_BOOT_TIMEOUT="${BENCH_BOOT_TIMEOUT:-60}"
+BENCH_BOOT_TMP="$(mktemp -d)"
+trap 'rm -Rf "$BENCH_BOOT_TMP"' 0
+
+# Boot headless, with the stage marks on the serial console; the image reboots
+# once the shell on console is spawned, and qemu exits instead.
+i=0
+while [ "$i" -lt "$BENCH_BOOT_N" ]
+do
+	i=$((i + 1))
+	log="$BENCH_BOOT_TMP/boot$i.log"
+
+	# shellcheck disable=SC2086
+	if ! timeout "$BENCH_BOOT_TIMEOUT" \
+	     "qemu-system-$(uname -m)" -kernel bzImage -initrd initramfs.cpio \
+	     -append "rdinit=/sbin/tini console=ttyS0 quiet TINI_STAGES=1 TINI_BENCH_BOOT=1" \
+	     -display none -monitor none -serial "file:$log" -no-reboot \
+	     $QEMUFLAGS
+	then
+		echo "Error: Boot #$i did not complete!" >&2
+		cat "$log" >&2
+		exit 1
+	fi
+
+	sed -n "s,^tini: stage \([^ ]*\) \([0-9.]*\).*,\1 \2,p" "$log" \
+		>>"$BENCH_BOOT_TMP/stages"
+done
+
+# Median and 95th percentile (nearest rank) of every stage
+echo "stage,median,p95,unit" >"$BENCH_BOOT_CSV"
+sort -k1,1 -k2,2n "$BENCH_BOOT_TMP/stages" | \
+awk '
+function report() {
+	if (n == 0)
+		return
+	printf("%s,%s,%s,s\n", name, v[int((n + 1) / 2)], v[int((95 * n + 99) / 100)])
+}
+$1 != name { report(); name = $1; n = 0 }
+{ v[++n] = $2 }
+END { report() }
+' >>"$BENCH_BOOT_CSV"
+
+cat "$BENCH_BOOT_CSV"
+
+# The first run is the baseline
+if ! [ -e "$BENCH_BOOT_BASELINE" ]
+then
+	cp "$BENCH_BOOT_CSV" "$BENCH_BOOT_BASELINE"
+	echo "$BENCH_BOOT_BASELINE: Baseline recorded." >&2
+	exit 0
+fi
+
+# Fail when a stage is slower than its baseline plus the tolerance (in
+# percent) and the slack (in seconds), or when a stage is no longer marked.
+awk -F, -v tolerance="$BENCH_BOOT_TOLERANCE" -v slack="$BENCH_BOOT_SLACK" '
+FNR == 1 { next }
+NR == FNR { median[$1] = $2; p95[$1] = $3; next }
+{ seen[$1] = 1 }
+$1 in median && $2 > median[$1] * (1 + tolerance / 100) + slack {
+	printf("%s: median regressed: %ss (baseline: %ss)\n", $1, $2, median[$1]) >"/dev/stderr"
+	ret = 1
+}
+$1 in p95 && $3 > p95[$1] * (1 + tolerance / 100) + slack {
+	printf("%s: p95 regressed: %ss (baseline: %ss)\n", $1, $3, p95[$1]) >"/dev/stderr"
+	ret = 1
+}
+END {
+	for (s in median)
+		if (!(s in seen)) {
+			printf("%s: stage not reached\n", s) >"/dev/stderr"
+			ret = 1
+		}
+	exit ret
+}
+' "$BENCH_BOOT_BASELINE" "$BENCH_BOOT_CSV"
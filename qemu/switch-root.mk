@@ -0,0 +1,40 @@
+#
+#  Copyright (C) 2019 Gaël PORTAY
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+
+# Seconds the boot is given
+SWITCH_ROOT_TIMEOUT ?= 60
+
+# Virtio disk support, for a real root to switch to
+LINUX_CONFIGS	+= CONFIG_PCI=y
+LINUX_CONFIGS	+= CONFIG_BLOCK=y
+LINUX_CONFIGS	+= CONFIG_BLK_DEV=y
+LINUX_CONFIGS	+= CONFIG_VIRTIO_MENU=y
+LINUX_CONFIGS	+= CONFIG_VIRTIO_PCI=y
+LINUX_CONFIGS	+= CONFIG_VIRTIO_BLK=y
+
+# Second extended fs support
+LINUX_CONFIGS	+= CONFIG_EXT2_FS=y
+
+.PHONY: all
+all:
+
+.PHONY: clean
+clean: switch-root_clean
+
+# The real root is the initramfs, as an ext2 image
+rootfs.ext2: initramfs.cpio
+	rm -f $@
+	fakeroot -i rootfs.env -- mke2fs -q -t ext2 -d rootfs $@ 64M
+
+.PHONY: switch-root
+switch-root: bzImage initramfs.cpio rootfs.ext2
+	SWITCH_ROOT_TIMEOUT=$(SWITCH_ROOT_TIMEOUT) ./switch-root.sh
+
+.PHONY: switch-root_clean
+switch-root_clean:
+	rm -f rootfs.ext2
+
+# ex: filetype=make
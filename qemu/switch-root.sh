@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+#  Copyright (C) 2019 Gaël PORTAY
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+#
+
+set -e
+
+SWITCH_ROOT_TIMEOUT="${SWITCH_ROOT_TIMEOUT:-60}"
+SWITCH_ROOT_LOG="$(mktemp)"
+trap 'rm -f "$SWITCH_ROOT_LOG"' 0
+
+# Boot headless from the initramfs, which switches to the ext2 image on the
+# virtio disk; the real root reboots once its init script runs, and qemu exits
+# instead.
+# shellcheck disable=SC2086
+if ! timeout "$SWITCH_ROOT_TIMEOUT" \
+     "qemu-system-$(uname -m)" -kernel bzImage -initrd initramfs.cpio \
+     -drive file=rootfs.ext2,format=raw,if=virtio \
+     -append "rdinit=/sbin/tini console=ttyS0 quiet TINI_STAGES=1 TINI_SWITCH_ROOT=/dev/vda TINI_SWITCH_ROOT_CHECK=1" \
+     -display none -monitor none -serial "file:$SWITCH_ROOT_LOG" -no-reboot \
+     $QEMUFLAGS
+then
+	echo "Error: The boot did not complete!" >&2
+	cat "$SWITCH_ROOT_LOG" >&2
+	exit 1
+fi
+
+# Switched, and the respawned processes of the initramfs still supervised
+if ! grep -q '^tini: stage switch-root ' "$SWITCH_ROOT_LOG" ||
+     grep -q '^tini: stage switch-root/failed ' "$SWITCH_ROOT_LOG" ||
+   ! grep -q '^switch-root: [1-9][0-9]* pidfiles kept' "$SWITCH_ROOT_LOG"
+then
+	echo "Error: The root was not switched to!" >&2
+	cat "$SWITCH_ROOT_LOG" >&2
+	exit 1
+fi
+
+grep '^switch-root: ' "$SWITCH_ROOT_LOG"
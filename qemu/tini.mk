@@ -23,13 +23,24 @@ LINUX_CONFIGS	+= CONFIG_SYSFS=y
 # Multiple users, groups and capabilities support
 LINUX_CONFIGS	+= CONFIG_MULTIUSER=y
 
+# Reboot into a kernel loaded with kexec_file_load (reboot --kexec)
+LINUX_CONFIGS	+= CONFIG_KEXEC_FILE=y
+
 .PHONY: all
 all:
 
-rootfs/lib/tini/uevent/script: uevent.sh
-	install -D -m 755 $< $@
+rootfs/lib/tini/uevent/rules: uevent.rules
+	install -D -m 644 $< $@
+
+initramfs.cpio: rootfs/lib/tini/uevent/rules
 
-initramfs.cpio: rootfs/lib/tini/uevent/script
+# Copy the kernel into the initramfs to try reboot --kexec (make KEXEC=1)
+ifneq (,$(KEXEC))
+rootfs/boot/vmlinuz: bzImage
+	install -D -m 644 $< $@
+
+initramfs.cpio: rootfs/boot/vmlinuz
+endif
 
 rootfs/run rootfs/lib/tini/scripts rootfs/lib/tini/event/rcS:
 	mkdir -p $@
@@ -65,6 +76,8 @@ initramfs.cpio: rootfs/lib/tini/event/rcS/10coldplug
 initramfs.cpio: rootfs/lib/tini/event/rcS/20hostname
 initramfs.cpio: rootfs/lib/tini/event/rcS/30syslogd
 initramfs.cpio: rootfs/lib/tini/event/rcS/35klogd
+initramfs.cpio: rootfs/lib/tini/event/rcS/95switch-root
+initramfs.cpio: rootfs/lib/tini/event/rcS/99bench-boot
 initramfs.cpio: rootfs/lib/tini/uevent/devname/console/sh
 initramfs.cpio: rootfs/lib/tini/uevent/devname/tty2/sh rootfs/lib/tini/uevent/devname/tty3/sh rootfs/lib/tini/uevent/devname/tty4/sh
 initramfs.cpio: rootfs/lib/tini/scripts/rcS
@@ -82,13 +95,14 @@ initramfs.cpio: rootfs/var/run rootfs/lib/tini/event/rcS
 initramfs.cpio: rootfs/bin/raise
 initramfs.cpio: rootfs/sbin/tini
 initramfs.cpio: rootfs/sbin/halt rootfs/sbin/poweroff rootfs/sbin/reboot
-initramfs.cpio: rootfs/sbin/spawn rootfs/sbin/respawn rootfs/sbin/assassinate rootfs/sbin/status rootfs/sbin/zombize rootfs/sbin/re-exec
+initramfs.cpio: rootfs/sbin/spawn rootfs/sbin/respawn rootfs/sbin/assassinate rootfs/sbin/status rootfs/sbin/zombize rootfs/sbin/monitor rootfs/sbin/modalias rootfs/sbin/settle rootfs/sbin/mountall rootfs/sbin/heartbeat rootfs/sbin/fdstore rootfs/sbin/switch-root rootfs/sbin/re-exec
 
 tini: override CFLAGS+=-Wall -Wextra -Werror
+tini: override CPPFLAGS+=-I../src
 tini: override LDFLAGS+=-static
 
-rootfs/bin/raise: raise.sh | rootfs/bin
-	install -D -m 755 $< $@
+rootfs/bin/raise: rootfs/sbin/tini | rootfs/bin
+	ln -sf /sbin/$(<F) $@
 
 rootfs/sbin/tini: tini | rootfs/sbin
 	install -D -m 755 $< $@
@@ -96,7 +110,7 @@ rootfs/sbin/tini: tini | rootfs/sbin
 rootfs/sbin/halt rootfs/sbin/poweroff rootfs/sbin/reboot: rootfs/sbin/tini | rootfs/sbin
 	ln -sf $(<F) $@
 
-rootfs/sbin/spawn rootfs/sbin/respawn rootfs/sbin/assassinate rootfs/sbin/status rootfs/sbin/zombize rootfs/sbin/re-exec: rootfs/sbin/tini | rootfs/sbin
+rootfs/sbin/spawn rootfs/sbin/respawn rootfs/sbin/assassinate rootfs/sbin/status rootfs/sbin/zombize rootfs/sbin/monitor rootfs/sbin/modalias rootfs/sbin/settle rootfs/sbin/mountall rootfs/sbin/heartbeat rootfs/sbin/fdstore rootfs/sbin/switch-root rootfs/sbin/re-exec: rootfs/sbin/tini | rootfs/sbin
 	ln -sf $(<F) $@
 
 # ex: filetype=make
@@ -0,0 +1,104 @@
+/*
+ *  Copyright (C) 2019 Gaël PORTAY
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/*
+ * Userspace statically defined tracing, in the format of the <sys/sdt.h> of
+ * systemtap; a minimal fallback, written for tini, used when the system has
+ * no <sys/sdt.h>.
+ *
+ * A probe is a nop, and a .note.stapsdt entry with its address, the address
+ * of .stapsdt.base to relocate it, the address of its semaphore, if any, and
+ * the locations of its arguments; that is what bpftrace(8) and perf(1) read.
+ *
+ * With _SDT_HAS_SEMAPHORES, the probe PROVIDER:NAME refers to the semaphore
+ * PROVIDER_NAME_semaphore, defined by the caller in the .probes section; a
+ * tracer increments it while attached.
+ *
+ * Only the probes with up to two arguments, and only on x86; elsewhere they
+ * are nops without a note.
+ */
+
+#ifndef TINI_SDT_H
+#define TINI_SDT_H
+
+#define _SDT_NOTE_TYPE 3
+#define _SDT_NOTE_NAME "stapsdt"
+
+#if defined(__x86_64__)
+# define _SDT_ASM_ADDR ".8byte "
+#else
+# define _SDT_ASM_ADDR ".4byte "
+#endif
+
+#ifdef _SDT_HAS_SEMAPHORES
+# define _SDT_SEMAPHORE(provider, name) \
+	_SDT_ASM_ADDR #provider "_" #name "_semaphore\n"
+#else
+# define _SDT_SEMAPHORE(provider, name) _SDT_ASM_ADDR "0\n"
+#endif
+
+/* The size of the argument, negative if signed; arrays decay to pointers */
+#define _SDT_ARGTYPE(x) __typeof__((x) + 0)
+#define _SDT_ARGSIZE(x) \
+	((((_SDT_ARGTYPE(x))-1 < (_SDT_ARGTYPE(x))1) ? 1 : -1) * \
+	 (int)sizeof(_SDT_ARGTYPE(x)))
+#define _SDT_ARG(n, x) \
+	[_SDT_S##n] "n" (_SDT_ARGSIZE(x)), [_SDT_A##n] "nor" ((x) + 0)
+#define _SDT_ARGFMT(n) "%n[_SDT_S" #n "]@%[_SDT_A" #n "]"
+
+#define _SDT_ASM_BODY(provider, name, args) \
+	"990: nop\n" \
+	".pushsection .note.stapsdt,\"\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, " \
+		__SDT_STR(_SDT_NOTE_TYPE) "\n" \
+	"991: .asciz \"" _SDT_NOTE_NAME "\"\n" \
+	"992: .balign 4\n" \
+	"993: " _SDT_ASM_ADDR "990b\n" \
+	_SDT_ASM_ADDR "_.stapsdt.base\n" \
+	_SDT_SEMAPHORE(provider, name) \
+	".asciz \"" #provider "\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994: .balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+
+#define __SDT_STR(x) _SDT_STR(x)
+#define _SDT_STR(x) #x
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define STAP_PROBE(provider, name) \
+	__asm__ __volatile__ (_SDT_ASM_BODY(provider, name, ""))
+# define STAP_PROBE1(provider, name, a1) \
+	__asm__ __volatile__ (_SDT_ASM_BODY(provider, name, \
+					    _SDT_ARGFMT(1)) \
+			      :: _SDT_ARG(1, a1))
+# define STAP_PROBE2(provider, name, a1, a2) \
+	__asm__ __volatile__ (_SDT_ASM_BODY(provider, name, \
+					    _SDT_ARGFMT(1) " " \
+					    _SDT_ARGFMT(2)) \
+			      :: _SDT_ARG(1, a1), _SDT_ARG(2, a2))
+#else
+# define STAP_PROBE(provider, name) do { } while (0)
+# define STAP_PROBE1(provider, name, a1) do { (void)(a1); } while (0)
+# define STAP_PROBE2(provider, name, a1, a2) \
+	do { (void)(a1); (void)(a2); } while (0)
+#endif
+
+#define DTRACE_PROBE(provider, name) STAP_PROBE(provider, name)
+#define DTRACE_PROBE1(provider, name, a1) STAP_PROBE1(provider, name, a1)
+#define DTRACE_PROBE2(provider, name, a1, a2) \
+	STAP_PROBE2(provider, name, a1, a2)
+
+#endif
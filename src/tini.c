@@ -24,16 +24,49 @@ static const char VERSION[] = __DATE__ " " __TIME__;
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/reboot.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mount.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <dirent.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <pwd.h>
+#include <grp.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <mntent.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <asm/types.h>
 #include <linux/netlink.h>
+#include <linux/fiemap.h>
+#include <linux/magic.h>
 
 static int VERBOSE = 0;
 static int DEBUG = 0;
+static int RUSAGE = 0;
+static int STAGES = 0;
 #define verbose(fmt, ...) if (VERBOSE > 0) fprintf(stderr, fmt, ##__VA_ARGS__)
 #define debug(fmt, ...) if (DEBUG > 0) fprintf(stderr, fmt, ##__VA_ARGS__)
 
@@ -56,6 +89,139 @@ static inline const char *__getenv(const char *name, const char *undef)
 	return env;
 }
 
+/* Boot stage mark, in seconds since the kernel booted (see make bench-boot) */
+static void stage(const char *name)
+{
+	struct timespec ts;
+
+	if (STAGES == 0 || clock_gettime(CLOCK_BOOTTIME, &ts) == -1)
+		return;
+
+	fprintf(stderr, "tini: stage %s %lu.%06lu\n", name,
+		(unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec / 1000);
+}
+
+#ifdef __GLIBC_PREREQ
+# if !__GLIBC_PREREQ(2, 36)
+#  define P_PIDFD 3
+# endif
+#elif !defined(P_PIDFD)
+# define P_PIDFD 3
+#endif
+
+static inline int __pidfd_open(pid_t pid, unsigned int flags)
+{
+	return syscall(SYS_pidfd_open, pid, flags);
+}
+
+static inline int __pidfd_send_signal(int pidfd, int sig, siginfo_t *info,
+				      unsigned int flags)
+{
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, info, flags);
+}
+
+#ifndef MODULE_INIT_COMPRESSED_FILE
+# define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+
+static inline int __waitid(idtype_t idtype, id_t id, siginfo_t *infop,
+			   int options, struct rusage *ru)
+{
+	return syscall(SYS_waitid, idtype, id, infop, options, ru);
+}
+
+static inline int __memfd_create(const char *name, unsigned int flags)
+{
+	return syscall(SYS_memfd_create, name, flags);
+}
+
+static inline int __close_range(unsigned int first, unsigned int last,
+				unsigned int flags)
+{
+	return syscall(SYS_close_range, first, last, flags);
+}
+
+#ifndef FS_IOC_FIEMAP
+# define FS_IOC_FIEMAP _IOWR('f', 11, struct fiemap)
+#endif
+
+/*
+ * USDT probes, for bpftrace(8) and perf(1) to attach to tini:NAME. A probe is
+ * a nop, and its arguments are evaluated only while its semaphore is held by
+ * a tracer; not to cost pid 1 a syscall or a rescan per event otherwise.
+ */
+#define _SDT_HAS_SEMAPHORES 1
+#if defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+# else
+#  include "tini-sdt.h"
+# endif
+#else
+# include "tini-sdt.h"
+#endif
+
+#define PROBE_SEMAPHORE(name) \
+	__extension__ unsigned short tini_##name##_semaphore \
+	__attribute__((unused)) __attribute__((section(".probes")))
+
+PROBE_SEMAPHORE(fork);
+PROBE_SEMAPHORE(exec);
+PROBE_SEMAPHORE(reap);
+PROBE_SEMAPHORE(pid_respawn_entry);
+PROBE_SEMAPHORE(pid_respawn_return);
+PROBE_SEMAPHORE(uevent_receive);
+PROBE_SEMAPHORE(uevent_dispatch);
+
+#define PROBE2(name, a1, a2) \
+	do { \
+		if (__builtin_expect(tini_##name##_semaphore, 0)) \
+			DTRACE_PROBE2(tini, name, a1, a2); \
+	} while (0)
+
+#ifndef KEXEC_FILE_UNLOAD
+# define KEXEC_FILE_UNLOAD 0x00000001
+#endif
+
+#ifndef KEXEC_FILE_NO_INITRAMFS
+# define KEXEC_FILE_NO_INITRAMFS 0x00000004
+#endif
+
+static inline int __kexec_file_load(int kernel_fd, int initrd_fd,
+				    unsigned long cmdline_len,
+				    const char *cmdline, unsigned long flags)
+{
+#ifdef SYS_kexec_file_load
+	return syscall(SYS_kexec_file_load, kernel_fd, initrd_fd, cmdline_len,
+		       cmdline, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+#ifndef IOPRIO_CLASS_IDLE
+# define IOPRIO_CLASS_IDLE 3
+# define IOPRIO_CLASS_SHIFT 13
+# define IOPRIO_WHO_PROCESS 1
+#endif
+
+static inline int __ioprio_set(int which, int who, int ioprio)
+{
+	return syscall(SYS_ioprio_set, which, who, ioprio);
+}
+
+static inline int __finit_module(int fd, const char *params, int flags)
+{
+	return syscall(SYS_finit_module, fd, params, flags);
+}
+
+static inline int __init_module(void *image, unsigned long len,
+				const char *params)
+{
+	return syscall(SYS_init_module, image, len, params);
+}
+
 static inline int open_or_exit(const char *filename, int flags)
 {
 	int fd = open(filename, flags);
@@ -108,7 +274,7 @@ static inline pid_t strtopid(const char *nptr)
 	olderrno = errno;
 	errno = 0;
 	pid = (pid_t)strtol(nptr, &endptr, 0);
-	if (pid <= 0 || errno != 0 || *endptr == '\0') {
+	if (pid <= 0 || errno != 0 || *endptr != '\0') {
 		errno = EINVAL;
 		pid = -1;
 	} else {
@@ -118,43 +284,195 @@ static inline pid_t strtopid(const char *nptr)
 	return pid;
 }
 
-static inline pid_t readpid(int fd)
+/* One pid per line, as respawn prints them for the instances of a pool */
+static inline int readpids(int fd, pid_t pids[], int n)
 {
-	char buf[BUFSIZ];
-	ssize_t size;
+	char buf[BUFSIZ], *s, *save;
+	size_t size = 0;
+	int i = 0;
 
-	for (;;) {
-		size = read(fd, buf, sizeof(buf));
-		if (size == -1) {
+	while (size < sizeof(buf) - 1) {
+		ssize_t l = read(fd, &buf[size], sizeof(buf) - 1 - size);
+		if (l == -1) {
 			perror("read");
-			break;
-		} else if (size == 0) {
+			return -1;
+		} else if (l == 0) {
 			break;
 		}
-		buf[size] = '\0';
 
-		if (buf[size-1] == '\n')
-			buf[size-1] = '\0';
+		size += l;
+	}
+	buf[size] = '\0';
 
-		return strtopid(buf);
+	for (s = strtok_r(buf, "\n", &save); s && i < n;
+	     s = strtok_r(NULL, "\n", &save)) {
+		pids[i] = strtopid(s);
+		if (pids[i] == -1)
+			return -1;
+		i++;
 	}
 
-	return -1;
+	return i;
 }
 
-static char *CFS = " \t\n"; /* Command-line Field Separator */
-static char *strargv(char *buf, size_t bufsize, const char *path,
-		     char * const argv[]);
-static char **strtonargv(char *dest[], char *src, int *n);
+static size_t strvsize(char * const vec[], int *n);
+static char *strvcpy(char *dest, char * const vec[]);
+static char **strntov(char *dest[], const char *src, int n);
+static uint64_t strnhash(const char *s, size_t size);
 
 #ifndef UEVENT_BUFFER_SIZE
 #define UEVENT_BUFFER_SIZE 2048
 #endif
 
-static int nl_fd;
-static int netlink_open(struct sockaddr_nl *addr, int signal);
+/* Accept the uevents sent from userspace too; for the benchmarks only */
+#ifndef UEVENT_UNTRUSTED
+#define UEVENT_UNTRUSTED 0
+#endif
+
+static int nl_fd = -1;
+static int netlink_open(struct sockaddr_nl *addr);
 static ssize_t netlink_recv(int fd, struct sockaddr_nl *addr);
+static void uevent_dispatch(char *buf, ssize_t l);
+static uint64_t uevent_seqnum(const char *buf, ssize_t len);
+static uint64_t kernel_seqnum(uint64_t undef);
+static int uevent_coalesce(const char *buf, ssize_t len);
+static int uevent_coalesce_open(void);
+static void uevent_release(void);
+static int co_tfd = -1;
+
+#ifndef UEVENT_COALESCE_MS
+#define UEVENT_COALESCE_MS 50 /* 0 not to hold the uevents */
+#endif
+static long coalesce_ms = UEVENT_COALESCE_MS;
+
+/* Past them, the socket is not drained, and the kernel drops the next ones */
+#ifndef UEVENT_HELD_MAX
+#define UEVENT_HELD_MAX 4096
+#endif
+static int nheld;
+static int nl_paused;
+static void netlink_pause(int fd);
+static void netlink_unpause(int fd);
+static int held_keep(void);
+static void held_resume(void);
 static int netlink_close(int fd);
+static int netlink_keep(int fd);
+static int netlink_resume(struct sockaddr_nl *addr);
+static void uevent_receive(char *buf, ssize_t len);
+
+#ifndef UEVENT_CAPTURE
+#define UEVENT_CAPTURE "/run/tini.uevents"
+#endif
+
+#ifndef CAPTURE_SIZE_MAX
+#define CAPTURE_SIZE_MAX (16 << 20) /* bytes, not to fill /run up */
+#endif
+
+#define CAPTURE_MAGIC "tiniuevt"
+#define CAPTURE_VERSION 1
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+/* Followed by the message; unaligned */
+struct capture_record {
+	uint64_t usec; /* when received, on CLOCK_BOOTTIME */
+	uint32_t len;
+	uint32_t reserved;
+};
+
+struct replay {
+	char *addr;
+	size_t size;
+	size_t off; /* of the next record */
+	uint64_t first; /* usec of the first record */
+	uint64_t start; /* ns, on CLOCK_MONOTONIC */
+	double speed; /* 0 not to wait */
+	unsigned int n;
+	int handled;
+};
+
+static int cap_fd = -1;
+static size_t cap_size;
+static int rp_tfd = -1;
+static struct replay replay;
+static int replay_dry; /* the handlers only, not the devices nor modules */
+static int uevent_capture_open(const char *path);
+static void uevent_capture(const char *buf, ssize_t len);
+static int uevent_replay_open(const char *path, double speed);
+static void uevent_replay(void);
+
+#ifndef UEVENT_SOCKET
+#define UEVENT_SOCKET "@tini/uevent"
+#endif
+
+#ifndef UEVENT_FILTERS_MAX
+#define UEVENT_FILTERS_MAX 16
+#endif
+
+#ifndef UEVENT_SUBSCRIBERS_MAX
+#define UEVENT_SUBSCRIBERS_MAX 64
+#endif
+
+/* Connections of root kept past the cap, for the control messages */
+#ifndef UEVENT_SUBSCRIBERS_RESERVED
+#define UEVENT_SUBSCRIBERS_RESERVED 16
+#endif
+
+/* Milliseconds a control message waits for pid 1 to accept and reply */
+#ifndef CONTROL_TIMEOUT_MS
+#define CONTROL_TIMEOUT_MS 1000
+#endif
+
+struct uevent_filter {
+	char subsystem[32]; /* empty matches any */
+	char devtype[32]; /* empty matches any */
+};
+
+struct subscriber {
+	int fd;
+	int settle; /* waits for the uevents to be handled */
+	int nfilters;
+	struct uevent_filter filters[UEVENT_FILTERS_MAX];
+};
+
+static int ul_fd = -1;
+static int ul_paused; /* not accepting until a subscriber hangs up */
+static struct subscriber *subscribers;
+static int nsubscribers;
+static socklen_t uevent_address(struct sockaddr_un *addr);
+static int uevent_listen(void);
+static void uevent_resume(int fd);
+static int uevent_accept(int fd);
+static int uevent_subscriber(int fd);
+static int uevent_subscribe(int i);
+static void uevent_unsubscribe(int i);
+static void uevent_broadcast(const char *buf, size_t len,
+			     const char *subsystem, const char *devtype);
+static int uevent_close(int fd);
+
+#ifndef UEVENT_SEQNUM
+#define UEVENT_SEQNUM "/sys/kernel/uevent_seqnum"
+#endif
+
+#ifndef SETTLE_TIMEOUT
+#define SETTLE_TIMEOUT 120 /* seconds */
+#endif
+
+#ifndef SETTLE_GRACE_MS
+#define SETTLE_GRACE_MS 250 /* for the kernel SEQNUM; not all are sent here */
+#endif
+
+static uint64_t seqnum_received; /* highest */
+static uint64_t seqnum_handled; /* highest, with every uevent before it */
+static int st_tfd = -1; /* the grace for the kernel SEQNUM */
+static int settle_armed;
+static int settle_graced; /* on what was received, the kernel SEQNUM aside */
+static void uevent_settle(void);
+static void uevent_settle_grace(void);
 
 typedef int uevent_event_cb_t(char *, char *, void *);
 typedef int uevent_variable_cb_t(char *, char *, void *);
@@ -163,6 +481,199 @@ static int uevent_parse_line(char *line,
 			     uevent_variable_cb_t *var_cb,
 			     void *data);
 
+struct uevent {
+	const char *action;
+	const char *devpath;
+	const char *subsystem;
+	const char *devtype;
+	const char *devname;
+	const char *interface;
+	const char *modalias;
+	uint64_t seqnum;
+};
+
+static void uevent_fields(struct uevent *uevent, char * const envp[]);
+
+#ifndef DEVICE_RULES
+#define DEVICE_RULES "/lib/tini/uevent/rules"
+#endif
+
+struct device_rule {
+	char *buf;
+	const char *subsystem; /* fnmatch(3) pattern */
+	const char *devname; /* fnmatch(3) pattern */
+	mode_t mode; /* -1 leaves as is */
+	uid_t uid; /* -1 leaves as is */
+	gid_t gid; /* -1 leaves as is */
+	const char *symlinks; /* NUL-separated, relative to /dev */
+	int nsymlinks;
+};
+
+static struct device_rule *rules;
+static int nrules;
+static int device_rules_load(const char *path);
+static int device_setup(const struct uevent *uevent);
+
+#ifndef MODULES_DIR
+#define MODULES_DIR "/lib/modules"
+#endif
+
+#ifndef MODPROBE_D
+#define MODPROBE_D "/etc/modprobe.d:/run/modprobe.d:/lib/modprobe.d"
+#endif
+
+struct module_alias {
+	const char *pattern; /* fnmatch(3) pattern */
+	size_t patternlen;
+	size_t prefixlen; /* up to the first wildcard */
+	const char *name;
+	size_t namelen;
+};
+
+struct module_dep {
+	uint64_t hash; /* of the normalized name */
+	const char *path;
+	size_t pathlen;
+	const char *deps; /* space-separated paths */
+	size_t depslen;
+};
+
+struct modules {
+	int state; /* 0 closed, 1 opened, -1 unavailable */
+	const char *dir; /* or MODULES_DIR/$(uname -r) */
+	int dirfd;
+	int dryrun;
+	char *alias;
+	size_t aliassize;
+	char *dep;
+	size_t depsize;
+	struct module_alias *aliases;
+	int naliases;
+	struct module_dep *deps;
+	int ndeps;
+	uint64_t *loaded;
+	int nloaded;
+	uint64_t *blacklist;
+	int nblacklist;
+};
+
+static struct modules modules;
+static int modules_open(struct modules *m);
+static int modalias_load(struct modules *m, const char *modalias);
+
+#ifndef HANDLERS_CACHE
+#define HANDLERS_CACHE "/run/tini.cache"
+#endif
+
+#ifndef CACHE_CHECK_MS
+#define CACHE_CHECK_MS 1000 /* between two stat of the sources, unwatched */
+#endif
+
+#define CACHE_MAGIC "tinicach"
+#define CACHE_VERSION 1
+
+enum {
+	HANDLERS_EVENT, /* /lib/tini/event/NAME */
+	HANDLERS_DEVNAME, /* /lib/tini/uevent/devname/NAME */
+};
+
+struct cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nrecords;
+	uint64_t size;
+};
+
+struct cache_record {
+	uint64_t mtime; /* of the directory, in ns; 0 if missing */
+	uint32_t kind;
+	uint32_t dir; /* offset of the path */
+	uint32_t name; /* offset of the name; empty for the roots */
+	uint32_t handlers; /* offset of the NUL-separated basenames */
+	uint32_t nhandlers;
+	uint32_t reserved;
+};
+
+struct cache {
+	char *addr;
+	size_t size;
+	int mapped;
+	int watched; /* invalidated by inotify rather than by stat */
+	uint64_t checked; /* in ms, when stat last */
+	int stale; /* rebuilt rather than mapped */
+	const struct cache_header *header;
+	const struct cache_record *records;
+	int *wds; /* of the records, -1 if unwatched */
+	char *dirty; /* records to scan again */
+	uint32_t ndirty;
+};
+
+static int in_fd = -1;
+static struct cache cache;
+static int cache_watch(struct cache *c);
+static void cache_notify(struct cache *c, int fd);
+static int cache_open(struct cache *c, const char *path);
+static void cache_close(struct cache *c);
+static const struct cache_record *cache_lookup(struct cache *c, int kind,
+					       const char *name);
+static int run_parts(const struct cache *c, const struct cache_record *r,
+		     char *arg, char * const envp[]);
+static int uevent_handlers(const struct uevent *uevent, char * const envp[]);
+static int uevent_script(char * const argv[], char * const envp[]);
+static int runner_add(pid_t pid);
+
+#ifndef UEVENT_DAEMON
+#define UEVENT_DAEMON "/lib/tini/uevent/daemon"
+#endif
+
+#ifndef UEVENT_DAEMON_TIMEOUT
+#define UEVENT_DAEMON_TIMEOUT 30 /* seconds to ack a uevent */
+#endif
+
+#ifndef UEVENT_DAEMON_RESTART_MS
+#define UEVENT_DAEMON_RESTART_MS 100 /* doubled at every failure in a row */
+#endif
+
+#ifndef UEVENT_DAEMON_RESTART_MAX_MS
+#define UEVENT_DAEMON_RESTART_MAX_MS 10000
+#endif
+
+#ifndef UEVENT_DAEMON_BUFFER_MAX
+#define UEVENT_DAEMON_BUFFER_MAX (1024 * 1024) /* bytes not acked yet */
+#endif
+
+struct uevent_frame {
+	uint64_t sent; /* ms */
+	size_t len;
+	int replayed; /* to the next daemon, once */
+};
+
+struct uevent_daemon {
+	pid_t pid;
+	int in; /* the uevents, to its standard input */
+	int out; /* the acks, from its standard output */
+	int tfd; /* expires when the oldest uevent is not acked in time */
+	int polled; /* for the uevents not written yet */
+	char *buf; /* the uevents not acked yet */
+	size_t len;
+	size_t off; /* written */
+	struct uevent_frame *frames; /* of the uevents not acked yet */
+	int nsent;
+	uint64_t restart; /* ms, when to start it again; 0 if not waiting */
+	long delay; /* ms, before the next restart */
+};
+
+static struct uevent_daemon udaemon = {
+	-1, -1, -1, -1, 0, NULL, 0, 0, NULL, 0, 0, 0
+};
+static int udaemon_send(char * const envp[]);
+static void udaemon_flush(void);
+static void udaemon_ack(void);
+static void udaemon_timeout(void);
+static void udaemon_stop(int replay);
+static void udaemon_arm(void);
+static int replicas_hotplug(const struct uevent *uevent);
+
 typedef int variable_cb_t(char *, char *, void *);
 static int variable_parse_line(char *line, variable_cb_t *callback, void *data);
 
@@ -170,7 +681,14 @@ typedef int directory_cb_t(const char *, struct dirent *, void *);
 static int dir_parse(const char *path, directory_cb_t *callback, void *data);
 
 struct proc {
-	char exec[PATH_MAX];
+	char *buf;
+	const char *args; /* NUL-separated path and argv */
+	size_t argssize;
+	int argc;
+	const char *envs; /* NUL-separated envp */
+	size_t envssize;
+	int envc;
+	uint64_t hash; /* of args */
 	const char *dev_stdin;
 	const char *dev_stdout;
 	const char *dev_stderr;
@@ -180,16 +698,190 @@ struct proc {
 	pid_t oldpid;
 	uid_t uid;
 	gid_t gid;
+	int lowprio; /* deferred under pressure */
+	int deferred; /* not respawned yet; there is no process */
+	int replicas; /* pool size, REPLICAS_CPUS, or 0 if not in a pool */
+	int instance; /* index in the pool */
+	int cpu; /* pinned to, if in a pool */
+	int watchdog; /* ms without a heartbeat to be killed, 0 if unwatched */
+	int standby; /* keeps a standby instance to promote */
+	int waiting; /* is the standby instance */
+	time_t started; /* first spawn */
+	time_t spawned; /* last spawn */
+	/* accounting of the exited lives */
+	uint64_t utime; /* us */
+	uint64_t stime; /* us */
+	long maxrss; /* kB */
+	long majflt;
+	long nvcsw;
+	long nivcsw;
 };
 
+static int epfd = -1;
+static int epoll_watch(int fd);
+static int epoll_watch_events(int fd, uint32_t events);
+static int pidfd_watch(pid_t pid);
+static void pidfd_unwatch(int fd);
+
 static int spawn(const char *path, char * const argv[], char * const envp[],
 	  const char *devname);
-static int respawn(const char *path, char * const argv[], struct proc *proc);
+static int respawn(struct proc *proc);
+
+/* One instance per online CPU */
+#define REPLICAS_CPUS -1
+
+#ifndef CPUS_ONLINE
+#define CPUS_ONLINE "/sys/devices/system/cpu/online"
+#endif
+
+#ifndef WATCHDOG_TICK_MS
+#define WATCHDOG_TICK_MS 100
+#endif
+
+/* A watched process; its heartbeats are writes to its own eventfd */
+struct watchdog_entry {
+	pid_t pid; /* of the peer that sent the eventfd */
+	int fd; /* the eventfd */
+	int pidfd; /* not to kill a reused pid */
+	uint32_t timeout; /* ms */
+	uint64_t deadline; /* ms */
+};
+
+struct watchdog {
+	struct watchdog_entry *entries;
+	int nentries;
+	int tfd; /* ticks while a process is watched */
+	int ticking;
+};
+
+static struct watchdog watchdog = { .tfd = -1 };
+static int watchdog_open(void);
+static void watchdog_arm(int tick);
+static void watchdog_tick(void);
+static int watchdog_add(pid_t pid, int fd, uint32_t timeout);
+static void watchdog_release(pid_t pid);
+static void watchdog_keep(void);
+static int watchdog_claim(int timeout);
+static int control_send(const char *buf, int fd, int reply);
+
+#define STANDBY_FILENO 3
+
+/* Pre-started instances, blocked on a socket of pid 1 until promoted */
+struct standby {
+	uint64_t hash; /* of the args of the service */
+	int instance; /* of the replica */
+	pid_t pid;
+	int fd; /* written to promote it */
+};
+
+static struct standby *standbys;
+static int nstandbys;
+static int standby_add(uint64_t hash, int instance, pid_t pid, int fd);
+static void standby_remove(pid_t pid);
+static int standby_promote(struct proc *proc);
+
+#ifndef FDSTORE_MAX
+#define FDSTORE_MAX 16 /* per process */
+#endif
+
+#define FDSTORE_FILENO (STANDBY_FILENO + 1)
+
+/* Descriptors kept for the next instance of a process */
+struct fdstore {
+	pid_t pid; /* of the instance they belong to */
+	uid_t uid; /* of the sender */
+	char name[32];
+	int fd;
+};
+
+static struct fdstore *fdstores;
+static int nfdstores;
+static int fdstore_add(pid_t pid, uid_t uid, const char *name, int fd);
+static void fdstore_move(pid_t from, pid_t to);
+static void fdstore_remove(pid_t pid);
+static int fdstore_dup(pid_t pid, int fds[], const char *names[]);
+static void fdstore_keep(void);
+static void fdstore_resume(void);
+static pid_t fdstore_owner(pid_t pid);
+static int fdstore_permitted(pid_t pid, uid_t uid);
+static int fdstore_name(const char *name);
+
+/* Set by switch-root, for pid 1 to move there as it re-executes */
+static char newroot[PATH_MAX];
+static int switch_root(const char *path, const char *init);
+static int switch_root_check(const char *path, const char *init,
+			     unsigned int *skipped, unsigned int *copied);
+
+/* Windows in multiples of 2s, as required without CAP_SYS_RESOURCE */
+#ifndef PSI_MEMORY_TRIGGER
+#define PSI_MEMORY_TRIGGER "some 200000 2000000"
+#endif
+
+#ifndef PSI_CPU_TRIGGER
+#define PSI_CPU_TRIGGER "some 1000000 2000000"
+#endif
+
+#ifndef PSI_IO_TRIGGER
+#define PSI_IO_TRIGGER "some 600000 2000000"
+#endif
+
+#ifndef UEVENT_HANDLERS_UNDER_PRESSURE
+#define UEVENT_HANDLERS_UNDER_PRESSURE 1
+#endif
+
+struct psi {
+	const char *path;
+	const char *trigger;
+	int fd;
+};
+
+static struct psi psis[] = {
+	{ "/proc/pressure/memory", PSI_MEMORY_TRIGGER, -1 },
+	{ "/proc/pressure/cpu",    PSI_CPU_TRIGGER,    -1 },
+	{ "/proc/pressure/io",     PSI_IO_TRIGGER,     -1 },
+};
+
+static int psi_tfd = -1;
+static long psi_hold; /* ms without a trigger to release the pressure */
+static int pressure;
+static int psi_freeze;
+static struct proc *deferred;
+static int ndeferred;
+static pid_t *runners; /* of the uevent handlers */
+static int nrunners;
+static int nl_throttled;
+static int psi_open(void);
+static int psi_lookup(int fd);
+static void psi_hold_arm(void);
+static void psi_trigger(void);
+static void psi_release(void);
+static int netlink_throttle(void);
+static int proc_undefer(const char *path, struct dirent *entry, void *data);
+static void proc_release(void);
+
+#ifndef READAHEAD_LIST
+#define READAHEAD_LIST "/var/lib/tini/readahead"
+#endif
+
+#ifndef READAHEAD_SECONDS
+#define READAHEAD_SECONDS 30
+#endif
+
+static pid_t readahead_start(const char *list, int seconds);
 
 struct options_t {
 	int argc;
 	char * const *argv;
 	int re_exec;
+	int subreaper;
+	int freeze;
+	int readahead;
+	const char *capture;
+	const char *replay;
+	double speed;
+	int replay_setup;
+	const char *modules;
+	long coalesce;
 };
 
 static inline const char *applet(const char *arg0)
@@ -206,14 +898,41 @@ static void usage(FILE * f, char * const arg0)
 	const char *name = applet(arg0);
 	fprintf(f, "Usage: %s [OPTIONS]\n"
 		   "       %s halt|poweroff|reboot|re-exec\n"
-		   "       %s spawn|zombize COMMAND [ARGUMENT...]\n\n"
+		   "       %s reboot --kexec [KERNEL [INITRD [CMDLINE]]]\n"
+		   "       %s spawn|zombize COMMAND [ARGUMENT...]\n"
+		   "       %s status [--rusage] [PID|COMMAND [ARGUMENT...]]\n"
+		   "       %s raise EVENT start|stop\n"
+		   "       %s monitor [SUBSYSTEM[/DEVTYPE]...]\n"
+		   "       %s modalias [--modules DIR] MODALIAS...\n"
+		   "       %s settle [--timeout SECONDS]\n"
+		   "       %s mountall [FSTAB]\n"
+		   "       %s heartbeat\n"
+		   "       %s fdstore NAME [FD|-]\n"
+		   "       %s switch-root NEWROOT\n"
+		   "       %s --subreaper COMMAND [ARGUMENT...]\n\n"
 		   "Options:\n"
 		   "       --re-exec        Re-execute.\n"
+		   " -s or --subreaper      Run COMMAND as a child subreaper.\n"
+		   "       --freeze         Stop the low priority services under"
+					  " pressure.\n"
+		   "       --readahead[=SECONDS]\n"
+		   "                        Replay the boot readahead list, or"
+					  " record it.\n"
+		   "       --capture[=FILE] Record the uevents.\n"
+		   "       --replay=FILE    Replay the recorded uevents instead.\n"
+		   "       --replay-speed=FACTOR\n"
+		   "                        Replay faster, or at once if 0.\n"
+		   "       --replay-setup   Set the devices up and load the"
+					  " modules too.\n"
+		   "       --modules=DIR    Load the modules of DIR instead.\n"
+		   "       --coalesce=MS    Hold the uevents MS milliseconds, or"
+					  " not if 0.\n"
 		   " -v or --verbose        Turn on verbose messages.\n"
 		   " -D or --debug          Turn on debug messages.\n"
 		   " -V or --version        Display the version.\n"
 		   " -h or --help           Display this message.\n"
-		   "", name, name, name);
+		   "", name, name, name, name, name, name, name, name, name,
+		   name, name, name, name, name);
 }
 
 static int zombize(const char *path, char * const argv[], const char *devname)
@@ -225,8 +944,10 @@ static int zombize(const char *path, char * const argv[], const char *devname)
 	}
 
 	/* Parent */
-	if (pid > 0)
+	if (pid > 0) {
+		PROBE2(fork, pid, path);
 		return 0;
+	}
 
 	(void)netlink_close(nl_fd);
 
@@ -246,6 +967,7 @@ static int zombize(const char *path, char * const argv[], const char *devname)
 		chdir_or_exit("/");
 	}
 
+	PROBE2(exec, getpid(), path);
 	(void)execv(path, argv);
 	perror("execv");
 	_exit(127);
@@ -264,6 +986,7 @@ static int spawn(const char *path, char * const argv[], char * const envp[],
 	if (pid > 0) {
 		int status;
 
+		PROBE2(fork, pid, path);
 		if (waitpid(pid, &status, 0) == -1) {
 			perror("waitpid");
 			return -1;
@@ -304,17 +1027,127 @@ static int spawn(const char *path, char * const argv[], char * const envp[],
 		chdir_or_exit("/");
 	}
 
+	PROBE2(exec, getpid(), path);
 	(void)execvpe(path, argv, envp);
 	perror("execvpe");
 	_exit(127);
 }
 
-static int respawn(const char *path, char * const argv[], struct proc *proc)
+static pid_t subreap(const char *path, char * const argv[])
+{
+	sigset_t sigset;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+
+	/* Parent, as well: the signals are forwarded to the group at once */
+	if (pid > 0) {
+		if (setpgid(pid, pid) == -1 && errno != EACCES)
+			perror("setpgid");
+		return pid;
+	}
+
+	/* Child */
+	if (setpgid(0, 0) == -1)
+		perror("setpgid");
+
+	/* Take the terminal over, if any, as the foreground process group */
+	if (isatty(STDIN_FILENO)) {
+		(void)signal(SIGTTOU, SIG_IGN);
+		if (tcsetpgrp(STDIN_FILENO, getpgrp()) == -1)
+			perror("tcsetpgrp");
+		(void)signal(SIGTTOU, SIG_DFL);
+	}
+
+	if (sigemptyset(&sigset) == -1)
+		perror("sigemptyset");
+	else if (sigprocmask(SIG_SETMASK, &sigset, NULL) == -1)
+		perror("sigprocmask");
+
+	(void)execvp(path, argv);
+	perror("execvp");
+	_exit(127);
+}
+
+static int pidfile_write(FILE *f, const struct proc *proc)
+{
+	fprintf(f, "ARGC=%i\n", proc->argc);
+	fprintf(f, "ARGSIZE=%zu\n", proc->argssize);
+	fprintf(f, "ENVC=%i\n", proc->envc);
+	fprintf(f, "ENVSIZE=%zu\n", proc->envssize);
+	fprintf(f, "HASH=%016" PRIx64 "\n", proc->hash);
+	fprintf(f, "STDIN=%s\n", proc->dev_stdin);
+	fprintf(f, "STDOUT=%s\n", proc->dev_stdout);
+	fprintf(f, "STDERR=%s\n", proc->dev_stderr);
+	fprintf(f, "PID=%i\n", (int)proc->pid);
+	fprintf(f, "COUNTER=%i\n", proc->counter);
+	if (proc->oldstatus != -1)
+		fprintf(f, "OLDSTATUS=%i\n", proc->oldstatus);
+	if (proc->oldpid != -1)
+		fprintf(f, "OLDPID=%i\n", (int)proc->oldpid);
+	if (proc->uid != 0)
+		fprintf(f, "UID=%i\n", (int)proc->uid);
+	if (proc->gid != 0)
+		fprintf(f, "GID=%i\n", (int)proc->gid);
+	if (proc->lowprio != 0)
+		fprintf(f, "PRIORITY=low\n");
+	if (proc->deferred != 0)
+		fprintf(f, "DEFERRED=1\n");
+	if (proc->replicas == REPLICAS_CPUS)
+		fprintf(f, "REPLICAS=cpus\n");
+	else if (proc->replicas != 0)
+		fprintf(f, "REPLICAS=%i\n", proc->replicas);
+	if (proc->replicas != 0) {
+		fprintf(f, "INSTANCE=%i\n", proc->instance);
+		fprintf(f, "CPU=%i\n", proc->cpu);
+	}
+	if (proc->watchdog != 0)
+		fprintf(f, "WATCHDOG=%i\n", proc->watchdog);
+	if (proc->standby != 0)
+		fprintf(f, "STANDBY=1\n");
+	if (proc->waiting != 0)
+		fprintf(f, "WAITING=1\n");
+	fprintf(f, "STARTED=%lli\n", (long long)proc->started);
+	fprintf(f, "SPAWNED=%lli\n", (long long)proc->spawned);
+	fprintf(f, "UTIME=%" PRIu64 "\n", proc->utime);
+	fprintf(f, "STIME=%" PRIu64 "\n", proc->stime);
+	fprintf(f, "MAXRSS=%li\n", proc->maxrss);
+	fprintf(f, "MAJFLT=%li\n", proc->majflt);
+	fprintf(f, "NVCSW=%li\n", proc->nvcsw);
+	fprintf(f, "NIVCSW=%li\n", proc->nivcsw);
+
+	/* An empty line ends the variables; args and envs follow as is */
+	fprintf(f, "\n");
+	if (fwrite(proc->args, 1, proc->argssize, f) != proc->argssize ||
+	    fwrite(proc->envs, 1, proc->envssize, f) != proc->envssize) {
+		perror("fwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int respawn(struct proc *proc)
 {
+	char *argv[proc->argc + 1]; /* NULL terminated */
+	char *envp[proc->envc + 4 + FDSTORE_MAX]; /* INSTANCE, WATCHDOG_FD,
+						     STANDBY_FD, FDSTORE_*,
+						     NULL terminated */
+	char instance[sizeof("INSTANCE=") + 11];
+	char wdfd[sizeof("WATCHDOG_FD=") + 11];
+	char sbfd[sizeof("STANDBY_FD=") + 11];
+	char stored[FDSTORE_MAX][sizeof("FDSTORE_=") +
+				 sizeof(((struct fdstore *)0)->name) + 11];
+	const char *names[FDSTORE_MAX];
+	int fds[FDSTORE_MAX], nfds, i;
 	char pidfile[PATH_MAX];
+	int fd[2], sv[2] = { -1, -1 }, n, wd;
 	pid_t pid;
 	ssize_t s;
-	int fd[2];
 	FILE *f;
 
 	if (pipe(fd) == -1) {
@@ -322,11 +1155,24 @@ static int respawn(const char *path, char * const argv[], struct proc *proc)
 		return -1;
 	}
 
+	/* Standby: pid 1 keeps the other end, to promote it */
+	if (proc->waiting &&
+	    socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		close_and_ignore_error(fd[0]);
+		close_and_ignore_error(fd[1]);
+		return -1;
+	}
+
 	pid = fork();
 	if (pid == -1) {
 		perror("fork");
 		close_and_ignore_error(fd[0]);
 		close_and_ignore_error(fd[1]);
+		if (sv[0] != -1) {
+			close_and_ignore_error(sv[0]);
+			close_and_ignore_error(sv[1]);
+		}
 		return -1;
 	}
 
@@ -334,6 +1180,7 @@ static int respawn(const char *path, char * const argv[], struct proc *proc)
 	if (pid > 0) {
 		int status;
 
+		PROBE2(fork, pid, proc->args);
 		close_and_ignore_error(fd[1]);
 		s = read(fd[0], &proc->pid, sizeof(proc->pid));
 		if (s == -1) {
@@ -341,11 +1188,31 @@ static int respawn(const char *path, char * const argv[], struct proc *proc)
 			proc->pid = -1;
 		}
 
+		if (sv[0] != -1) {
+			close_and_ignore_error(sv[1]);
+			if (proc->pid > 0)
+				(void)standby_add(proc->hash, proc->instance,
+						  proc->pid, sv[0]);
+			else
+				close_and_ignore_error(sv[0]);
+		}
+
+		/* The stored descriptors now belong to the new instance */
+		if (proc->pid > 0)
+			fdstore_move(proc->oldpid, proc->pid);
+
 		if (waitpid(pid, &status, 0) == -1) {
 			perror("waitpid");
 			return -1;
 		}
 
+		/*
+		 * The daemon is an orphan now, and only its reaper is allowed
+		 * to reap it; its pid cannot be reused before we open it.
+		 */
+		if (proc->pid > 0)
+			(void)pidfd_watch(proc->pid);
+
 		if (WIFEXITED(status) != 0)
 			status = WEXITSTATUS(status);
 		else if (WIFSIGNALED(status) != 0)
@@ -358,6 +1225,8 @@ static int respawn(const char *path, char * const argv[], struct proc *proc)
 	}
 
 	close_and_ignore_error(fd[0]);
+	if (sv[0] != -1)
+		close_and_ignore_error(sv[0]);
 	(void)netlink_close(nl_fd);
 	proc->counter++;
 
@@ -378,31 +1247,14 @@ static int respawn(const char *path, char * const argv[], struct proc *proc)
 
 	close_and_ignore_error(fd[1]);
 	proc->pid = getpid();
+	proc->spawned = time(NULL);
+	if (proc->started == 0)
+		proc->started = proc->spawned;
 
-	/*
-	 * TODO: check for fprintf returned values
-	 *       serialize in a dedicated function
-	 */
 	(void)snprintf(pidfile, sizeof(pidfile), "/run/tini/%i", (int)getpid());
 	f = fopen(pidfile, "w");
 	if (f) {
-		if (!strargv(proc->exec, sizeof(proc->exec), path, argv))
-			perror("strargv");
-
-		fprintf(f, "EXEC=%s\n", proc->exec);
-		fprintf(f, "STDIN=%s\n", proc->dev_stdin);
-		fprintf(f, "STDOUT=%s\n", proc->dev_stdout);
-		fprintf(f, "STDERR=%s\n", proc->dev_stderr);
-		fprintf(f, "PID=%i\n", (int)proc->pid);
-		fprintf(f, "COUNTER=%i\n", proc->counter);
-		if (proc->oldstatus != -1)
-			fprintf(f, "OLDSTATUS=%i\n", proc->oldstatus);
-		if (proc->oldpid != -1)
-			fprintf(f, "OLDPID=%i\n", (int)proc->oldpid);
-		if (proc->uid != 0)
-			fprintf(f, "UID=%i\n", (int)proc->uid);
-		if (proc->gid != 0)
-			fprintf(f, "GID=%i\n", (int)proc->gid);
+		(void)pidfile_write(f, proc);
 
 		if (fclose(f) == -1)
 			perror("fclose");
@@ -421,8 +1273,36 @@ static int respawn(const char *path, char * const argv[], struct proc *proc)
 	close_or_exit(STDERR_FILENO);
 	(void)open_or_exit(proc->dev_stderr, O_WRONLY|O_NOCTTY);
 
+	/* Stored: duplicated out of the way first, as they may be anywhere */
+	nfds = fdstore_dup(proc->oldpid, fds, names);
+
+	/* Standby: its socket is the first descriptor after the standard ones */
+	if (sv[1] != -1) {
+		if (sv[1] == STANDBY_FILENO) {
+			if (fcntl(sv[1], F_SETFD, 0) == -1)
+				perror("fcntl");
+		} else if (dup2(sv[1], STANDBY_FILENO) == -1) {
+			perror("dup2");
+		} else {
+			close_and_ignore_error(sv[1]);
+		}
+	}
+
+	/* Stored: in turn after the socket of the standby */
+	for (i = 0; i < nfds; i++) {
+		if (dup2(fds[i], FDSTORE_FILENO + i) == -1)
+			perror("dup2");
+		close_and_ignore_error(fds[i]);
+	}
+
 	chdir_or_exit("/");
 
+	/* Watched: its eventfd is left open, as written by the heartbeats; a
+	 * standby does not beat, and gets one with the promotion */
+	wd = -1;
+	if (proc->watchdog > 0 && !proc->waiting)
+		wd = watchdog_claim(proc->watchdog);
+
 	/* Drop privileges */
 	if (proc->gid != 0)
 		if (setgid(proc->gid) == -1)
@@ -432,8 +1312,47 @@ static int respawn(const char *path, char * const argv[], struct proc *proc)
 		if (setuid(proc->uid) == -1)
 			perror("setuid");
 
-	(void)execv(path, argv);
-	perror("execv");
+	/* The args are the path, followed by argv */
+	(void)strntov(argv, proc->args, proc->argc);
+	(void)strntov(envp, proc->envs, proc->envc);
+	n = proc->envc;
+
+	/* Replica: pinned, and given its index */
+	if (proc->replicas != 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(proc->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == -1)
+			perror("sched_setaffinity");
+
+		(void)snprintf(instance, sizeof(instance), "INSTANCE=%i",
+			       proc->instance);
+		envp[n++] = instance;
+	}
+
+	if (wd != -1) {
+		(void)snprintf(wdfd, sizeof(wdfd), "WATCHDOG_FD=%i", wd);
+		envp[n++] = wdfd;
+	}
+
+	/* Standby: blocked on this socket until it reads the promotion */
+	if (sv[1] != -1) {
+		(void)snprintf(sbfd, sizeof(sbfd), "STANDBY_FD=%i",
+			       STANDBY_FILENO);
+		envp[n++] = sbfd;
+	}
+
+	for (i = 0; i < nfds; i++) {
+		(void)snprintf(stored[i], sizeof(stored[i]), "FDSTORE_%s=%i",
+			       names[i], FDSTORE_FILENO + i);
+		envp[n++] = stored[i];
+	}
+	envp[n] = NULL;
+
+	PROBE2(exec, getpid(), argv[0]);
+	(void)execve(argv[0], &argv[1], envp);
+	perror("execve");
 	_exit(127);
 }
 
@@ -441,18 +1360,30 @@ static int parse_arguments(struct options_t *opts, int argc,
 			   char * const argv[])
 {
 	static const struct option long_options[] = {
-		{ "re-exec", no_argument,       NULL, 1   },
-		{ "verbose", no_argument,       NULL, 'v' },
-		{ "debug",   no_argument,       NULL, 'D' },
-		{ "version", no_argument,       NULL, 'V' },
-		{ "help",    no_argument,       NULL, 'h' },
-		{ NULL,      no_argument,       NULL, 0   }
+		{ "re-exec",   no_argument,     NULL, 1   },
+		{ "subreaper", no_argument,     NULL, 's' },
+		{ "freeze",    no_argument,     NULL, 2   },
+		{ "readahead", optional_argument, NULL, 3 },
+		{ "capture",   optional_argument, NULL, 4 },
+		{ "replay",    required_argument, NULL, 5 },
+		{ "replay-speed", required_argument, NULL, 6 },
+		{ "modules",   required_argument, NULL, 7 },
+		{ "coalesce",  required_argument, NULL, 8 },
+		{ "replay-setup", no_argument,  NULL, 9   },
+		{ "verbose",   no_argument,     NULL, 'v' },
+		{ "debug",     no_argument,     NULL, 'D' },
+		{ "version",   no_argument,     NULL, 'V' },
+		{ "help",      no_argument,     NULL, 'h' },
+		{ NULL,        no_argument,     NULL, 0   }
 	};
 
+	opts->speed = 1;
+	opts->coalesce = UEVENT_COALESCE_MS;
 	opterr = 0;
 	for (;;) {
 		int index;
-		int c = getopt_long(argc, argv, "vDVh", long_options, &index);
+		int c = getopt_long(argc, argv, "+svDVh", long_options,
+				    &index);
 		if (c == -1)
 			break;
 
@@ -461,7 +1392,47 @@ static int parse_arguments(struct options_t *opts, int argc,
 			opts->re_exec = 1;
 			break;
 
-		case 'v':
+		case 's':
+			opts->subreaper = 1;
+			break;
+
+		case 2:
+			opts->freeze = 1;
+			break;
+
+		case 3:
+			opts->readahead = READAHEAD_SECONDS;
+			if (optarg)
+				opts->readahead = strtol(optarg, NULL, 0);
+			break;
+
+		case 4:
+			opts->capture = UEVENT_CAPTURE;
+			if (optarg)
+				opts->capture = optarg;
+			break;
+
+		case 5:
+			opts->replay = optarg;
+			break;
+
+		case 6:
+			opts->speed = strtod(optarg, NULL);
+			break;
+
+		case 7:
+			opts->modules = optarg;
+			break;
+
+		case 8:
+			opts->coalesce = strtol(optarg, NULL, 0);
+			break;
+
+		case 9:
+			opts->replay_setup = 1;
+			break;
+
+		case 'v':
 			VERBOSE++;
 			break;
 
@@ -558,36 +1529,60 @@ static int uevent_parse_line(char *line,
 	return 1;
 }
 
-static int setup_signal(int fd, int signal)
+static int epoll_watch(int fd)
+{
+	return epoll_watch_events(fd, EPOLLIN);
+}
+
+static int epoll_watch_events(int fd, uint32_t events)
 {
-	int flags;
+	struct epoll_event event;
 
-	if (fcntl(fd, F_SETSIG, signal) == -1) {
-		perror("fcntl");
+	(void)memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = fd;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		perror("epoll_ctl");
 		return -1;
 	}
 
-	if (fcntl(fd, F_SETOWN, getpid()) == -1) {
-		perror("fcntl");
+	return 0;
+}
+
+static int pidfd_watch(pid_t pid)
+{
+	int fd;
+
+	/* Not the reaper */
+	if (epfd == -1)
 		return -1;
-	}
 
-	flags = fcntl(fd, F_GETFL);
-	if (flags == -1) {
-		perror("fcntl");
+	fd = __pidfd_open(pid, 0);
+	if (fd == -1) {
+		/* Let SIGCHLD reap it */
+		if (errno != ENOSYS)
+			perror("pidfd_open");
 		return -1;
 	}
 
-	flags |= (O_ASYNC | O_NONBLOCK | O_CLOEXEC);
-	if (fcntl(fd, F_SETFL, flags) == -1) {
-		perror("fcntl");
+	if (epoll_watch(fd) == -1) {
+		close_and_ignore_error(fd);
 		return -1;
 	}
 
-	return 0;
+	return fd;
+}
+
+static void pidfd_unwatch(int fd)
+{
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+		perror("epoll_ctl");
+
+	close_and_ignore_error(fd);
 }
 
-static int netlink_open(struct sockaddr_nl *addr, int signal)
+static int netlink_open(struct sockaddr_nl *addr)
 {
 	int fd;
 
@@ -596,7 +1591,8 @@ static int netlink_open(struct sockaddr_nl *addr, int signal)
 	addr->nl_pid = getpid();
 	addr->nl_groups = NETLINK_KOBJECT_UEVENT;
 
-	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_KOBJECT_UEVENT);
+	fd = socket(AF_NETLINK, SOCK_RAW|SOCK_NONBLOCK|SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
 	if (fd == -1) {
 		perror("socket");
 		return -1;
@@ -607,11 +1603,6 @@ static int netlink_open(struct sockaddr_nl *addr, int signal)
 		goto error;
 	}
 
-	if (setup_signal(fd, signal) == -1) {
-		close_and_ignore_error(fd);
-		goto error;
-	}
-
 	nl_fd = fd;
 	return fd;
 
@@ -624,6 +1615,9 @@ static int netlink_close(int fd)
 {
 	int ret;
 
+	if (fd == -1)
+		return 0;
+
 	ret = close(fd);
 	if (ret == -1)
 		perror("close");
@@ -637,7 +1631,7 @@ static ssize_t netlink_recv(int fd, struct sockaddr_nl *addr)
 	char buf[UEVENT_BUFFER_SIZE];
 	struct iovec iov = {
 		.iov_base = buf,
-		.iov_len = sizeof(buf),
+		.iov_len = sizeof(buf) - 1, /* NUL terminated */
 	};
 	struct msghdr msg = {
 		.msg_name = addr,
@@ -651,12 +1645,20 @@ static ssize_t netlink_recv(int fd, struct sockaddr_nl *addr)
 	ssize_t len = 0;
 
 	for (;;) {
-		int nenvp = 0;
-		char *n, *s;
 		ssize_t l;
 
+		/* Full: left queued until released, or overrun (ENOBUFS) */
+		if (nheld >= UEVENT_HELD_MAX) {
+			netlink_pause(fd);
+			break;
+		}
+
 		l = recvmsg(fd, &msg, 0);
 		if (l == -1) {
+			/* The overrun uevents are lost; not to be waited */
+			if (errno == ENOBUFS)
+				seqnum_received = kernel_seqnum(seqnum_received);
+
 			if (errno != EAGAIN) {
 				perror("recvmsg");
 				break;
@@ -667,574 +1669,7187 @@ static ssize_t netlink_recv(int fd, struct sockaddr_nl *addr)
 			break;
 		}
 
+		/*
+		 * From the kernel only: anyone can send to the port of pid 1,
+		 * and pid 1 would set the device up and load its modules.
+		 */
+		if (addr->nl_pid != 0 && !UEVENT_UNTRUSTED) {
+			verbose("uevent: Not from the kernel (port %u)!\n",
+				addr->nl_pid);
+			continue;
+		}
+
 		buf[l] = '\0';
-		s = buf;
+		len += l;
 
-		for (;;) {
-			n = strchr(s, '\0');
-			if (!n || n == s)
-				break;
+		uevent_capture(buf, l);
+		uevent_receive(buf, l);
+	}
 
-			nenvp++;
-			s = n + 1;
-		}
+	uevent_settle();
+	return len;
+}
 
-		s = buf;
-		s += strlen(s) + 1;
+/* The socket is level-triggered: not watched while the held are full */
+static void netlink_pause(int fd)
+{
+	if (nl_paused)
+		return;
 
-		if (nenvp > 0) {
-			char * const argv[] = {
-				"/lib/tini/uevent/script",
-				buf,
-				NULL
-			};
-			char *envp[nenvp+1]; /* NULL terminated */
-			char **env = envp;
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+		perror("epoll_ctl");
+		return;
+	}
 
-			for (;;) {
-				n = strchr(s, '\0');
-				if (!n || n == s)
-					break;
+	nl_paused = 1;
+	verbose("uevents: %i held, not received anymore!\n", nheld);
+}
 
-				if (uevent_parse_line(s, uevent_event,
-						     uevent_variable, env) != 0)
-					break;
+static void netlink_unpause(int fd)
+{
+	if (!nl_paused || fd == -1 || nheld >= UEVENT_HELD_MAX)
+		return;
 
-				env++;
-				s = n + 1;
-			}
+	if (epoll_watch(fd) == -1)
+		return;
 
-			*env = NULL;
-			len += l;
+	nl_paused = 0;
+	debug("uevents: received again\n");
+}
 
-			if (spawn(argv[0], argv, envp, NULL) != EXIT_SUCCESS)
-				perror("spawn");
-		}
-	}
+/* From the kernel, or from a capture */
+static void uevent_receive(char *buf, ssize_t len)
+{
+	uint64_t n;
 
-	return len;
+	n = uevent_seqnum(buf, len);
+	if (n > seqnum_received)
+		seqnum_received = n;
+	PROBE2(uevent_receive, n, buf);
+
+	/* Held a while, merged or cancelled */
+	if (uevent_coalesce(buf, len))
+		return;
+
+	uevent_dispatch(buf, len);
 }
 
-static int variable_parse_line(char *line, variable_cb_t *callback, void *data)
+static uint64_t boottime_us(void)
 {
-	char *equal;
+	struct timespec ts;
 
-	/* empty line? */
-	if (*line == '\0')
+	if (clock_gettime(CLOCK_BOOTTIME, &ts) == -1)
 		return 0;
 
-	/* variable? */
-	equal = strchr(line, '=');
-	if (equal) {
-		char *variable, *value;
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-		variable = line;
-		value = equal + 1;
-		*equal = '\0';
+static int uevent_capture_open(const char *path)
+{
+	struct capture_header header;
 
-		if (!callback)
-			return 0;
+	cap_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0644);
+	if (cap_fd == -1) {
+		fprintf(stderr, "%s: open: %s\n", path, strerror(errno));
+		return -1;
+	}
 
-		return callback(variable, value, data);
+	(void)memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = CAPTURE_VERSION;
+	if (write(cap_fd, &header, sizeof(header)) != sizeof(header)) {
+		fprintf(stderr, "%s: write: %s\n", path, strerror(errno));
+		close_and_ignore_error(cap_fd);
+		cap_fd = -1;
+		return -1;
 	}
 
-	fprintf(stderr, "malformated variable: \"%s\"."
-			" Must be variable=value!\n", line);
-	return 1;
+	cap_size = sizeof(header);
+	return 0;
 }
 
-static ssize_t variable_read(int fd, variable_cb_t cb, void *data)
+/* A record per message, as received; stops at the first error, or once full */
+static void uevent_capture(const char *buf, ssize_t len)
 {
-	char buf[BUFSIZ];
-	ssize_t len = 0;
+	struct capture_record r;
+	struct iovec iov[2];
 
-	for (;;) {
-		char *n, *s;
-		ssize_t l;
+	if (cap_fd == -1)
+		return;
 
-		l = read(fd, buf, sizeof(buf));
-		if (l == -1)
-			perror("read");
-		else if (l == 0)
+	if (cap_size + sizeof(r) + len > CAPTURE_SIZE_MAX) {
+		fprintf(stderr, "capture: Full!\n");
+		close_and_ignore_error(cap_fd);
+		cap_fd = -1;
+		return;
+	}
+
+	(void)memset(&r, 0, sizeof(r));
+	r.usec = boottime_us();
+	r.len = len;
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	if (writev(cap_fd, iov, 2) != (ssize_t)(sizeof(r) + len)) {
+		perror("writev");
+		close_and_ignore_error(cap_fd);
+		cap_fd = -1;
+		return;
+	}
+
+	cap_size += sizeof(r) + len;
+}
+
+static uint64_t uevent_seqnum(const char *buf, ssize_t len)
+{
+	const char *s;
+
+	for (s = buf; s < &buf[len]; s += strlen(s) + 1)
+		if (__strncmp(s, "SEQNUM=") == 0)
+			return strtoull(s + 7, NULL, 10);
+
+	return 0;
+}
+
+/* The last uevent sent by the kernel */
+static uint64_t kernel_seqnum(uint64_t undef)
+{
+	char buf[32];
+	ssize_t l;
+	int fd;
+
+	fd = open(UEVENT_SEQNUM, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return undef;
+
+	l = read(fd, buf, sizeof(buf) - 1);
+	close_and_ignore_error(fd);
+	if (l <= 0)
+		return undef;
+	buf[l] = '\0';
+
+	return strtoull(buf, NULL, 10);
+}
+
+
+static void uevent_dispatch(char *buf, ssize_t l)
+{
+	struct uevent uevent;
+	int nenvp = 0;
+	char *n, *s;
+
+	s = buf;
+
+	for (;;) {
+		n = strchr(s, '\0');
+		if (!n || n == s)
 			break;
 
-		buf[l] = '\0';
-		s = buf;
+		nenvp++;
+		s = n + 1;
+	}
+
+	s = buf;
+	s += strlen(s) + 1;
+
+	if (nenvp > 0) {
+		char * const argv[] = {
+			"/lib/tini/uevent/script",
+			buf,
+			NULL
+		};
+		char *envp[nenvp+1]; /* NULL terminated */
+		char **env = envp;
 
 		for (;;) {
-			n = strchr(s, '\n');
+			n = strchr(s, '\0');
 			if (!n || n == s)
 				break;
 
-			*n = '\0';
-			if (variable_parse_line(s, cb, data) != 0)
+			if (uevent_parse_line(s, uevent_event,
+					     uevent_variable, env) != 0)
 				break;
 
+			env++;
 			s = n + 1;
 		}
 
-		len += l;
-	}
+		*env = NULL;
 
-	return len;
+		uevent_fields(&uevent, envp);
+		PROBE2(uevent_dispatch, uevent.seqnum, uevent.devpath);
+
+		/* Replayed: not to act on the devices of the capture */
+		if (nrules > 0 && *uevent.devname && !replay_dry)
+			(void)device_setup(&uevent);
+
+		if (*uevent.modalias && !replay_dry &&
+		    strcmp(uevent.action, "add") == 0 &&
+		    modules_open(&modules) == 0)
+			(void)modalias_load(&modules, uevent.modalias);
+
+		if (strcmp(uevent.subsystem, "cpu") == 0 && !replay_dry)
+			(void)replicas_hotplug(&uevent);
+
+		(void)uevent_handlers(&uevent, envp);
+
+		/* Streamed to the daemon if any, rather than a script each */
+		if (udaemon_send(envp) == -1 && access(argv[0], X_OK) == 0)
+			(void)uevent_script(argv, envp);
+
+		if (nsubscribers > 0)
+			uevent_broadcast(buf, l, uevent.subsystem,
+					 uevent.devtype);
+	}
 }
 
-static int pidfile_info(char *variable, char *value, void *data)
+enum {
+	UEVENT_OTHER,
+	UEVENT_ADD,
+	UEVENT_CHANGE,
+	UEVENT_REMOVE,
+};
+
+struct held {
+	struct held *next, *prev; /* in the order of release */
+	struct held *bucket; /* the last held of another DEVPATH */
+	struct held *before; /* the held of the same DEVPATH, if any */
+	char *buf; /* the message, as received */
+	ssize_t len;
+	const char *devpath; /* in buf */
+	int action;
+	uint64_t deadline; /* ms */
+};
+
+/* The last held of every DEVPATH, hashed */
+#define HELD_BUCKETS 1024
+
+static struct held *held_first, *held_tail;
+static struct held *held_buckets[HELD_BUCKETS];
+
+static uint64_t now_ms(void)
 {
-	struct proc *proc = (struct proc *)data;
+	struct timespec ts;
 
-	if (strcmp(variable, "EXEC") == 0)
-		strncpy(proc->exec, value, PATH_MAX);
-	else if (strcmp(variable, "STDIN") == 0)
-		proc->dev_stdin = value;
-	else if (strcmp(variable, "STDOUT") == 0)
-		proc->dev_stdout = value;
-	else if (strcmp(variable, "STDERR") == 0)
-		proc->dev_stderr = value;
-	else if (strcmp(variable, "PID") == 0)
-		proc->pid = strtol(value, NULL, 0);
-	else if (strcmp(variable, "COUNTER") == 0)
-		proc->counter = strtol(value, NULL, 0);
-	else if (strcmp(variable, "OLDSTATUS") == 0)
-		proc->oldstatus = strtol(value, NULL, 0);
-	else if (strcmp(variable, "OLDPID") == 0)
-		proc->oldpid = strtol(value, NULL, 0);
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
 
-	return 0;
+	return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
 }
 
-static int pidfile_parse(const char *pidfile, variable_cb_t *callback,
-			 void *data)
+static uint64_t now_ns(void)
 {
-	struct stat statbuf;
-	int fd, ret;
+	struct timespec ts;
 
-	if (stat(pidfile, &statbuf) == -1) {
-		perror("stat");
-		return -1;
-	}
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
 
-	if (S_ISDIR(statbuf.st_mode))
-		return -1;
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	fd = open(pidfile, O_RDONLY);
-	if (fd == -1) {
-		perror("open");
+/* Also holds the uevents back while throttled, coalesced or not */
+static int uevent_coalesce_open(void)
+{
+	co_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (co_tfd == -1) {
+		perror("timerfd_create");
 		return -1;
 	}
 
-	ret = variable_read(fd, callback, data);
-
-	if (close(fd) == -1)
-		perror("close");
+	if (epoll_watch(co_tfd) == -1) {
+		close_and_ignore_error(co_tfd);
+		co_tfd = -1;
+		return -1;
+	}
 
-	return ret;
+	return 0;
 }
 
-static int pid_respawn(pid_t pid, int status)
+/* Expires at the first deadline, or never if nothing is held */
+static void held_arm(uint64_t retry)
 {
-	struct proc proc;
-	char pidfile[PATH_MAX];
-	struct stat statbuf;
-	int ret;
+	struct itimerspec its;
+	uint64_t deadline = retry;
 
-	/* command not found */
-	if (status == 127)
-		return 1;
+	if (held_first && (deadline == 0 || held_first->deadline < deadline))
+		deadline = held_first->deadline;
 
-	(void)snprintf(pidfile, sizeof(pidfile), "/run/tini/%i", (int)pid);
-	if (stat(pidfile, &statbuf) == -1)
-		return 1;
+	(void)memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / 1000;
+	its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+	if (timerfd_settime(co_tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		perror("timerfd_settime");
+}
 
-	(void)memset(&proc, 0, sizeof(proc));
-	proc.oldstatus = -1;
-	proc.pid = -1;
-	proc.oldpid = -1;
-	ret = pidfile_parse(pidfile, pidfile_info, &proc);
+static int uevent_action(const char *buf)
+{
+	if (__strncmp(buf, "add@") == 0)
+		return UEVENT_ADD;
+	else if (__strncmp(buf, "change@") == 0)
+		return UEVENT_CHANGE;
+	else if (__strncmp(buf, "remove@") == 0)
+		return UEVENT_REMOVE;
+
+	return UEVENT_OTHER;
+}
 
-	/* overwrite values */
-	proc.oldstatus = status;
-	proc.oldpid = pid;
-	if (proc.exec[0] != '\0') {
-		char exec[BUFSIZ];
-		int argc = 127;
-
-		strncpy(exec, proc.exec, sizeof(exec));
-		(void)strtonargv(NULL, exec, &argc);
-		if (argc > 0) {
-			char *argv[argc];
-			if (!strtonargv(argv, exec, &argc)) {
-				perror("strtonargv");
-				return -1;
-			}
+/* The bucket slot of the last held of DEVPATH; NULL in it if none */
+static struct held **held_slot(const char *devpath)
+{
+	uint32_t hash = 2166136261U;
+	struct held **p;
+	const char *s;
 
-			ret = respawn(argv[0], &argv[1], &proc);
-		}
+	for (s = devpath; *s; s++) {
+		hash ^= (unsigned char)*s;
+		hash *= 16777619U;
 	}
-	if (unlink(pidfile) == -1)
-		perror("unlink");
 
-	return ret;
+	p = &held_buckets[hash % HELD_BUCKETS];
+	while (*p && strcmp((*p)->devpath, devpath) != 0)
+		p = &(*p)->bucket;
+
+	return p;
 }
 
-static char *strargv(char *buf, size_t bufsize, const char *path,
-		     char * const argv[])
+static struct held *held_last(const char *devpath)
 {
-	char * const *arg = argv;
-	int size = 0;
-
-	size = snprintf(&buf[size], size - bufsize, "%s %s", path, *arg++);
-	while (*arg)
-		size += snprintf(&buf[size], size - bufsize, " %s", *arg++);
-
-	return buf;
+	return *held_slot(devpath);
 }
 
-static char **strtonargv(char *dest[], char *src, int *n)
+/* A copy of the message, NUL terminated, with its DEVPATH */
+static int held_set(struct held *h, const char *buf, ssize_t len)
 {
-	char **arg = dest;
-	char *str = src;
-	char *s = NULL;
-	int i = 0;
+	char *b;
 
-	if (!n || *n < 0) {
-		errno = EINVAL;
-		return NULL;
+	b = malloc(len + 1);
+	if (!b) {
+		perror("malloc");
+		return -1;
 	}
+	(void)memcpy(b, buf, len);
+	b[len] = '\0';
+
+	free(h->buf);
+	h->buf = b;
+	h->len = len;
+	h->devpath = strchr(b, '@') + 1;
+	h->action = uevent_action(b);
+	return 0;
+}
 
-	for (;;) {
-		if (*n == 0)
-			break;
-
-		s = strchr(str, CFS[0]);
-		if (!s)
-			break;
+/* Holds the message after the given held, or last; as the last of DEVPATH */
+static int held_add(const char *buf, ssize_t len, uint64_t deadline,
+		    struct held *after)
+{
+	struct held **p, *h;
 
-		if (arg)
-			*s = '\0'; /* CFS[0] <- NUL */
-		s++; /* s = next cstring */
-		(*n)--;
-		i++;
-		if (arg)
-			*arg++ = str;
-		str = s;
+	h = calloc(1, sizeof(*h));
+	if (!h) {
+		perror("calloc");
+		return -1;
 	}
 
-	if (*str != '\0') {
-		i++;
-		if (arg)
-			*arg++ = str;
+	if (held_set(h, buf, len) == -1) {
+		free(h);
+		return -1;
 	}
+	h->deadline = deadline;
+
+	p = held_slot(h->devpath);
+	h->before = *p;
+	h->bucket = *p ? (*p)->bucket : NULL;
+	*p = h;
+
+	if (!after)
+		after = held_tail;
+	h->prev = after;
+	h->next = after ? after->next : held_first;
+	if (h->next)
+		h->next->prev = h;
+	else
+		held_tail = h;
+	if (after)
+		after->next = h;
+	else
+		held_first = h;
+	nheld++;
 
-	if (arg)
-		*arg = NULL;
-
-	*n = i;
-	return dest;
+	return 0;
 }
 
-static int pidfile_assassinate(const char *path, struct dirent *entry,
-			       void *data)
+/* Keeps the order of the others */
+static void held_drop(struct held *h)
 {
-	struct proc proc;
-	char pidfile[BUFSIZ];
+	struct held **p = held_slot(h->devpath), *f;
 
-	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+	if (*p == h) {
+		if (h->before)
+			h->before->bucket = h->bucket;
+		*p = h->before ? h->before : h->bucket;
+	} else {
+		for (f = *p; f && f->before != h; f = f->before);
+		if (f)
+			f->before = h->before;
+	}
 
-	(void)memset(&proc, 0, sizeof(proc));
-	proc.oldstatus = -1;
-	proc.pid = -1;
-	proc.oldpid = -1;
-	(void)pidfile_parse(pidfile, pidfile_info, &proc);
+	if (h->prev)
+		h->prev->next = h->next;
+	else
+		held_first = h->next;
+	if (h->next)
+		h->next->prev = h->prev;
+	else
+		held_tail = h->prev;
+	nheld--;
+
+	free(h->buf);
+	free(h);
+}
 
-	if (strcmp(proc.exec, (const char *)data) == 0) {
-		if (unlink(pidfile) == -1)
+/*
+ * Holds the uevents for a window, keyed on DEVPATH: a change following a
+ * change replaces it, in its place, as does a remove, a change following an
+ * add is held right behind the add, with its window, and an add followed by
+ * a remove cancels both, and the change in between if any. The uevents are
+ * held as well while throttled, or behind a held one of their device.
+ */
+static int uevent_coalesce(const char *buf, ssize_t len)
+{
+	uint64_t deadline = now_ms() + coalesce_ms;
+	const char *devpath = strchr(buf, '@');
+	int action = uevent_action(buf);
+	struct held *h, *after = NULL;
+
+	if (co_tfd == -1 || !devpath)
+		return 0;
+	devpath++;
+
+	h = held_last(devpath);
+	if (h && h->action == UEVENT_CHANGE && action == UEVENT_REMOVE &&
+	    h->before && h->before->action == UEVENT_ADD) {
+		debug("%s: add, change and remove cancelled\n", devpath);
+		held_drop(h->before);
+		held_drop(h);
+		held_arm(0);
+		return 1;
+	} else if (h && h->action == UEVENT_CHANGE &&
+		   (action == UEVENT_CHANGE || action == UEVENT_REMOVE)) {
+		debug("%s: change merged\n", devpath);
+		return held_set(h, buf, len) == 0;
+	} else if (h && h->action == UEVENT_ADD && action == UEVENT_REMOVE) {
+		debug("%s: add and remove cancelled\n", devpath);
+		held_drop(h);
+		held_arm(0);
+		return 1;
+	} else if (h && h->action == UEVENT_ADD && action == UEVENT_CHANGE) {
+		debug("%s: change held behind add\n", devpath);
+		deadline = h->deadline;
+		after = h;
+	} else if (coalesce_ms == 0 && !h && !netlink_throttle()) {
+		return 0;
+	}
+
+	if (held_add(buf, len, deadline, after) == -1)
+		return 0;
+
+	held_arm(0);
+	return 1;
+}
+
+/* Dispatches the uevents held for their whole window, in order */
+static void uevent_release(void)
+{
+	uint64_t expirations, now = now_ms();
+
+	if (read(co_tfd, &expirations, sizeof(expirations)) == -1 &&
+	    errno != EAGAIN)
+		perror("read");
+
+	while (held_first && held_first->deadline <= now) {
+		char *buf = held_first->buf;
+		ssize_t len = held_first->len;
+
+		/* Throttled; rearmed once a handler exits */
+		if (netlink_throttle())
+			return;
+
+		held_first->buf = NULL;
+		held_drop(held_first);
+		uevent_dispatch(buf, len);
+		free(buf);
+	}
+
+	held_arm(0);
+	netlink_unpause(nl_fd);
+	uevent_settle();
+}
+
+static void settle_arm(long ms)
+{
+	struct itimerspec its;
+
+	if (ms && settle_armed)
+		return;
+
+	if (st_tfd == -1) {
+		if (ms == 0)
+			return;
+
+		st_tfd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK|TFD_CLOEXEC);
+		if (st_tfd == -1) {
+			perror("timerfd_create");
+			settle_graced = 1;
+			return;
+		}
+
+		if (epoll_watch(st_tfd) == -1) {
+			close_and_ignore_error(st_tfd);
+			st_tfd = -1;
+			settle_graced = 1;
+			return;
+		}
+	}
+
+	(void)memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	if (timerfd_settime(st_tfd, 0, &its, NULL) == -1)
+		perror("timerfd_settime");
+	settle_armed = ms != 0;
+}
+
+/* The missing SEQNUMs are not for this namespace; settle on the received */
+static void uevent_settle_grace(void)
+{
+	uint64_t expirations;
+
+	if (read(st_tfd, &expirations, sizeof(expirations)) == -1) {
+		if (errno != EAGAIN)
+			perror("read");
+		return;
+	}
+
+	settle_armed = 0;
+	settle_graced = 1;
+	debug("settle: SEQNUM %" PRIu64 " of %" PRIu64 "\n", seqnum_handled,
+	      kernel_seqnum(seqnum_handled));
+	uevent_settle();
+}
+
+/*
+ * The uevents are handled once none is held, no handler runs anymore, and
+ * the kernel has sent none since the last received, or not in a grace
+ * period; the waiters are then told the last handled SEQNUM.
+ */
+static void uevent_settle(void)
+{
+	char buf[sizeof("SEQNUM=") + 20];
+	int i, l;
+
+	if (nheld > 0 || nrunners > 0 || udaemon.nsent > 0)
+		return;
+
+	seqnum_handled = seqnum_received;
+
+	/* The whole capture is handled; against tini/replay */
+	if (replay.size && replay.off == replay.size && !replay.handled) {
+		replay.handled = 1;
+		stage("tini/replayed");
+	}
+
+	for (i = 0; i < nsubscribers; i++)
+		if (subscribers[i].settle)
+			break;
+	if (i == nsubscribers)
+		return;
+
+	/* Replayed: the capture stands for the kernel */
+	if (replay.size && replay.off < replay.size)
+		return;
+
+	/*
+	 * The kernel counts the uevents of every network namespace, but sends
+	 * those of this one only: wait for the missing ones a while only.
+	 */
+	if (!replay.size && !settle_graced &&
+	    kernel_seqnum(seqnum_handled) > seqnum_handled) {
+		settle_arm(SETTLE_GRACE_MS);
+		return;
+	}
+
+	settle_arm(0);
+	settle_graced = 0;
+
+	l = snprintf(buf, sizeof(buf), "SEQNUM=%" PRIu64, seqnum_handled);
+	for (i = 0; i < nsubscribers; i++) {
+		struct subscriber *s = &subscribers[i];
+
+		if (!s->settle)
+			continue;
+
+		if (send(s->fd, buf, l, MSG_DONTWAIT|MSG_NOSIGNAL) == -1)
+			debug("%i: send: %s\n", s->fd, strerror(errno));
+		s->settle = 0;
+	}
+}
+
+/* Followed by the message */
+struct held_record {
+	uint64_t deadline; /* ms, on CLOCK_MONOTONIC */
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/*
+ * The held uevents are written to a memfd left open across the execution,
+ * with their windows; the next execution holds them again.
+ */
+static int held_keep(void)
+{
+	char buf[sizeof("-2147483648")];
+	struct held *h;
+	int fd;
+
+	if (nheld == 0)
+		return 0;
+
+	fd = __memfd_create("tini.held", 0);
+	if (fd == -1) {
+		perror("memfd_create");
+		return -1;
+	}
+
+	for (h = held_first; h; h = h->next) {
+		struct held_record r = {
+			.deadline = h->deadline,
+			.len = h->len,
+		};
+		struct iovec iov[2] = {
+			{ .iov_base = &r, .iov_len = sizeof(r) },
+			{ .iov_base = h->buf, .iov_len = h->len },
+		};
+
+		if (writev(fd, iov, 2) != (ssize_t)(sizeof(r) + r.len)) {
+			perror("writev");
+			goto error;
+		}
+	}
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		perror("lseek");
+		goto error;
+	}
+
+	(void)snprintf(buf, sizeof(buf), "%i", fd);
+	if (setenv("TINI_HELD", buf, 1) == -1) {
+		perror("setenv");
+		goto error;
+	}
+
+	while (held_tail)
+		held_drop(held_tail);
+
+	return 0;
+
+error:
+	close_and_ignore_error(fd);
+	return -1;
+}
+
+/* The uevents held by the previous execution, if any; in order */
+static void held_resume(void)
+{
+	char buf[UEVENT_BUFFER_SIZE];
+	struct held_record r;
+	int fd;
+
+	fd = strtol(__getenv("TINI_HELD", "-1"), NULL, 0);
+	__unsetenv("TINI_HELD");
+	if (fd < 0)
+		return;
+
+	while (read(fd, &r, sizeof(r)) == sizeof(r)) {
+		if (r.len == 0 || r.len >= sizeof(buf) ||
+		    read(fd, buf, r.len) != (ssize_t)r.len) {
+			fprintf(stderr, "%i: Invalid held uevent!\n", fd);
+			break;
+		}
+		buf[r.len] = '\0';
+
+		if (!strchr(buf, '@'))
+			continue;
+
+		/* Not to be held: dispatched at once */
+		if (co_tfd == -1 ||
+		    held_add(buf, r.len, r.deadline, NULL) == -1)
+			uevent_dispatch(buf, r.len);
+	}
+
+	close_and_ignore_error(fd);
+	if (co_tfd != -1)
+		held_arm(0);
+}
+
+/*
+ * Left open across the execution, with the held uevents kept as well: the
+ * uevents queued meanwhile are received after, and none is lost.
+ */
+static int netlink_keep(int fd)
+{
+	char buf[sizeof("11 ") + 20];
+
+	/* Or dispatched first, all of them, even while throttled */
+	if (held_keep() == -1) {
+		while (held_first) {
+			char *msg = held_first->buf;
+			ssize_t len = held_first->len;
+
+			held_first->buf = NULL;
+			held_drop(held_first);
+			uevent_dispatch(msg, len);
+			free(msg);
+		}
+	}
+
+	if (fcntl(fd, F_SETFD, 0) == -1) {
+		perror("fcntl");
+		return netlink_close(fd);
+	}
+
+	(void)snprintf(buf, sizeof(buf), "%i %" PRIu64, fd, seqnum_received);
+	if (setenv("TINI_NETLINK", buf, 1) == -1) {
+		perror("setenv");
+		return netlink_close(fd);
+	}
+
+	return 0;
+}
+
+/* The socket left open by the previous execution, if any */
+static int netlink_resume(struct sockaddr_nl *addr)
+{
+	uint64_t seqnum;
+	char *end;
+	int fd;
+
+	fd = strtol(__getenv("TINI_NETLINK", "-1"), &end, 0);
+	__unsetenv("TINI_NETLINK");
+	if (fd < 0)
+		return -1;
+	seqnum = strtoull(end, NULL, 0);
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		perror("fcntl");
+		return -1;
+	}
+
+	(void)memset(addr, 0, sizeof(*addr));
+	addr->nl_family = AF_NETLINK;
+	addr->nl_pid = getpid();
+	addr->nl_groups = NETLINK_KOBJECT_UEVENT;
+
+	seqnum_received = seqnum;
+	seqnum_handled = seqnum;
+	nl_fd = fd;
+	return fd;
+}
+
+static void replay_arm(uint64_t ns)
+{
+	struct itimerspec its;
+
+	(void)memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns / 1000000000ULL;
+	its.it_value.tv_nsec = ns % 1000000000ULL;
+	if (timerfd_settime(rp_tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		perror("timerfd_settime");
+}
+
+/* The records are as far apart as received, divided by the speed */
+static uint64_t replay_due(const struct capture_record *r)
+{
+	if (replay.speed <= 0 || r->usec < replay.first)
+		return replay.start;
+
+	return replay.start +
+	       (uint64_t)((r->usec - replay.first) * 1000 / replay.speed);
+}
+
+/* Feeds the records that are due through the pipeline, as netlink_recv */
+static void uevent_replay(void)
+{
+	uint64_t expirations, now = now_ns();
+	struct capture_record r;
+
+	if (read(rp_tfd, &expirations, sizeof(expirations)) == -1 &&
+	    errno != EAGAIN)
+		perror("read");
+
+	while (replay.off + sizeof(r) <= replay.size) {
+		char buf[UEVENT_BUFFER_SIZE];
+		uint64_t due;
+
+		memcpy(&r, &replay.addr[replay.off], sizeof(r));
+		due = replay_due(&r);
+		if (due > now) {
+			replay_arm(due);
+			return;
+		}
+
+		if (r.len >= sizeof(buf) ||
+		    replay.off + sizeof(r) + r.len > replay.size) {
+			fprintf(stderr, "replay: Truncated capture!\n");
+			break;
+		}
+
+		memcpy(buf, &replay.addr[replay.off + sizeof(r)], r.len);
+		buf[r.len] = '\0';
+		replay.off += sizeof(r) + r.len;
+		replay.n++;
+
+		uevent_receive(buf, r.len);
+	}
+
+	verbose("replay: %u uevents\n", replay.n);
+
+	/* Done; the size is kept for settle */
+	replay.off = replay.size;
+	(void)munmap(replay.addr, replay.size);
+	replay.addr = NULL;
+	(void)epoll_ctl(epfd, EPOLL_CTL_DEL, rp_tfd, NULL);
+	close_and_ignore_error(rp_tfd);
+	rp_tfd = -1;
+
+	uevent_settle();
+}
+
+static int uevent_replay_open(const char *path, double speed)
+{
+	const struct capture_header *header;
+	struct capture_record r;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "%s: open: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*header)) {
+		fprintf(stderr, "%s: Invalid capture!\n", path);
+		goto error;
+	}
+
+	replay.addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (replay.addr == MAP_FAILED) {
+		perror("mmap");
+		replay.addr = NULL;
+		goto error;
+	}
+	close_and_ignore_error(fd);
+	fd = -1;
+
+	replay.size = st.st_size;
+	header = (const struct capture_header *)replay.addr;
+	if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != CAPTURE_VERSION) {
+		fprintf(stderr, "%s: Invalid capture!\n", path);
+		goto error;
+	}
+
+	replay.off = sizeof(*header);
+	if (replay.off + sizeof(r) <= replay.size) {
+		memcpy(&r, &replay.addr[replay.off], sizeof(r));
+		replay.first = r.usec;
+	}
+	replay.start = now_ns();
+	replay.speed = speed;
+	stage("tini/replay");
+
+	rp_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (rp_tfd == -1) {
+		perror("timerfd_create");
+		goto error;
+	}
+
+	if (epoll_watch(rp_tfd) == -1)
+		goto error;
+
+	replay_arm(replay.start);
+	return 0;
+
+error:
+	if (fd != -1)
+		close_and_ignore_error(fd);
+	if (rp_tfd != -1)
+		close_and_ignore_error(rp_tfd);
+	rp_tfd = -1;
+	if (replay.addr)
+		(void)munmap(replay.addr, replay.size);
+	replay.addr = NULL;
+	return -1;
+}
+
+static void uevent_fields(struct uevent *uevent, char * const envp[])
+{
+	char * const *env;
+
+	uevent->action = "";
+	uevent->devpath = "";
+	uevent->subsystem = "";
+	uevent->devtype = "";
+	uevent->devname = "";
+	uevent->interface = "";
+	uevent->modalias = "";
+	uevent->seqnum = 0;
+
+	for (env = envp; *env; env++) {
+		if (__strncmp(*env, "ACTION=") == 0)
+			uevent->action = *env + 7;
+		else if (__strncmp(*env, "DEVPATH=") == 0)
+			uevent->devpath = *env + 8;
+		else if (__strncmp(*env, "SUBSYSTEM=") == 0)
+			uevent->subsystem = *env + 10;
+		else if (__strncmp(*env, "DEVTYPE=") == 0)
+			uevent->devtype = *env + 8;
+		else if (__strncmp(*env, "DEVNAME=") == 0)
+			uevent->devname = *env + 8;
+		else if (__strncmp(*env, "INTERFACE=") == 0)
+			uevent->interface = *env + 10;
+		else if (__strncmp(*env, "MODALIAS=") == 0)
+			uevent->modalias = *env + 9;
+		else if (__strncmp(*env, "SEQNUM=") == 0)
+			uevent->seqnum = strtoull(*env + 7, NULL, 10);
+	}
+}
+
+static uid_t strtouid(const char *name)
+{
+	struct passwd *pw;
+	uid_t uid = -1;
+	char *endptr;
+	FILE *f;
+
+	uid = strtoul(name, &endptr, 0);
+	if (*name != '\0' && *endptr == '\0')
+		return uid;
+
+	/* No NSS for static binaries */
+	f = fopen("/etc/passwd", "r");
+	if (!f)
+		return -1;
+
+	uid = -1;
+	while ((pw = fgetpwent(f)))
+		if (strcmp(pw->pw_name, name) == 0) {
+			uid = pw->pw_uid;
+			break;
+		}
+
+	fclose(f);
+	return uid;
+}
+
+static gid_t strtogid(const char *name)
+{
+	struct group *gr;
+	gid_t gid = -1;
+	char *endptr;
+	FILE *f;
+
+	gid = strtoul(name, &endptr, 0);
+	if (*name != '\0' && *endptr == '\0')
+		return gid;
+
+	/* No NSS for static binaries */
+	f = fopen("/etc/group", "r");
+	if (!f)
+		return -1;
+
+	gid = -1;
+	while ((gr = fgetgrent(f)))
+		if (strcmp(gr->gr_name, name) == 0) {
+			gid = gr->gr_gid;
+			break;
+		}
+
+	fclose(f);
+	return gid;
+}
+
+/* SUBSYSTEM DEVNAME MODE|- USER[:GROUP]|- [SYMLINK...] */
+static int device_rule_parse(char *line, struct device_rule *rule)
+{
+	char *mode, *owner, *group, *symlink, *saveptr, *s;
+
+	rule->subsystem = strtok_r(line, " \t\n", &saveptr);
+	if (!rule->subsystem || *rule->subsystem == '#')
+		return 1;
+
+	rule->devname = strtok_r(NULL, " \t\n", &saveptr);
+	mode = strtok_r(NULL, " \t\n", &saveptr);
+	owner = strtok_r(NULL, " \t\n", &saveptr);
+	if (!rule->devname || !mode || !owner)
+		return -1;
+
+	rule->mode = -1;
+	if (strcmp(mode, "-") != 0) {
+		char *endptr;
+
+		rule->mode = strtoul(mode, &endptr, 8);
+		if (*endptr != '\0' || rule->mode > 07777)
+			return -1;
+	}
+
+	rule->uid = -1;
+	rule->gid = -1;
+	group = strchr(owner, ':');
+	if (group)
+		*group++ = '\0';
+
+	if (strcmp(owner, "-") != 0 && *owner != '\0') {
+		rule->uid = strtouid(owner);
+		if (rule->uid == (uid_t)-1)
+			return -1;
+	}
+
+	if (group && *group != '\0') {
+		rule->gid = strtogid(group);
+		if (rule->gid == (gid_t)-1)
+			return -1;
+	}
+
+	/* Pack the symlinks NUL-separated */
+	rule->symlinks = NULL;
+	rule->nsymlinks = 0;
+	s = NULL;
+	while ((symlink = strtok_r(NULL, " \t\n", &saveptr))) {
+		size_t len = strlen(symlink) + 1;
+
+		if (!s)
+			rule->symlinks = s = symlink;
+		else
+			memmove(s, symlink, len);
+
+		s += len;
+		rule->nsymlinks++;
+	}
+
+	return 0;
+}
+
+static int device_rules_load(const char *path)
+{
+	size_t size = 0;
+	char *line = NULL;
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			perror("fopen");
+		return -1;
+	}
+
+	while (getline(&line, &size, f) != -1) {
+		struct device_rule *r;
+		int ret;
+
+		lineno++;
+		r = realloc(rules, (nrules + 1) * sizeof(*r));
+		if (!r) {
+			perror("realloc");
+			break;
+		}
+		rules = r;
+
+		r = &rules[nrules];
+		ret = device_rule_parse(line, r);
+		if (ret == -1)
+			fprintf(stderr, "%s:%i: Invalid rule!\n", path, lineno);
+		if (ret != 0)
+			continue;
+
+		/* The rule owns the line */
+		r->buf = line;
+		line = NULL;
+		size = 0;
+		nrules++;
+	}
+
+	free(line);
+	fclose(f);
+	verbose("%s: %i rules\n", path, nrules);
+	return nrules;
+}
+
+static void mkdir_parents(char *path)
+{
+	char *s = path;
+
+	while ((s = strchr(s + 1, '/'))) {
+		*s = '\0';
+		if (mkdir(path, 0755) == -1 && errno != EEXIST)
+			debug("%s: mkdir: %s\n", path, strerror(errno));
+		*s = '/';
+	}
+}
+
+static int device_setup(const struct uevent *uevent)
+{
+	const struct device_rule *r = NULL;
+	char path[PATH_MAX];
+	const char *symlink;
+	int i, add;
+
+	for (i = 0; i < nrules; i++) {
+		if (fnmatch(rules[i].subsystem, uevent->subsystem, 0) == 0 &&
+		    fnmatch(rules[i].devname, uevent->devname, 0) == 0) {
+			r = &rules[i];
+			break;
+		}
+	}
+
+	if (!r)
+		return 0;
+
+	add = strcmp(uevent->action, "add") == 0;
+	if (!add && strcmp(uevent->action, "remove") != 0)
+		return 0;
+
+	if (snprintf(path, sizeof(path), "/dev/%s", uevent->devname) >=
+	    (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (add && r->mode != (mode_t)-1 &&
+	    fchmodat(AT_FDCWD, path, r->mode, 0) == -1)
+		fprintf(stderr, "%s: fchmodat: %s\n", path, strerror(errno));
+
+	if (add && (r->uid != (uid_t)-1 || r->gid != (gid_t)-1) &&
+	    fchownat(AT_FDCWD, path, r->uid, r->gid,
+		     AT_SYMLINK_NOFOLLOW) == -1)
+		fprintf(stderr, "%s: fchownat: %s\n", path, strerror(errno));
+
+	symlink = r->symlinks;
+	for (i = 0; i < r->nsymlinks; i++, symlink += strlen(symlink) + 1) {
+		char link[PATH_MAX], target[PATH_MAX];
+		ssize_t len;
+
+		if (snprintf(link, sizeof(link), "/dev/%s", symlink) >=
+		    (int)sizeof(link))
+			continue;
+
+		/* Remove only the symlinks to this very node */
+		if (!add) {
+			len = readlink(link, target, sizeof(target) - 1);
+			if (len == -1)
+				continue;
+			target[len] = '\0';
+
+			if (strcmp(target, path) == 0 &&
+			    unlinkat(AT_FDCWD, link, 0) == -1)
+				perror("unlinkat");
+			continue;
+		}
+
+		mkdir_parents(link);
+		if (symlinkat(path, AT_FDCWD, link) == 0)
+			continue;
+
+		if (errno == EEXIST && unlinkat(AT_FDCWD, link, 0) == 0 &&
+		    symlinkat(path, AT_FDCWD, link) == 0)
+			continue;
+
+		fprintf(stderr, "%s: symlinkat: %s\n", link, strerror(errno));
+	}
+
+	return 0;
+}
+
+static void *mmap_file(int dirfd, const char *path, size_t *size)
+{
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = openat(dirfd, path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "%s: openat: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		goto error;
+	}
+
+	if (st.st_size == 0) {
+		errno = ENODATA;
+		goto error;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		goto error;
+	}
+
+	close_and_ignore_error(fd);
+	*size = st.st_size;
+	return addr;
+
+error:
+	close_and_ignore_error(fd);
+	return NULL;
+}
+
+/* Name of a module path; up to its first dot, dashes as underscores */
+static uint64_t module_hash(const char *path, size_t len)
+{
+	const char *s = path, *end = path + len;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (; path < end; path++)
+		if (*path == '/')
+			s = path + 1;
+
+	for (; s < end && *s != '.'; s++) {
+		hash ^= (unsigned char)(*s == '-' ? '_' : *s);
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static const char *next_field(const char *s, const char *end, size_t *len)
+{
+	const char *f;
+
+	while (s < end && (*s == ' ' || *s == '\t'))
+		s++;
+
+	f = s;
+	while (s < end && *s != ' ' && *s != '\t' && *s != '\n')
+		s++;
+
+	*len = s - f;
+	return f;
+}
+
+/* alias PATTERN NAME */
+static int modules_index_aliases(struct modules *m)
+{
+	const char *s = m->alias, *end = m->alias + m->aliassize;
+
+	while (s < end) {
+		const char *eol = memchr(s, '\n', end - s);
+		struct module_alias *a;
+		const char *f;
+		size_t len;
+
+		if (!eol)
+			eol = end;
+
+		f = next_field(s, eol, &len);
+		if (len != 5 || memcmp(f, "alias", 5) != 0)
+			goto next;
+
+		a = realloc(m->aliases, (m->naliases + 1) * sizeof(*a));
+		if (!a) {
+			perror("realloc");
+			return -1;
+		}
+		m->aliases = a;
+
+		a = &m->aliases[m->naliases];
+		a->pattern = next_field(f + len, eol, &a->patternlen);
+		a->name = next_field(a->pattern + a->patternlen, eol,
+				     &a->namelen);
+		if (a->patternlen == 0 || a->namelen == 0)
+			goto next;
+
+		for (len = 0; len < a->patternlen; len++)
+			if (strchr("*?[", a->pattern[len]))
+				break;
+		a->prefixlen = len;
+		m->naliases++;
+
+	next:
+		s = eol + 1;
+	}
+
+	return m->naliases;
+}
+
+/* PATH: [DEPENDENCY...] */
+static int modules_index_deps(struct modules *m)
+{
+	const char *s = m->dep, *end = m->dep + m->depsize;
+
+	while (s < end) {
+		const char *eol = memchr(s, '\n', end - s);
+		const char *colon;
+		struct module_dep *d;
+
+		if (!eol)
+			eol = end;
+
+		colon = memchr(s, ':', eol - s);
+		if (!colon || colon == s)
+			goto next;
+
+		d = realloc(m->deps, (m->ndeps + 1) * sizeof(*d));
+		if (!d) {
+			perror("realloc");
+			return -1;
+		}
+		m->deps = d;
+
+		d = &m->deps[m->ndeps++];
+		d->path = s;
+		d->pathlen = colon - s;
+		d->hash = module_hash(d->path, d->pathlen);
+		d->deps = colon + 1;
+		d->depslen = eol - d->deps;
+
+	next:
+		s = eol + 1;
+	}
+
+	return m->ndeps;
+}
+
+/* blacklist NAME, in the *.conf files of the modprobe.d directories */
+static int modules_blacklist_file(struct modules *m, int dirfd,
+				  const char *name)
+{
+	const char *s, *end;
+	size_t size;
+	char *conf;
+
+	conf = mmap_file(dirfd, name, &size);
+	if (!conf)
+		return -1;
+
+	s = conf;
+	end = conf + size;
+	while (s < end) {
+		const char *eol = memchr(s, '\n', end - s);
+		uint64_t *b;
+		const char *f;
+		size_t len;
+
+		if (!eol)
+			eol = end;
+
+		f = next_field(s, eol, &len);
+		if (len != 9 || memcmp(f, "blacklist", 9) != 0)
+			goto next;
+
+		f = next_field(f + len, eol, &len);
+		if (len == 0)
+			goto next;
+
+		b = realloc(m->blacklist, (m->nblacklist + 1) * sizeof(*b));
+		if (!b) {
+			perror("realloc");
+			break;
+		}
+		m->blacklist = b;
+		m->blacklist[m->nblacklist++] = module_hash(f, len);
+
+	next:
+		s = eol + 1;
+	}
+
+	(void)munmap(conf, size);
+	return 0;
+}
+
+static int modules_blacklist(struct modules *m)
+{
+	char dirs[] = MODPROBE_D;
+	char *dir, *saveptr;
+
+	for (dir = strtok_r(dirs, ":", &saveptr); dir;
+	     dir = strtok_r(NULL, ":", &saveptr)) {
+		struct dirent *entry;
+		size_t len;
+		DIR *d;
+
+		d = opendir(dir);
+		if (!d) {
+			if (errno != ENOENT)
+				fprintf(stderr, "%s: opendir: %s\n", dir,
+					strerror(errno));
+			continue;
+		}
+
+		while ((entry = readdir(d))) {
+			len = strlen(entry->d_name);
+			if (len < 5 ||
+			    strcmp(&entry->d_name[len - 5], ".conf") != 0)
+				continue;
+
+			(void)modules_blacklist_file(m, dirfd(d),
+						     entry->d_name);
+		}
+
+		closedir(d);
+	}
+
+	return m->nblacklist;
+}
+
+static int modules_blacklisted(const struct modules *m, const char *name,
+			       size_t len)
+{
+	uint64_t hash = module_hash(name, len);
+	int i;
+
+	for (i = 0; i < m->nblacklist; i++)
+		if (m->blacklist[i] == hash)
+			return 1;
+
+	return 0;
+}
+
+static int modules_open(struct modules *m)
+{
+	char path[PATH_MAX];
+	struct utsname u;
+
+	if (m->state != 0)
+		return m->state == 1 ? 0 : -1;
+
+	/* Do not try again on every uevent */
+	m->state = -1;
+
+	if (m->dir) {
+		if (strlen(m->dir) >= sizeof(path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(path, m->dir);
+	} else if (uname(&u) == -1) {
+		perror("uname");
+		return -1;
+	} else if (snprintf(path, sizeof(path), MODULES_DIR "/%s",
+			    u.release) >= (int)sizeof(path)) {
+		return -1;
+	}
+
+	m->dirfd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (m->dirfd == -1) {
+		if (errno != ENOENT)
+			perror("open");
+		return -1;
+	}
+
+	m->alias = mmap_file(m->dirfd, "modules.alias", &m->aliassize);
+	if (!m->alias)
+		return -1;
+
+	m->dep = mmap_file(m->dirfd, "modules.dep", &m->depsize);
+	if (!m->dep)
+		return -1;
+
+	if (modules_index_aliases(m) == -1 || modules_index_deps(m) == -1)
+		return -1;
+
+	/* Not fatal: the modules are still loaded, blacklisted or not */
+	(void)modules_blacklist(m);
+
+	verbose("%s: %i aliases, %i modules, %i blacklisted\n", path,
+		m->naliases, m->ndeps, m->nblacklist);
+	m->state = 1;
+	return 0;
+}
+
+/* The image of the module, decompressed by the tool for its suffix */
+static void *module_decompress(int fd, const char *path, size_t *size)
+{
+	static const struct {
+		const char *suffix;
+		const char *tool;
+	} tools[] = {
+		{ ".xz", "xz" },
+		{ ".zst", "zstd" },
+		{ ".gz", "gzip" },
+	};
+	size_t i, len = 0, pathlen = strlen(path), max = 0;
+	char *argv[] = { NULL, "-dc", NULL };
+	char *image = NULL, *p;
+	int fds[2], status;
+	ssize_t l;
+	pid_t pid;
+
+	for (i = 0; i < sizeof(tools) / sizeof(tools[0]); i++) {
+		size_t n = strlen(tools[i].suffix);
+
+		if (pathlen > n &&
+		    strcmp(&path[pathlen - n], tools[i].suffix) == 0) {
+			argv[0] = (char *)tools[i].tool;
+			break;
+		}
+	}
+	if (!argv[0]) {
+		errno = ENOEXEC;
+		return NULL;
+	}
+
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		return NULL;
+
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		return NULL;
+
+	pid = fork();
+	if (pid == -1) {
+		close_and_ignore_error(fds[0]);
+		close_and_ignore_error(fds[1]);
+		return NULL;
+	} else if (pid == 0) {
+		if (dup2(fd, STDIN_FILENO) == -1 ||
+		    dup2(fds[1], STDOUT_FILENO) == -1)
+			_exit(127);
+
+		(void)execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	close_and_ignore_error(fds[1]);
+	for (;;) {
+		if (len == max) {
+			max = max ? max * 2 : 1024 * 1024;
+			p = realloc(image, max);
+			if (!p)
+				break;
+			image = p;
+		}
+
+		l = read(fds[0], &image[len], max - len);
+		if (l == -1 && errno == EINTR)
+			continue;
+		if (l <= 0)
+			break;
+		len += l;
+	}
+	close_and_ignore_error(fds[0]);
+
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR) {
+			status = -1;
+			break;
+		}
+
+	if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    len == 0 || len == max) {
+		free(image);
+		errno = ENOEXEC;
+		return NULL;
+	}
+
+	*size = len;
+	return image;
+}
+
+static int module_insert(struct modules *m, const char *path, size_t len)
+{
+	uint64_t hash = module_hash(path, len);
+	char buf[PATH_MAX];
+	uint64_t *loaded;
+	int i, fd, flags = 0;
+
+	for (i = 0; i < m->nloaded; i++)
+		if (m->loaded[i] == hash)
+			return 0;
+
+	if (len >= sizeof(buf)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(buf, path, len);
+	buf[len] = '\0';
+
+	if (m->dryrun) {
+		printf("%s\n", buf);
+		goto loaded;
+	}
+
+	fd = openat(m->dirfd, buf, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "%s: openat: %s\n", buf, strerror(errno));
+		return -1;
+	}
+
+	/* Let the kernel decompress .ko.xz, .ko.zst... */
+	if (len < 3 || memcmp(&buf[len - 3], ".ko", 3) != 0)
+		flags |= MODULE_INIT_COMPRESSED_FILE;
+
+	if (__finit_module(fd, "", flags) == -1 && errno != EEXIST) {
+		void *image;
+		size_t size;
+
+		/* The kernel cannot, decompress in userspace instead */
+		if (!(flags & MODULE_INIT_COMPRESSED_FILE) ||
+		    (errno != EINVAL && errno != EOPNOTSUPP)) {
+			fprintf(stderr, "%s: finit_module: %s\n", buf,
+				strerror(errno));
+			close_and_ignore_error(fd);
+			return -1;
+		}
+
+		image = module_decompress(fd, buf, &size);
+		if (!image) {
+			fprintf(stderr, "%s: decompress: %s\n", buf,
+				strerror(errno));
+			close_and_ignore_error(fd);
+			return -1;
+		}
+
+		if (__init_module(image, size, "") == -1 && errno != EEXIST) {
+			fprintf(stderr, "%s: init_module: %s\n", buf,
+				strerror(errno));
+			free(image);
+			close_and_ignore_error(fd);
+			return -1;
+		}
+
+		free(image);
+	}
+
+	close_and_ignore_error(fd);
+	verbose("%s: loaded\n", buf);
+
+loaded:
+	loaded = realloc(m->loaded, (m->nloaded + 1) * sizeof(*loaded));
+	if (!loaded) {
+		perror("realloc");
+		return -1;
+	}
+	m->loaded = loaded;
+	m->loaded[m->nloaded++] = hash;
+
+	return 0;
+}
+
+static int module_load(struct modules *m, const char *name, size_t len)
+{
+	uint64_t hash = module_hash(name, len);
+	const struct module_dep *d = NULL;
+	const char *deps[64];
+	const char *s, *end;
+	size_t l, lens[64];
+	int i, n = 0;
+
+	for (i = 0; i < m->ndeps; i++)
+		if (m->deps[i].hash == hash) {
+			d = &m->deps[i];
+			break;
+		}
+
+	if (!d) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* The dependencies are listed in full; load them last first */
+	s = d->deps;
+	end = d->deps + d->depslen;
+	for (;;) {
+		s = next_field(s, end, &l);
+		if (l == 0)
+			break;
+
+		if (n == 64) {
+			errno = E2BIG;
+			return -1;
+		}
+
+		deps[n] = s;
+		lens[n++] = l;
+		s += l;
+	}
+
+	while (n-- > 0)
+		if (module_insert(m, deps[n], lens[n]) == -1)
+			return -1;
+
+	return module_insert(m, d->path, d->pathlen);
+}
+
+static int modalias_load(struct modules *m, const char *modalias)
+{
+	size_t len = strlen(modalias);
+	int i, ret = 0;
+
+	for (i = 0; i < m->naliases; i++) {
+		const struct module_alias *a = &m->aliases[i];
+		char pattern[256];
+
+		if (a->prefixlen > len ||
+		    memcmp(a->pattern, modalias, a->prefixlen) != 0)
+			continue;
+
+		if (a->patternlen >= sizeof(pattern))
+			continue;
+		memcpy(pattern, a->pattern, a->patternlen);
+		pattern[a->patternlen] = '\0';
+
+		if (fnmatch(pattern, modalias, 0) != 0)
+			continue;
+
+		/* As modprobe(8), blacklisting applies to the aliases only */
+		if (modules_blacklisted(m, a->name, a->namelen)) {
+			verbose("%.*s: blacklisted\n", (int)a->namelen,
+				a->name);
+			continue;
+		}
+
+		if (module_load(m, a->name, a->namelen) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static const char *handlers_root(int kind)
+{
+	if (kind == HANDLERS_EVENT)
+		return "/lib/tini/event";
+
+	return "/lib/tini/uevent/devname";
+}
+
+static uint64_t stmtime(const struct stat *st)
+{
+	return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL +
+	       st->st_mtim.tv_nsec;
+}
+
+/* As run-parts(8): [a-zA-Z0-9_-]+ */
+static int run_parts_name(const char *name)
+{
+	if (*name == '\0')
+		return 0;
+
+	for (; *name; name++)
+		if (!isalnum((unsigned char)*name) && *name != '_' &&
+		    *name != '-')
+			return 0;
+
+	return 1;
+}
+
+static int strcmpp(const void *p1, const void *p2)
+{
+	return strcmp(*(char * const *)p1, *(char * const *)p2);
+}
+
+struct cache_entry {
+	uint64_t mtime;
+	int kind;
+	char *dir;
+	const char *name; /* in dir */
+	char *handlers;
+	size_t handlerssize;
+	int nhandlers;
+};
+
+struct cache_build {
+	struct cache_entry *entries;
+	int nentries;
+};
+
+static int cache_entry_cmp(const void *p1, const void *p2)
+{
+	const struct cache_entry *e1 = p1, *e2 = p2;
+
+	if (e1->kind != e2->kind)
+		return e1->kind - e2->kind;
+
+	return strcmp(e1->name, e2->name);
+}
+
+static int cache_scan(struct cache_build *b, int kind, const char *name)
+{
+	const char *root = handlers_root(kind);
+	char **names = NULL, **n;
+	struct cache_entry *e;
+	struct dirent *entry;
+	int i, nnames = 0;
+	struct stat st;
+	DIR *dir;
+
+	e = realloc(b->entries, (b->nentries + 1) * sizeof(*e));
+	if (!e) {
+		perror("realloc");
+		return -1;
+	}
+	b->entries = e;
+
+	e = &b->entries[b->nentries];
+	(void)memset(e, 0, sizeof(*e));
+	e->kind = kind;
+	if (asprintf(&e->dir, "%s%s%s", root, *name ? "/" : "", name) == -1) {
+		perror("asprintf");
+		return -1;
+	}
+	e->name = e->dir + strlen(e->dir) - strlen(name);
+	b->nentries++;
+
+	dir = opendir(e->dir);
+	if (!dir) {
+		if (errno != ENOENT && errno != ENOTDIR)
+			perror("opendir");
+		return 0;
+	}
+
+	if (fstat(dirfd(dir), &st) == 0)
+		e->mtime = stmtime(&st);
+
+	while ((entry = readdir(dir))) {
+		if (!run_parts_name(entry->d_name))
+			continue;
+
+		if (fstatat(dirfd(dir), entry->d_name, &st, 0) == -1)
+			continue;
+
+		/* The event names are flat, the device names are not (input/) */
+		if (S_ISDIR(st.st_mode)) {
+			char *sub;
+			int ret;
+
+			if (kind != HANDLERS_DEVNAME && *name)
+				continue;
+
+			if (asprintf(&sub, "%s%s%s", name, *name ? "/" : "",
+				     entry->d_name) == -1) {
+				perror("asprintf");
+				continue;
+			}
+
+			ret = cache_scan(b, kind, sub);
+			free(sub);
+			if (ret == -1)
+				break;
+
+			/* b->entries may have moved */
+			continue;
+		}
+
+		if (faccessat(dirfd(dir), entry->d_name, X_OK, 0) == -1)
+			continue;
+
+		n = realloc(names, (nnames + 1) * sizeof(*n));
+		if (!n) {
+			perror("realloc");
+			break;
+		}
+		names = n;
+
+		names[nnames] = strdup(entry->d_name);
+		if (names[nnames])
+			nnames++;
+	}
+
+	closedir(dir);
+
+	/* As run-parts(8), in the C locale */
+	qsort(names, nnames, sizeof(*names), strcmpp);
+
+	for (e = b->entries; e < &b->entries[b->nentries]; e++)
+		if (e->kind == kind && strcmp(e->name, name) == 0)
+			break;
+
+	for (i = 0; i < nnames; i++) {
+		size_t len = strlen(names[i]) + 1;
+		char *h = realloc(e->handlers, e->handlerssize + len);
+
+		if (h) {
+			memcpy(&h[e->handlerssize], names[i], len);
+			e->handlers = h;
+			e->handlerssize += len;
+			e->nhandlers++;
+		}
+
+		free(names[i]);
+	}
+	free(names);
+
+	return 0;
+}
+
+static char *cache_serialize(struct cache_build *b, size_t *size)
+{
+	struct cache_header *header;
+	struct cache_record *r;
+	size_t off, len;
+	char *buf;
+	int i;
+
+	qsort(b->entries, b->nentries, sizeof(*b->entries), cache_entry_cmp);
+
+	len = sizeof(*header) + b->nentries * sizeof(*r);
+	for (i = 0; i < b->nentries; i++)
+		len += strlen(b->entries[i].dir) + 1 +
+		       b->entries[i].handlerssize;
+
+	buf = calloc(1, len);
+	if (!buf) {
+		perror("calloc");
+		return NULL;
+	}
+
+	header = (struct cache_header *)buf;
+	memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+	header->version = CACHE_VERSION;
+	header->nrecords = b->nentries;
+	header->size = len;
+
+	r = (struct cache_record *)&header[1];
+	off = sizeof(*header) + b->nentries * sizeof(*r);
+	for (i = 0; i < b->nentries; i++, r++) {
+		const struct cache_entry *e = &b->entries[i];
+
+		r->mtime = e->mtime;
+		r->kind = e->kind;
+		r->dir = off;
+		r->name = off + (e->name - e->dir);
+		strcpy(&buf[off], e->dir);
+		off += strlen(e->dir) + 1;
+
+		r->handlers = off;
+		r->nhandlers = e->nhandlers;
+		if (e->handlerssize)
+			memcpy(&buf[off], e->handlers, e->handlerssize);
+		off += e->handlerssize;
+	}
+
+	*size = len;
+	return buf;
+}
+
+static void cache_build_free(struct cache_build *b)
+{
+	int i;
+
+	for (i = 0; i < b->nentries; i++) {
+		free(b->entries[i].dir);
+		free(b->entries[i].handlers);
+	}
+	free(b->entries);
+}
+
+/* Serializes the entries to the cache, and writes it; frees them */
+static int cache_commit(struct cache *c, struct cache_build *b,
+			const char *path)
+{
+	char tmp[PATH_MAX];
+	int fd;
+
+	c->addr = cache_serialize(b, &c->size);
+	if (!c->addr)
+		goto exit;
+
+	c->mapped = 0;
+	c->header = (const struct cache_header *)c->addr;
+	c->records = (const struct cache_record *)&c->header[1];
+
+	/* Best effort: an unwritable cache is still usable in memory */
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		goto exit;
+
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd == -1) {
+		debug("%s: open: %s\n", tmp, strerror(errno));
+		goto exit;
+	}
+
+	if (write(fd, c->addr, c->size) != (ssize_t)c->size ||
+	    rename(tmp, path) == -1) {
+		debug("%s: %s\n", tmp, strerror(errno));
+		(void)unlink(tmp);
+	}
+
+	close_and_ignore_error(fd);
+
+exit:
+	cache_build_free(b);
+	return c->addr ? 0 : -1;
+}
+
+static int cache_build(struct cache *c, const char *path)
+{
+	struct cache_build b = { NULL, 0 };
+
+	if (cache_scan(&b, HANDLERS_EVENT, "") == -1 ||
+	    cache_scan(&b, HANDLERS_DEVNAME, "") == -1) {
+		cache_build_free(&b);
+		return -1;
+	}
+
+	return cache_commit(c, &b, path);
+}
+
+/* The record i is the record j, or under its directory */
+static int cache_under(const struct cache *c, uint32_t i, uint32_t j)
+{
+	const char *name = &c->addr[c->records[i].name];
+	const char *parent = &c->addr[c->records[j].name];
+	size_t len = strlen(parent);
+
+	if (c->records[i].kind != c->records[j].kind)
+		return 0;
+
+	return i == j || len == 0 ||
+	       (strncmp(name, parent, len) == 0 && name[len] == '/');
+}
+
+/*
+ * Scans the dirty directories again, with their subdirectories, and keeps
+ * the other records as they are; the cache is then serialized again.
+ */
+static int cache_refresh(struct cache *c, const char *path)
+{
+	struct cache_build b = { NULL, 0 };
+	uint32_t i, j;
+
+	for (i = 0; i < c->header->nrecords; i++) {
+		const struct cache_record *r = &c->records[i];
+		const char *handler = &c->addr[r->handlers];
+		struct cache_entry *e;
+		size_t size = 0;
+
+		for (j = 0; j < c->header->nrecords; j++)
+			if (c->dirty[j] && cache_under(c, i, j))
+				break;
+		if (j < c->header->nrecords)
+			continue;
+
+		for (j = 0; j < r->nhandlers; j++)
+			size += strlen(&handler[size]) + 1;
+
+		e = realloc(b.entries, (b.nentries + 1) * sizeof(*e));
+		if (!e) {
+			perror("realloc");
+			goto error;
+		}
+		b.entries = e;
+
+		e = &b.entries[b.nentries];
+		(void)memset(e, 0, sizeof(*e));
+		e->mtime = r->mtime;
+		e->kind = r->kind;
+		e->dir = strdup(&c->addr[r->dir]);
+		e->handlers = size ? malloc(size) : NULL;
+		if (!e->dir || (size && !e->handlers)) {
+			perror("malloc");
+			free(e->dir);
+			free(e->handlers);
+			goto error;
+		}
+		e->name = e->dir + (r->name - r->dir);
+		(void)memcpy(e->handlers, handler, size);
+		e->handlerssize = size;
+		e->nhandlers = r->nhandlers;
+		b.nentries++;
+	}
+
+	/* Once per subtree, from its top dirty directory */
+	for (i = 0; i < c->header->nrecords; i++) {
+		if (!c->dirty[i])
+			continue;
+
+		for (j = 0; j < c->header->nrecords; j++)
+			if (j != i && c->dirty[j] && cache_under(c, i, j))
+				break;
+		if (j < c->header->nrecords)
+			continue;
+
+		debug("%s: %s: rescanning\n", path,
+		      &c->addr[c->records[i].dir]);
+		if (cache_scan(&b, c->records[i].kind,
+			       &c->addr[c->records[i].name]) == -1)
+			goto error;
+	}
+
+	cache_close(c);
+	return cache_commit(c, &b, path);
+
+error:
+	cache_build_free(&b);
+	return -1;
+}
+
+static int cache_valid(const struct cache *c)
+{
+	uint32_t i;
+
+	for (i = 0; i < c->header->nrecords; i++) {
+		const struct cache_record *r = &c->records[i];
+		struct stat st;
+
+		if (stat(&c->addr[r->dir], &st) == -1) {
+			if (r->mtime != 0)
+				return 0;
+			continue;
+		}
+
+		if (stmtime(&st) != r->mtime)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* The string at off, NUL terminated within the cache; or NULL */
+static const char *cache_string(const struct cache *c, uint64_t off)
+{
+	if (off >= c->size || !memchr(&c->addr[off], '\0', c->size - off))
+		return NULL;
+
+	return &c->addr[off];
+}
+
+/*
+ * Every offset within the file and every string terminated in it, and the
+ * records sorted as looked up; not to trust the file more than the sources.
+ */
+static int cache_check(const struct cache *c)
+{
+	const char *prev = NULL;
+	uint32_t i, j;
+
+	for (i = 0; i < c->header->nrecords; i++) {
+		const struct cache_record *r = &c->records[i];
+		const char *dir, *name, *handler;
+		uint64_t off;
+
+		dir = cache_string(c, r->dir);
+		name = cache_string(c, r->name);
+		if (!dir || !name || r->name < r->dir ||
+		    r->name > r->dir + strlen(dir) ||
+		    (r->kind != HANDLERS_EVENT && r->kind != HANDLERS_DEVNAME))
+			return 0;
+
+		if (i > 0 && (r->kind < c->records[i - 1].kind ||
+			      (r->kind == c->records[i - 1].kind &&
+			       strcmp(prev, name) >= 0)))
+			return 0;
+		prev = name;
+
+		off = r->handlers;
+		for (j = 0; j < r->nhandlers; j++) {
+			handler = cache_string(c, off);
+			if (!handler)
+				return 0;
+			off += strlen(handler) + 1;
+		}
+	}
+
+	return 1;
+}
+
+static int cache_map(struct cache *c, const char *path)
+{
+	const struct cache_header *header;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*header))
+		goto error;
+
+	c->addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (c->addr == MAP_FAILED) {
+		c->addr = NULL;
+		goto error;
+	}
+	close_and_ignore_error(fd);
+
+	c->size = st.st_size;
+	c->mapped = 1;
+	c->header = header = (const struct cache_header *)c->addr;
+	c->records = (const struct cache_record *)&header[1];
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != CACHE_VERSION || header->size != c->size ||
+	    sizeof(*header) + header->nrecords * sizeof(*c->records) >
+	    c->size || !cache_check(c) || !cache_valid(c)) {
+		cache_close(c);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	close_and_ignore_error(fd);
+	return -1;
+}
+
+static int cache_open(struct cache *c, const char *path)
+{
+	if (!c->stale && cache_map(c, path) == 0)
+		return 0;
+
+	verbose("%s: rebuilding\n", path);
+	c->stale = 0;
+	return cache_build(c, path);
+}
+
+static void cache_close(struct cache *c)
+{
+	if (!c->addr)
+		return;
+
+	if (c->mapped)
+		(void)munmap(c->addr, c->size);
+	else
+		free(c->addr);
+
+	c->addr = NULL;
+	c->size = 0;
+	c->mapped = 0;
+	c->header = NULL;
+	c->records = NULL;
+	free(c->wds);
+	c->wds = NULL;
+	free(c->dirty);
+	c->dirty = NULL;
+	c->ndirty = 0;
+}
+
+/* Watch the cached directories, and the parents of the roots */
+static int cache_watch(struct cache *c)
+{
+	const uint32_t mask = IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|
+			      IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR;
+	const char * const parents[] = { "/lib/tini", "/lib/tini/uevent" };
+	uint32_t i;
+
+	/* Drop the former watches at once; forked children may share it */
+	if (in_fd != -1) {
+		if (epoll_ctl(epfd, EPOLL_CTL_DEL, in_fd, NULL) == -1)
+			perror("epoll_ctl");
+		close_and_ignore_error(in_fd);
+	}
+
+	in_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (in_fd == -1) {
+		perror("inotify_init1");
+		return -1;
+	}
+
+	if (epoll_watch(in_fd) == -1)
+		goto error;
+
+	free(c->wds);
+	free(c->dirty);
+	c->ndirty = 0;
+	c->wds = malloc(c->header->nrecords * sizeof(*c->wds) + 1);
+	c->dirty = calloc(c->header->nrecords + 1, sizeof(*c->dirty));
+	if (!c->wds || !c->dirty) {
+		perror("malloc");
+		goto error;
+	}
+
+	for (i = 0; i < sizeof(parents) / sizeof(*parents); i++)
+		(void)inotify_add_watch(in_fd, parents[i], mask);
+
+	for (i = 0; i < c->header->nrecords; i++) {
+		const char *dir = &c->addr[c->records[i].dir];
+
+		c->wds[i] = -1;
+		if (c->records[i].mtime == 0)
+			continue;
+
+		c->wds[i] = inotify_add_watch(in_fd, dir, mask);
+		if (c->wds[i] == -1)
+			debug("%s: inotify_add_watch: %s\n", dir,
+			      strerror(errno));
+	}
+
+	c->watched = 1;
+	return 0;
+
+error:
+	close_and_ignore_error(in_fd);
+	in_fd = -1;
+	return -1;
+}
+
+/* The record of the watch, or -1 (e.g. the parents of the roots) */
+static int cache_record_of(const struct cache *c, int wd)
+{
+	uint32_t i;
+
+	if (!c->addr || !c->wds)
+		return -1;
+
+	for (i = 0; i < c->header->nrecords; i++)
+		if (c->wds[i] == wd)
+			return i;
+
+	return -1;
+}
+
+/*
+ * The directories changed are scanned again at the next lookup, the others
+ * are kept; the whole cache is rebuilt if the parent of a root changed, or
+ * the events overflowed. Not mapped again, the directory times miss the
+ * changes of the handlers themselves (chmod +x).
+ */
+static void cache_notify(struct cache *c, int fd)
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	int all = 0;
+	ssize_t l;
+	char *p;
+
+	for (;;) {
+		l = read(fd, buf, sizeof(buf));
+		if (l == -1) {
+			if (errno != EAGAIN)
+				perror("read");
+			break;
+		} else if (l == 0) {
+			break;
+		}
+
+		for (p = buf; p < buf + l; p += sizeof(*event) + event->len) {
+			int i;
+
+			event = (const struct inotify_event *)p;
+
+			/* Reported by the parent as well */
+			if (event->mask & (IN_IGNORED|IN_DELETE_SELF|
+					   IN_MOVE_SELF))
+				continue;
+
+			i = cache_record_of(c, event->wd);
+			if (i == -1) {
+				all = 1;
+				continue;
+			}
+
+			if (!c->dirty[i]) {
+				c->dirty[i] = 1;
+				c->ndirty++;
+			}
+		}
+	}
+
+	if (all) {
+		debug("%s: invalidated\n", HANDLERS_CACHE);
+		cache_close(c);
+		c->stale = 1;
+	}
+}
+
+static const struct cache_record *cache_lookup(struct cache *c, int kind,
+					       const char *name)
+{
+	uint64_t now = now_ms();
+	uint32_t lo = 0, hi;
+
+	/* Rebuild once the sources changed; check them once in a while */
+	if (c->addr && !c->watched && now >= c->checked + CACHE_CHECK_MS) {
+		c->checked = now;
+		if (!cache_valid(c))
+			cache_close(c);
+	}
+
+	/* Some changed only: the rest is kept */
+	if (c->addr && c->ndirty > 0 &&
+	    (cache_refresh(c, HANDLERS_CACHE) == -1 || cache_watch(c) == -1 ||
+	     !cache_valid(c))) {
+		cache_close(c);
+		c->stale = 1;
+	}
+
+	if (!c->addr) {
+		if (cache_open(c, HANDLERS_CACHE) == -1)
+			return NULL;
+		c->checked = now;
+
+		/* Catch the changes made before the watches */
+		if (c->watched && (cache_watch(c) == -1 || !cache_valid(c))) {
+			cache_close(c);
+			if (cache_open(c, HANDLERS_CACHE) == -1)
+				return NULL;
+		}
+	}
+
+	hi = c->header->nrecords;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const struct cache_record *r = &c->records[mid];
+		int cmp = (int)r->kind - kind;
+
+		if (cmp == 0)
+			cmp = strcmp(&c->addr[r->name], name);
+
+		if (cmp == 0)
+			return r;
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/* As run-parts --exit-on-error --arg ARG DIR */
+static int run_parts(const struct cache *c, const struct cache_record *r,
+		     char *arg, char * const envp[])
+{
+	const char *handler = &c->addr[r->handlers];
+	uint32_t i;
+
+	for (i = 0; i < r->nhandlers; i++, handler += strlen(handler) + 1) {
+		char path[PATH_MAX];
+		char *argv[] = { path, arg, NULL };
+		int status;
+		pid_t pid;
+
+		if (snprintf(path, sizeof(path), "%s/%s", &c->addr[r->dir],
+			     handler) >= (int)sizeof(path))
+			return EXIT_FAILURE;
+
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			return EXIT_FAILURE;
+		} else if (pid == 0) {
+			(void)execve(path, argv, envp);
+			perror("execve");
+			_exit(127);
+		}
+
+		if (waitpid(pid, &status, 0) == -1) {
+			perror("waitpid");
+			return EXIT_FAILURE;
+		}
+
+		if (WIFSIGNALED(status) != 0)
+			return 128 + WTERMSIG(status);
+
+		if (WEXITSTATUS(status) != 0)
+			return WEXITSTATUS(status);
+
+		/*
+		 * Once the handler returned: e.g. rcS/10coldplug once the
+		 * coldplug uevents are settled, or console/sh once the shell is
+		 * spawned (not yet prompting).
+		 */
+		if (STAGES > 0 && strcmp(arg, "start") == 0 &&
+		    snprintf(path, sizeof(path), "%s/%s", &c->addr[r->name],
+			     handler) < (int)sizeof(path))
+			stage(path);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Run the handlers of a uevent as /lib/tini/uevent/script used to */
+/* The uevent handlers still running, reaped by child_reap() */
+static int runner_add(pid_t pid)
+{
+	pid_t *r = realloc(runners, (nrunners + 1) * sizeof(*r));
+
+	if (!r) {
+		perror("realloc");
+		return 0;
+	}
+
+	runners = r;
+	runners[nrunners++] = pid;
+	return 0;
+}
+
+static int uevent_handlers(const struct uevent *uevent, char * const envp[])
+{
+	const struct cache_record *r = NULL;
+	char *arg = "start";
+	pid_t pid;
+
+	if (*uevent->devname)
+		r = cache_lookup(&cache, HANDLERS_DEVNAME, uevent->devname);
+	if (!r && *uevent->interface)
+		r = cache_lookup(&cache, HANDLERS_DEVNAME, uevent->interface);
+	if (!r || r->nhandlers == 0)
+		return 0;
+
+	if (strcmp(uevent->action, "remove") == 0)
+		arg = "stop";
+
+	/* Not to block pid 1; reaped on SIGCHLD */
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	} else if (pid > 0) {
+		return runner_add(pid);
+	}
+
+	(void)netlink_close(nl_fd);
+	_exit(run_parts(&cache, r, arg, envp));
+}
+
+/* The legacy script; a runner as well, waited for by settle */
+static int uevent_script(char * const argv[], char * const envp[])
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	} else if (pid > 0) {
+		PROBE2(fork, pid, argv[0]);
+		return runner_add(pid);
+	}
+
+	(void)netlink_close(nl_fd);
+	PROBE2(exec, getpid(), argv[0]);
+	(void)execve(argv[0], argv, envp);
+	perror("execve");
+	_exit(127);
+}
+
+static int udaemon_start(void)
+{
+	char * const argv[] = { UEVENT_DAEMON, NULL };
+	int i, in[2], out[2];
+	sigset_t sigset;
+	pid_t pid;
+
+	if (access(UEVENT_DAEMON, X_OK) == -1)
+		return -1;
+
+	if (udaemon.tfd == -1) {
+		udaemon.tfd = timerfd_create(CLOCK_MONOTONIC,
+					     TFD_NONBLOCK|TFD_CLOEXEC);
+		if (udaemon.tfd == -1) {
+			perror("timerfd_create");
+			return -1;
+		}
+
+		if (epoll_watch(udaemon.tfd) == -1) {
+			close_and_ignore_error(udaemon.tfd);
+			udaemon.tfd = -1;
+			return -1;
+		}
+	}
+
+	if (pipe2(in, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		return -1;
+	}
+
+	if (pipe2(out, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		goto error;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close_and_ignore_error(out[0]);
+		close_and_ignore_error(out[1]);
+		goto error;
+	} else if (pid == 0) {
+		(void)netlink_close(nl_fd);
+		dup2_or_exit(in[0], STDIN_FILENO);
+		dup2_or_exit(out[1], STDOUT_FILENO);
+
+		if (sigemptyset(&sigset) == -1)
+			perror("sigemptyset");
+		else if (sigprocmask(SIG_SETMASK, &sigset, NULL) == -1)
+			perror("sigprocmask");
+
+		PROBE2(exec, getpid(), argv[0]);
+		(void)execv(argv[0], argv);
+		perror("execv");
+		_exit(127);
+	}
+
+	PROBE2(fork, pid, argv[0]);
+	close_and_ignore_error(in[0]);
+	close_and_ignore_error(out[1]);
+	udaemon.pid = pid;
+	udaemon.in = in[1];
+	udaemon.out = out[0];
+
+	/* Not to block pid 1 on a full pipe */
+	if (fcntl(udaemon.in, F_SETFL, O_NONBLOCK) == -1)
+		perror("fcntl");
+
+	if (epoll_watch(udaemon.out) == -1) {
+		udaemon_stop(0);
+		return -1;
+	}
+
+	/* The uevents not acked by the former, to ack in time */
+	for (i = 0; i < udaemon.nsent; i++)
+		udaemon.frames[i].sent = now_ms();
+
+	verbose("%s: started as pid %i\n", UEVENT_DAEMON, pid);
+	return 0;
+
+error:
+	close_and_ignore_error(in[0]);
+	close_and_ignore_error(in[1]);
+	return -1;
+}
+
+/* Drops the first N uevents from the frames */
+static void udaemon_drop(int n)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		len += udaemon.frames[i].len;
+
+	(void)memmove(udaemon.buf, &udaemon.buf[len], udaemon.len - len);
+	udaemon.len -= len;
+	udaemon.off = udaemon.off > len ? udaemon.off - len : 0;
+	(void)memmove(udaemon.frames, &udaemon.frames[n],
+		      (udaemon.nsent - n) * sizeof(*udaemon.frames));
+	udaemon.nsent -= n;
+}
+
+/*
+ * Killed if still running, and reaped as any other child. The uevents not
+ * acked yet are replayed to the next daemon, started after a delay, doubled
+ * until one is acked; the oldest is lost if already replayed once, not to
+ * crash every daemon on it.
+ */
+static void udaemon_stop(int replay)
+{
+	int i, n = 0;
+
+	if (udaemon.pid == -1)
+		return;
+
+	if (kill(udaemon.pid, SIGKILL) == -1 && errno != ESRCH)
+		perror("kill");
+
+	close_and_ignore_error(udaemon.in);
+	close_and_ignore_error(udaemon.out);
+	udaemon.pid = -1;
+	udaemon.in = -1;
+	udaemon.out = -1;
+	udaemon.polled = 0;
+	udaemon.off = 0;
+
+	if (!replay)
+		n = udaemon.nsent;
+	else if (udaemon.nsent > 0 && udaemon.frames[0].replayed)
+		n = 1;
+	if (n > 0)
+		fprintf(stderr, "%s: %i uevents not acked!\n", UEVENT_DAEMON, n);
+	udaemon_drop(n);
+
+	if (udaemon.nsent > 0) {
+		for (i = 0; i < udaemon.nsent; i++)
+			udaemon.frames[i].replayed = 1;
+
+		udaemon.delay = udaemon.delay ? udaemon.delay * 2 :
+				UEVENT_DAEMON_RESTART_MS;
+		if (udaemon.delay > UEVENT_DAEMON_RESTART_MAX_MS)
+			udaemon.delay = UEVENT_DAEMON_RESTART_MAX_MS;
+		udaemon.restart = now_ms() + udaemon.delay;
+		verbose("%s: replaying %i uevents in %li ms\n", UEVENT_DAEMON,
+			udaemon.nsent, udaemon.delay);
+	}
+
+	udaemon_arm();
+}
+
+/* Once the delay is over, the uevents not acked are replayed to it */
+static void udaemon_restart(void)
+{
+	udaemon.restart = 0;
+	if (udaemon_start() == -1 && udaemon.nsent > 0) {
+		fprintf(stderr, "%s: %i uevents not acked!\n", UEVENT_DAEMON,
+			udaemon.nsent);
+		udaemon_drop(udaemon.nsent);
+	}
+
+	udaemon_arm();
+	if (udaemon.pid != -1)
+		udaemon_flush();
+}
+
+/*
+ * Expires when the oldest uevent sent should have been acked, or when the
+ * daemon is to be started again
+ */
+static void udaemon_arm(void)
+{
+	struct itimerspec its;
+	uint64_t deadline;
+
+	if (udaemon.tfd == -1)
+		return;
+
+	(void)memset(&its, 0, sizeof(its));
+	if (udaemon.pid == -1 && udaemon.restart) {
+		its.it_value.tv_sec = udaemon.restart / 1000;
+		its.it_value.tv_nsec = (udaemon.restart % 1000) * 1000000;
+	} else if (udaemon.nsent > 0) {
+		deadline = udaemon.frames[0].sent +
+			   UEVENT_DAEMON_TIMEOUT * 1000ULL;
+		its.it_value.tv_sec = deadline / 1000;
+		its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+	}
+
+	if (timerfd_settime(udaemon.tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		perror("timerfd_settime");
+}
+
+/*
+ * A uevent is its NUL-terminated variables, followed by an empty one; the
+ * daemon acks every uevent with a line, in order. It is (re)started by the
+ * first uevent, and the uevents wait meanwhile if it is to be restarted.
+ * Past UEVENT_DAEMON_BUFFER_MAX bytes not acked, the script has them.
+ */
+static int udaemon_send(char * const envp[])
+{
+	struct uevent_frame *frames;
+	char * const *env;
+	size_t len = 1;
+	char *buf;
+
+	if (udaemon.pid == -1 && !udaemon.restart && udaemon_start() == -1)
+		return -1;
+
+	for (env = envp; *env; env++)
+		len += strlen(*env) + 1;
+
+	if (udaemon.len + len > UEVENT_DAEMON_BUFFER_MAX) {
+		fprintf(stderr, "%s: Too many uevents not acked!\n",
+			UEVENT_DAEMON);
+		return -1;
+	}
+
+	buf = realloc(udaemon.buf, udaemon.len + len);
+	if (!buf) {
+		perror("realloc");
+		return -1;
+	}
+	udaemon.buf = buf;
+
+	frames = realloc(udaemon.frames,
+			 (udaemon.nsent + 1) * sizeof(*frames));
+	if (!frames) {
+		perror("realloc");
+		return -1;
+	}
+	udaemon.frames = frames;
+
+	for (env = envp; *env; env++) {
+		size_t l = strlen(*env) + 1;
+
+		(void)memcpy(&udaemon.buf[udaemon.len], *env, l);
+		udaemon.len += l;
+	}
+	udaemon.buf[udaemon.len++] = '\0';
+
+	udaemon.frames[udaemon.nsent].sent = now_ms();
+	udaemon.frames[udaemon.nsent].len = len;
+	udaemon.frames[udaemon.nsent].replayed = 0;
+	udaemon.nsent++;
+	if (udaemon.pid == -1)
+		return 0;
+
+	if (udaemon.nsent == 1)
+		udaemon_arm();
+
+	udaemon_flush();
+	return 0;
+}
+
+/* Writes what the pipe takes, and the rest once writable */
+static void udaemon_flush(void)
+{
+	struct epoll_event event;
+	ssize_t l;
+
+	while (udaemon.off < udaemon.len) {
+		l = write(udaemon.in, &udaemon.buf[udaemon.off],
+			  udaemon.len - udaemon.off);
+		if (l == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+
+			perror("write");
+			udaemon_stop(1);
+			return;
+		}
+
+		udaemon.off += l;
+	}
+
+	if ((udaemon.off < udaemon.len) == udaemon.polled)
+		return;
+
+	(void)memset(&event, 0, sizeof(event));
+	event.events = EPOLLOUT;
+	event.data.fd = udaemon.in;
+	if (epoll_ctl(epfd, udaemon.polled ? EPOLL_CTL_DEL : EPOLL_CTL_ADD,
+		      udaemon.in, &event) == -1) {
+		perror("epoll_ctl");
+		return;
+	}
+
+	udaemon.polled = !udaemon.polled;
+}
+
+static void udaemon_ack(void)
+{
+	char buf[BUFSIZ];
+	ssize_t l;
+	int i, n = 0;
+
+	l = read(udaemon.out, buf, sizeof(buf));
+	if (l == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+
+		perror("read");
+		udaemon_stop(1);
+		uevent_settle();
+		return;
+	} else if (l == 0) {
+		/* Exited; restarted if not acked, else by the next uevent */
+		udaemon_stop(1);
+		uevent_settle();
+		return;
+	}
+
+	for (i = 0; i < l; i++)
+		if (buf[i] == '\n')
+			n++;
+
+	/* Working: restarted at once the next time */
+	if (n > 0)
+		udaemon.delay = 0;
+
+	if (n > udaemon.nsent)
+		n = udaemon.nsent;
+	udaemon_drop(n);
+	udaemon_arm();
+	uevent_settle();
+}
+
+static void udaemon_timeout(void)
+{
+	uint64_t expirations;
+
+	if (read(udaemon.tfd, &expirations, sizeof(expirations)) == -1 &&
+	    errno != EAGAIN)
+		perror("read");
+
+	if (udaemon.pid == -1 && udaemon.restart) {
+		if (udaemon.restart <= now_ms()) {
+			udaemon_restart();
+			uevent_settle();
+		}
+		return;
+	}
+
+	if (udaemon.nsent == 0 ||
+	    udaemon.frames[0].sent + UEVENT_DAEMON_TIMEOUT * 1000ULL > now_ms())
+		return;
+
+	fprintf(stderr, "%s: Timed out!\n", UEVENT_DAEMON);
+	udaemon_stop(1);
+	uevent_settle();
+}
+
+static socklen_t uevent_address(struct sockaddr_un *addr)
+{
+	size_t len = strlen(UEVENT_SOCKET);
+
+	if (len > sizeof(addr->sun_path))
+		len = sizeof(addr->sun_path);
+
+	(void)memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	(void)memcpy(addr->sun_path, UEVENT_SOCKET, len);
+
+	/* Abstract namespace */
+	if (addr->sun_path[0] == '@')
+		addr->sun_path[0] = '\0';
+
+	return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+static int uevent_listen(void)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	addrlen = uevent_address(&addr);
+	if (bind(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+		perror("bind");
+		goto error;
+	}
+
+	if (listen(fd, SOMAXCONN) == -1) {
+		perror("listen");
+		goto error;
+	}
+
+	if (epoll_watch(fd) == -1)
+		goto error;
+
+	ul_fd = fd;
+	return fd;
+
+error:
+	close_and_ignore_error(fd);
+	return -1;
+}
+
+/*
+ * The listening socket is level-triggered: stop watching it while no
+ * subscriber can be accepted, the connections wait in its backlog.
+ */
+static void uevent_pause(int fd)
+{
+	if (ul_paused)
+		return;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+		perror("epoll_ctl");
+		return;
+	}
+
+	ul_paused = 1;
+	debug("%i: paused\n", fd);
+}
+
+static void uevent_resume(int fd)
+{
+	if (!ul_paused || fd == -1 ||
+	    nsubscribers >= UEVENT_SUBSCRIBERS_MAX + UEVENT_SUBSCRIBERS_RESERVED)
+		return;
+
+	if (epoll_watch(fd) == -1)
+		return;
+
+	ul_paused = 0;
+	debug("%i: resumed\n", fd);
+}
+
+/*
+ * Past the cap, only root is accepted, for the control messages not to wait
+ * behind the unprivileged subscribers; the others are hung up on.
+ */
+static int uevent_accept(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct subscriber *s;
+	int cfd;
+
+	if (nsubscribers >= UEVENT_SUBSCRIBERS_MAX + UEVENT_SUBSCRIBERS_RESERVED) {
+		fprintf(stderr, "%i: Too many subscribers!\n", fd);
+		uevent_pause(fd);
+		return -1;
+	}
+
+	cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	if (cfd == -1) {
+		if (errno == EMFILE || errno == ENFILE)
+			uevent_pause(fd);
+		if (errno != EAGAIN)
+			perror("accept4");
+		return -1;
+	}
+
+	if (nsubscribers >= UEVENT_SUBSCRIBERS_MAX &&
+	    (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+	     cred.uid != 0)) {
+		fprintf(stderr, "%i: Too many subscribers!\n", fd);
+		goto error;
+	}
+
+	s = realloc(subscribers, (nsubscribers + 1) * sizeof(*s));
+	if (!s) {
+		perror("realloc");
+		goto error;
+	}
+	subscribers = s;
+
+	if (epoll_watch(cfd) == -1)
+		goto error;
+
+	s = &subscribers[nsubscribers++];
+	s->fd = cfd;
+	s->settle = 0;
+	s->nfilters = 0;
+	debug("%i: subscribed\n", cfd);
+
+	return cfd;
+
+error:
+	close_and_ignore_error(cfd);
+	return -1;
+}
+
+static int uevent_subscriber(int fd)
+{
+	int i;
+
+	for (i = 0; i < nsubscribers; i++)
+		if (subscribers[i].fd == fd)
+			return i;
+
+	return -1;
+}
+
+static int uevent_peer_root(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+	    cred.uid != 0) {
+		fprintf(stderr, "%i: Not permitted!\n", fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int uevent_subscribe(int i)
+{
+	struct subscriber *s = &subscribers[i];
+	struct uevent_filter *f;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	char buf[sizeof("!switch-root ") + PATH_MAX];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int fd = -1;
+	char *slash;
+	ssize_t l;
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf) - 1;
+	(void)memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	l = recvmsg(s->fd, &msg, MSG_CMSG_CLOEXEC);
+	if (l == -1) {
+		if (errno == EAGAIN)
+			return 0;
+
+		perror("recvmsg");
+		uevent_unsubscribe(i);
+		return -1;
+	} else if (l == 0) {
+		uevent_unsubscribe(i);
+		return 0;
+	}
+	buf[l] = '\0';
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS)
+		(void)memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	/* Never act on a truncated message, the rest of it is lost */
+	if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+		fprintf(stderr, "%i: Message too long!\n", s->fd);
+		if (fd != -1)
+			close_and_ignore_error(fd);
+		return -1;
+	}
+
+	/* Not a filter: a descriptor to keep for the next instance */
+	if (strncmp(buf, "!fdstore ", 9) == 0) {
+		const char *name = &buf[9];
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		pid_t pid = -1;
+		int err = 0;
+
+		cred.pid = -1;
+		if (getsockopt(s->fd, SOL_SOCKET, SO_PEERCRED, &cred,
+			       &len) == 0)
+			pid = fdstore_owner(cred.pid);
+
+		if (pid == -1 || fdstore_name(name) == -1 ||
+		    fdstore_permitted(pid, cred.uid) == -1) {
+			err = pid == -1 ? ESRCH : errno;
+			if (fd != -1)
+				close_and_ignore_error(fd);
+		} else if (fdstore_add(pid, cred.uid, name, fd) == -1) {
+			err = errno;
+		}
+
+		/* The sender waits for it, so its pid is still there */
+		l = snprintf(buf, sizeof(buf), "%i", err);
+		if (send(s->fd, buf, l, MSG_DONTWAIT|MSG_NOSIGNAL) == -1)
+			debug("%i: send: %s\n", s->fd, strerror(errno));
+
+		return err ? -1 : 0;
+	}
+
+	/* Not a filter: a standby was spawned, and this is its socket */
+	if (strncmp(buf, "!standby ", 9) == 0 && fd != -1) {
+		uint64_t hash;
+		int instance;
+		char *end;
+		pid_t pid;
+
+		if (uevent_peer_root(s->fd) == -1) {
+			close_and_ignore_error(fd);
+			return -1;
+		}
+
+		pid = strtol(&buf[9], &end, 10);
+		hash = strtoull(end, &end, 16);
+		instance = strtol(end, NULL, 10);
+		return standby_add(hash, instance, pid, fd);
+	}
+
+	/* Not a filter: the peer is to be watched, and this is its eventfd */
+	if (strncmp(buf, "!watchdog ", 10) == 0 && fd != -1) {
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		int err = 0;
+
+		if (uevent_peer_root(s->fd) == -1 ||
+		    getsockopt(s->fd, SOL_SOCKET, SO_PEERCRED, &cred,
+			       &len) == -1) {
+			close_and_ignore_error(fd);
+			err = EPERM;
+		} else if (watchdog_add(cred.pid, fd,
+					strtoul(&buf[10], NULL, 10)) == -1) {
+			err = errno;
+		}
+
+		/* The peer waits for it before it executes */
+		l = snprintf(buf, sizeof(buf), "%i", err);
+		if (send(s->fd, buf, l, MSG_DONTWAIT|MSG_NOSIGNAL) == -1)
+			debug("%i: send: %s\n", s->fd, strerror(errno));
+
+		return err ? -1 : 0;
+	}
+
+	if (fd != -1)
+		close_and_ignore_error(fd);
+
+	/* Not a filter: pid 1 is to move to the new root, as re-executed */
+	if (strncmp(buf, "!switch-root ", 13) == 0) {
+		unsigned int skipped, copied;
+		int err = 0;
+
+		/* All that can fail before anything is moved */
+		if (uevent_peer_root(s->fd) == -1)
+			err = EPERM;
+		else if (l - 13 >= (ssize_t)sizeof(newroot))
+			err = ENAMETOOLONG;
+		else if (switch_root_check(&buf[13], program_invocation_name,
+					   &skipped, &copied) == -1)
+			err = errno;
+
+		if (err == 0) {
+			(void)memcpy(newroot, &buf[13], l - 13 + 1);
+			if (kill(getpid(), SIGUSR1) == -1)
+				perror("kill");
+		}
+
+		l = snprintf(buf, sizeof(buf), "%i", err);
+		if (send(s->fd, buf, l, MSG_DONTWAIT|MSG_NOSIGNAL) == -1)
+			debug("%i: send: %s\n", s->fd, strerror(errno));
+
+		return err ? -1 : 0;
+	}
+
+	/* Not a filter: waits for the uevents to be handled */
+	if (strcmp(buf, "!settle") == 0) {
+		s->settle = 1;
+		debug("%i: settle\n", s->fd);
+		uevent_settle();
+		return 0;
+	}
+
+	if (s->nfilters == UEVENT_FILTERS_MAX) {
+		fprintf(stderr, "%i: Too many filters!\n", s->fd);
+		return -1;
+	}
+
+	/* SUBSYSTEM[/DEVTYPE], or * for every uevent */
+	f = &s->filters[s->nfilters];
+	f->subsystem[0] = '\0';
+	f->devtype[0] = '\0';
+	if (strcmp(buf, "*") != 0) {
+		slash = strchr(buf, '/');
+		if (slash) {
+			*slash++ = '\0';
+			if (strlen(slash) >= sizeof(f->devtype))
+				goto inval;
+			strcpy(f->devtype, slash);
+		}
+
+		if (*buf == '\0' || strlen(buf) >= sizeof(f->subsystem))
+			goto inval;
+		strcpy(f->subsystem, buf);
+	}
+
+	s->nfilters++;
+	debug("%i: filter: %s/%s\n", s->fd, f->subsystem, f->devtype);
+	return 0;
+
+inval:
+	fprintf(stderr, "%i: %s: Invalid filter!\n", s->fd, buf);
+	return -1;
+}
+
+static void uevent_unsubscribe(int i)
+{
+	int fd = subscribers[i].fd;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+		perror("epoll_ctl");
+
+	close_and_ignore_error(fd);
+	subscribers[i] = subscribers[--nsubscribers];
+	debug("%i: unsubscribed\n", fd);
+
+	uevent_resume(ul_fd);
+}
+
+static int uevent_filter_match(const struct subscriber *s,
+			       const char *subsystem, const char *devtype)
+{
+	int i;
+
+	for (i = 0; i < s->nfilters; i++) {
+		const struct uevent_filter *f = &s->filters[i];
+
+		if (*f->subsystem && strcmp(f->subsystem, subsystem) != 0)
+			continue;
+
+		if (*f->devtype && strcmp(f->devtype, devtype) != 0)
+			continue;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static void uevent_broadcast(const char *buf, size_t len,
+			     const char *subsystem, const char *devtype)
+{
+	int i;
+
+	for (i = 0; i < nsubscribers; i++) {
+		const struct subscriber *s = &subscribers[i];
+
+		if (!uevent_filter_match(s, subsystem, devtype))
+			continue;
+
+		/* Never block pid 1 on a slow subscriber; drop the uevent */
+		if (send(s->fd, buf, len, MSG_DONTWAIT|MSG_NOSIGNAL) == -1)
+			debug("%i: send: %s\n", s->fd, strerror(errno));
+	}
+}
+
+static int uevent_close(int fd)
+{
+	int ret;
+
+	if (fd == -1)
+		return 0;
+
+	ul_paused = 0;
+	while (nsubscribers > 0)
+		uevent_unsubscribe(nsubscribers - 1);
+
+	free(subscribers);
+	subscribers = NULL;
+
+	ret = close(fd);
+	if (ret == -1)
+		perror("close");
+
+	ul_fd = -1;
+	return ret;
+}
+
+static int variable_parse_line(char *line, variable_cb_t *callback, void *data)
+{
+	char *equal;
+
+	/* empty line? */
+	if (*line == '\0')
+		return 0;
+
+	/* variable? */
+	equal = strchr(line, '=');
+	if (equal) {
+		char *variable, *value;
+
+		variable = line;
+		value = equal + 1;
+		*equal = '\0';
+
+		if (!callback)
+			return 0;
+
+		return callback(variable, value, data);
+	}
+
+	fprintf(stderr, "malformated variable: \"%s\"."
+			" Must be variable=value!\n", line);
+	return 1;
+}
+
+static int strtoreplicas(const char *value)
+{
+	if (strcmp(value, "cpus") == 0)
+		return REPLICAS_CPUS;
+
+	return strtol(value, NULL, 0);
+}
+
+static int pidfile_info(char *variable, char *value, void *data)
+{
+	struct proc *proc = (struct proc *)data;
+
+	if (strcmp(variable, "ARGC") == 0)
+		proc->argc = strtol(value, NULL, 0);
+	else if (strcmp(variable, "ARGSIZE") == 0)
+		proc->argssize = strtoul(value, NULL, 0);
+	else if (strcmp(variable, "ENVC") == 0)
+		proc->envc = strtol(value, NULL, 0);
+	else if (strcmp(variable, "ENVSIZE") == 0)
+		proc->envssize = strtoul(value, NULL, 0);
+	else if (strcmp(variable, "HASH") == 0)
+		proc->hash = strtoull(value, NULL, 16);
+	else if (strcmp(variable, "STDIN") == 0)
+		proc->dev_stdin = value;
+	else if (strcmp(variable, "STDOUT") == 0)
+		proc->dev_stdout = value;
+	else if (strcmp(variable, "STDERR") == 0)
+		proc->dev_stderr = value;
+	else if (strcmp(variable, "PID") == 0)
+		proc->pid = strtol(value, NULL, 0);
+	else if (strcmp(variable, "COUNTER") == 0)
+		proc->counter = strtol(value, NULL, 0);
+	else if (strcmp(variable, "OLDSTATUS") == 0)
+		proc->oldstatus = strtol(value, NULL, 0);
+	else if (strcmp(variable, "OLDPID") == 0)
+		proc->oldpid = strtol(value, NULL, 0);
+	else if (strcmp(variable, "UID") == 0)
+		proc->uid = strtol(value, NULL, 0);
+	else if (strcmp(variable, "PRIORITY") == 0)
+		proc->lowprio = strcmp(value, "low") == 0;
+	else if (strcmp(variable, "DEFERRED") == 0)
+		proc->deferred = strtol(value, NULL, 0);
+	else if (strcmp(variable, "REPLICAS") == 0)
+		proc->replicas = strtoreplicas(value);
+	else if (strcmp(variable, "INSTANCE") == 0)
+		proc->instance = strtol(value, NULL, 0);
+	else if (strcmp(variable, "CPU") == 0)
+		proc->cpu = strtol(value, NULL, 0);
+	else if (strcmp(variable, "WATCHDOG") == 0)
+		proc->watchdog = strtol(value, NULL, 0);
+	else if (strcmp(variable, "STANDBY") == 0)
+		proc->standby = strtol(value, NULL, 0);
+	else if (strcmp(variable, "WAITING") == 0)
+		proc->waiting = strtol(value, NULL, 0);
+	else if (strcmp(variable, "STARTED") == 0)
+		proc->started = strtoll(value, NULL, 0);
+	else if (strcmp(variable, "SPAWNED") == 0)
+		proc->spawned = strtoll(value, NULL, 0);
+	else if (strcmp(variable, "UTIME") == 0)
+		proc->utime = strtoull(value, NULL, 0);
+	else if (strcmp(variable, "STIME") == 0)
+		proc->stime = strtoull(value, NULL, 0);
+	else if (strcmp(variable, "MAXRSS") == 0)
+		proc->maxrss = strtol(value, NULL, 0);
+	else if (strcmp(variable, "MAJFLT") == 0)
+		proc->majflt = strtol(value, NULL, 0);
+	else if (strcmp(variable, "NVCSW") == 0)
+		proc->nvcsw = strtol(value, NULL, 0);
+	else if (strcmp(variable, "NIVCSW") == 0)
+		proc->nivcsw = strtol(value, NULL, 0);
+	else if (strcmp(variable, "GID") == 0)
+		proc->gid = strtol(value, NULL, 0);
+
+	return 0;
+}
+
+static int pidfile_parse(const char *pidfile, struct proc *proc)
+{
+	struct stat statbuf;
+	size_t size = 0;
+	char *n, *s;
+	int fd;
+
+	fd = open(pidfile, O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &statbuf) == -1) {
+		perror("fstat");
+		goto error;
+	}
+
+	if (S_ISDIR(statbuf.st_mode))
+		goto error;
+
+	/* The strings of the proc point to the buffer; it is to be freed */
+	proc->buf = malloc(statbuf.st_size + 1);
+	if (!proc->buf) {
+		perror("malloc");
+		goto error;
+	}
+
+	while (size < (size_t)statbuf.st_size) {
+		ssize_t l;
+
+		l = read(fd, &proc->buf[size], statbuf.st_size - size);
+		if (l == -1) {
+			perror("read");
+			goto error;
+		} else if (l == 0) {
+			break;
+		}
+
+		size += l;
+	}
+	proc->buf[size] = '\0';
+
+	if (close(fd) == -1)
+		perror("close");
+
+	/* Variables, up to the empty line */
+	s = proc->buf;
+	for (;;) {
+		n = strchr(s, '\n');
+		if (!n)
+			return -1;
+
+		*n = '\0';
+		if (n == s)
+			break;
+
+		if (variable_parse_line(s, pidfile_info, proc) != 0)
+			return -1;
+
+		s = n + 1;
+	}
+	s = n + 1;
+
+	/* Args and envs, as is */
+	if (proc->argc < 1 ||
+	    proc->argssize + proc->envssize != size - (s - proc->buf)) {
+		fprintf(stderr, "%s: Invalid pidfile!\n", pidfile);
+		return -1;
+	}
+
+	proc->args = s;
+	proc->envs = s + proc->argssize;
+	return size;
+
+error:
+	close_and_ignore_error(fd);
+	return -1;
+}
+
+static uint64_t tvtous(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+static void proc_account(struct proc *proc, const struct rusage *ru)
+{
+	proc->utime += tvtous(&ru->ru_utime);
+	proc->stime += tvtous(&ru->ru_stime);
+	if (ru->ru_maxrss > proc->maxrss)
+		proc->maxrss = ru->ru_maxrss;
+	proc->majflt += ru->ru_majflt;
+	proc->nvcsw += ru->ru_nvcsw;
+	proc->nivcsw += ru->ru_nivcsw;
+}
+
+/*
+ * Respawned once the pressure is released; takes the buffer over. The
+ * pidfile deferred.OLDPID stands for it meanwhile, for status and assassinate,
+ * and across the executions; the reaped pid may be reused.
+ */
+static int proc_defer(struct proc *proc)
+{
+	char pidfile[PATH_MAX];
+	struct proc *d;
+	FILE *f;
+
+	d = realloc(deferred, (ndeferred + 1) * sizeof(*d));
+	if (!d) {
+		perror("realloc");
+		return respawn(proc);
+	}
+	deferred = d;
+
+	proc->pid = -1;
+	proc->deferred = 1;
+	(void)snprintf(pidfile, sizeof(pidfile), "/run/tini/deferred.%i",
+		       (int)proc->oldpid);
+	f = fopen(pidfile, "w");
+	if (!f) {
+		fprintf(stderr, "%s: fopen: %s\n", pidfile, strerror(errno));
+	} else {
+		(void)pidfile_write(f, proc);
+
+		if (fclose(f) == -1)
+			perror("fclose");
+	}
+	proc->deferred = 0;
+
+	deferred[ndeferred++] = *proc;
+	proc->buf = NULL;
+	verbose("pid %i respawn deferred\n", (int)proc->oldpid);
+	return 0;
+}
+
+/* Left by the previous execution */
+static int proc_undefer(const char *path, struct dirent *entry, void *data)
+{
+	char pidfile[PATH_MAX];
+	struct proc proc, *d;
+
+	(void)data;
+	if (__strncmp(entry->d_name, "deferred.") != 0)
+		return 0;
+
+	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+
+	(void)memset(&proc, 0, sizeof(proc));
+	proc.oldstatus = -1;
+	proc.pid = -1;
+	proc.oldpid = -1;
+	if (pidfile_parse(pidfile, &proc) == -1 || proc.oldpid == -1) {
+		free(proc.buf);
+		return 0;
+	}
+
+	d = realloc(deferred, (ndeferred + 1) * sizeof(*d));
+	if (!d) {
+		perror("realloc");
+		free(proc.buf);
+		return 0;
+	}
+	deferred = d;
+
+	proc.deferred = 0;
+	deferred[ndeferred++] = proc;
+	return 1;
+}
+
+/* Respawns the backlog, but the assassinated (its pidfile is gone) */
+static void proc_release(void)
+{
+	char pidfile[PATH_MAX];
+	int i;
+
+	for (i = 0; i < ndeferred; i++) {
+		struct proc *proc = &deferred[i];
+
+		(void)snprintf(pidfile, sizeof(pidfile),
+			       "/run/tini/deferred.%i", (int)proc->oldpid);
+		if (unlink(pidfile) == -1 && errno == ENOENT) {
+			verbose("pid %i respawn cancelled\n",
+				(int)proc->oldpid);
+			fdstore_remove(proc->oldpid);
+		} else {
+			(void)respawn(proc);
+		}
+
+		free(proc->buf);
+	}
+	free(deferred);
+	deferred = NULL;
+	ndeferred = 0;
+}
+
+static int pid_respawn(pid_t pid, int status, const struct rusage *ru)
+{
+	struct proc proc;
+	char pidfile[PATH_MAX];
+	struct stat statbuf;
+	int ret;
+
+	(void)snprintf(pidfile, sizeof(pidfile), "/run/tini/%i", (int)pid);
+	if (stat(pidfile, &statbuf) == -1)
+		return 1;
+
+	/* Supervised only */
+	PROBE2(pid_respawn_entry, pid, status);
+
+	/* command not found */
+	if (status == 127) {
+		if (unlink(pidfile) == -1)
+			perror("unlink");
+		PROBE2(pid_respawn_return, pid, 1);
+		return 1;
+	}
+
+	(void)memset(&proc, 0, sizeof(proc));
+	proc.oldstatus = -1;
+	proc.pid = -1;
+	proc.oldpid = -1;
+	ret = pidfile_parse(pidfile, &proc);
+
+	/* overwrite values */
+	proc.oldstatus = status;
+	proc.oldpid = pid;
+	proc_account(&proc, ru);
+	if (ret != -1 && pressure && proc.lowprio)
+		ret = proc_defer(&proc);
+	else if (ret != -1 && proc.standby && !proc.waiting &&
+		 standby_promote(&proc) == 0)
+		ret = 0;
+	else if (ret != -1)
+		ret = respawn(&proc);
+	free(proc.buf);
+	proc.buf = NULL;
+
+	if (unlink(pidfile) == -1)
+		perror("unlink");
+
+	PROBE2(pid_respawn_return, pid, ret);
+	return ret;
+}
+
+static size_t strvsize(char * const vec[], int *n)
+{
+	char * const *v = vec;
+	size_t size = 0;
+
+	while (*v)
+		size += strlen(*v++) + 1;
+
+	if (n)
+		*n = v - vec;
+
+	return size;
+}
+
+static char *strvcpy(char *dest, char * const vec[])
+{
+	char * const *v = vec;
+	char *d = dest;
+
+	while (*v)
+		d = stpcpy(d, *v++) + 1;
+
+	return d;
+}
+
+static char **strntov(char *dest[], const char *src, int n)
+{
+	char **v = dest;
+
+	while (n-- > 0) {
+		*v++ = (char *)src;
+		src += strlen(src) + 1;
+	}
+	*v = NULL;
+
+	return dest;
+}
+
+/* FNV-1a */
+static uint64_t strnhash(const char *s, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (size-- > 0) {
+		hash ^= (unsigned char)*s++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static int proc_alloc(struct proc *proc, const char *path, char * const argv[],
+		      char * const envp[])
+{
+	char *s;
+
+	proc->argssize = strlen(path) + 1 + strvsize(argv, &proc->argc);
+	proc->argc++;
+	proc->envssize = 0;
+	proc->envc = 0;
+	if (envp)
+		proc->envssize = strvsize(envp, &proc->envc);
+
+	proc->buf = malloc(proc->argssize + proc->envssize);
+	if (!proc->buf) {
+		perror("malloc");
+		return -1;
+	}
+
+	s = stpcpy(proc->buf, path) + 1;
+	s = strvcpy(s, argv);
+	if (envp)
+		(void)strvcpy(s, envp);
+
+	proc->args = proc->buf;
+	proc->envs = proc->buf + proc->argssize;
+	proc->hash = strnhash(proc->args, proc->argssize);
+	return 0;
+}
+
+static int proc_cmp(const struct proc *proc1, const struct proc *proc2)
+{
+	if (proc1->hash != proc2->hash ||
+	    proc1->argssize != proc2->argssize)
+		return 1;
+
+	return memcmp(proc1->args, proc2->args, proc1->argssize);
+}
+
+static int pidfile_kill(const char *pidfile, const struct proc *proc,
+			int signum, int forget)
+{
+	struct proc p;
+	int fd;
+
+	/* Not respawned yet: forgotten, or nothing to signal */
+	if (proc->deferred) {
+		if (!forget)
+			return -1;
+
+		if (unlink(pidfile) == -1) {
+			perror("unlink");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	fd = __pidfd_open(proc->pid, 0);
+	if (fd == -1 && errno == ENOSYS) {
+		if (forget && unlink(pidfile) == -1)
 			perror("unlink");
 
-		if (kill(proc.pid, SIGKILL) == -1)
-			perror("kill");
+		if (kill(proc->pid, signum) == -1) {
+			perror("kill");
+			return -1;
+		}
+
+		return 0;
+	} else if (fd == -1) {
+		perror("pidfd_open");
+		return -1;
+	}
+
+	/*
+	 * The reaper removes the pidfile before it reaps the pid. Thus, if the
+	 * pidfile still describes the process, the pidfd does refer to it and
+	 * not to a process that reuses its pid.
+	 */
+	(void)memset(&p, 0, sizeof(p));
+	p.oldstatus = -1;
+	p.pid = -1;
+	p.oldpid = -1;
+	if (pidfile_parse(pidfile, &p) == -1 ||
+	    p.pid != proc->pid || proc_cmp(&p, proc) != 0) {
+		fprintf(stderr, "%i: Process reaped!\n", (int)proc->pid);
+		close_and_ignore_error(fd);
+		free(p.buf);
+		return -1;
+	}
+	free(p.buf);
+	p.buf = NULL;
+
+	/* Not to be respawned */
+	if (forget && unlink(pidfile) == -1)
+		perror("unlink");
+
+	if (__pidfd_send_signal(fd, signum, NULL, 0) == -1) {
+		perror("pidfd_send_signal");
+		close_and_ignore_error(fd);
+		return -1;
+	}
+
+	close_and_ignore_error(fd);
+	return 0;
+}
+
+static int pidfile_assassinate(const char *path, struct dirent *entry,
+			       void *data)
+{
+	struct proc proc;
+	char pidfile[BUFSIZ];
+	int ret = 0;
+
+	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+
+	(void)memset(&proc, 0, sizeof(proc));
+	proc.oldstatus = -1;
+	proc.pid = -1;
+	proc.oldpid = -1;
+	if (pidfile_parse(pidfile, &proc) == -1) {
+		free(proc.buf);
+		return 0;
+	}
+
+	if (proc_cmp(&proc, (const struct proc *)data) == 0 &&
+	    pidfile_kill(pidfile, &proc, SIGKILL, 1) == 0) {
+		verbose("pid %i assassinated\n", (int)proc.pid);
+		ret = 1;
+	}
+
+	free(proc.buf);
+	return ret;
+}
+
+static int pidfile_assassinate_by_pid(const char *path, struct dirent *entry,
+				      void *data)
+{
+	struct proc proc;
+	char pidfile[BUFSIZ];
+	int ret = 0;
+	pid_t pid;
+
+	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+
+	(void)memset(&proc, 0, sizeof(proc));
+	proc.oldstatus = -1;
+	proc.pid = -1;
+	proc.oldpid = -1;
+	if (pidfile_parse(pidfile, &proc) == -1) {
+		free(proc.buf);
+		return 0;
+	}
+
+	pid = proc.oldpid;
+	if (pid == -1)
+		pid = proc.pid;
+
+	if (pid == *(pid_t *)data &&
+	    pidfile_kill(pidfile, &proc, SIGKILL, 1) == 0) {
+		verbose("pid %i assassinated\n", (int)proc.pid);
+		ret = 1;
+	}
+
+	free(proc.buf);
+	return ret;
+}
+
+/* Add the usage of the running life, from /proc */
+static void proc_live_rusage(struct proc *proc)
+{
+	unsigned long majflt, cmajflt, utime, stime;
+	long cutime, cstime, tck = sysconf(_SC_CLK_TCK);
+	char path[PATH_MAX], buf[BUFSIZ], *s;
+	ssize_t l;
+	FILE *f;
+	int fd;
+
+	(void)snprintf(path, sizeof(path), "/proc/%i/stat", (int)proc->pid);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	l = read(fd, buf, sizeof(buf) - 1);
+	close_and_ignore_error(fd);
+	if (l <= 0)
+		return;
+	buf[l] = '\0';
+
+	/* The comm may have spaces and parentheses */
+	s = strrchr(buf, ')');
+	if (s && tck > 0 &&
+	    sscanf(s + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %lu %lu %lu %lu"
+		   " %ld %ld", &majflt, &cmajflt, &utime, &stime, &cutime,
+		   &cstime) == 6) {
+		proc->majflt += majflt + cmajflt;
+		proc->utime += (utime + cutime) * 1000000ULL / tck;
+		proc->stime += (stime + cstime) * 1000000ULL / tck;
+	}
+
+	(void)snprintf(path, sizeof(path), "/proc/%i/status", (int)proc->pid);
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		long val;
+
+		if (sscanf(buf, "VmHWM: %ld", &val) == 1) {
+			if (val > proc->maxrss)
+				proc->maxrss = val;
+		} else if (sscanf(buf, "voluntary_ctxt_switches: %ld",
+				  &val) == 1) {
+			proc->nvcsw += val;
+		} else if (sscanf(buf, "nonvoluntary_ctxt_switches: %ld",
+				  &val) == 1) {
+			proc->nivcsw += val;
+		}
+	}
+
+	fclose(f);
+}
+
+static void proc_status(const struct proc *proc)
+{
+	struct proc p = *proc;
+
+	/* There is no pid to print, but there is no process to kill either */
+	if (RUSAGE == 0) {
+		if (!proc->deferred)
+			printf("%i\n", (int)proc->pid);
+		return;
+	}
+
+	if (proc->deferred)
+		printf("DEFERRED=1\n");
+	else
+		proc_live_rusage(&p);
+	printf("PID=%i\n", (int)p.pid);
+	printf("COUNTER=%i\n", p.counter);
+	if (p.replicas != 0) {
+		printf("INSTANCE=%i\n", p.instance);
+		printf("CPU=%i\n", p.cpu);
+	}
+	printf("STARTED=%lli\n", (long long)p.started);
+	printf("SPAWNED=%lli\n", (long long)p.spawned);
+	printf("UPTIME=%lli\n", (long long)(time(NULL) - p.started));
+	printf("UTIME=%" PRIu64 "\n", p.utime);
+	printf("STIME=%" PRIu64 "\n", p.stime);
+	printf("MAXRSS=%li\n", p.maxrss);
+	printf("MAJFLT=%li\n", p.majflt);
+	printf("NVCSW=%li\n", p.nvcsw);
+	printf("NIVCSW=%li\n", p.nivcsw);
+	printf("\n");
+}
+
+static int pidfile_status(const char *path, struct dirent *entry, void *data)
+{
+	struct proc proc;
+	char pidfile[BUFSIZ];
+	int ret = 0;
+
+	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+
+	(void)memset(&proc, 0, sizeof(proc));
+	proc.oldstatus = -1;
+	proc.pid = -1;
+	proc.oldpid = -1;
+	if (pidfile_parse(pidfile, &proc) == -1) {
+		free(proc.buf);
+		return 0;
+	}
+
+	if (proc_cmp(&proc, (const struct proc *)data) == 0) {
+		proc_status(&proc);
+		ret = 1;
+	}
+
+	free(proc.buf);
+	return ret;
+}
+
+static int pidfile_status_by_pid(const char *path, struct dirent *entry,
+				 void *data)
+{
+	struct proc proc;
+	char pidfile[BUFSIZ];
+	int ret = 0;
+	pid_t pid;
+
+	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+
+	(void)memset(&proc, 0, sizeof(proc));
+	proc.oldstatus = -1;
+	proc.pid = -1;
+	proc.oldpid = -1;
+	if (pidfile_parse(pidfile, &proc) == -1) {
+		free(proc.buf);
+		return 0;
+	}
+
+	pid = proc.oldpid;
+	if (pid == -1)
+		pid = proc.pid;
+
+	if (pid == *(pid_t *)data) {
+		proc_status(&proc);
+		ret = 1;
+	}
+
+	free(proc.buf);
+	return ret;
+}
+
+static int dir_parse(const char *path, directory_cb_t *callback, void *data)
+{
+	struct dirent *entry;
+	int ret = 0;
+	DIR *dir;
+
+	/* Unsorted: no allocation per entry */
+	dir = opendir(path);
+	if (!dir) {
+		perror("opendir");
+		return -1;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (strcmp(entry->d_name, ".") != 0 &&
+		    strcmp(entry->d_name, "..") != 0 ) {
+			if (callback(path, entry, data) != 0)
+				ret++;
+		}
+	}
+	closedir(dir);
+
+	return ret;
+}
+
+static pid_t child_reap(idtype_t idtype, id_t id, int *status)
+{
+	siginfo_t siginfo;
+	struct rusage ru;
+	pid_t pid;
+	int i;
+
+	/*
+	 * Peek at the zombie first, so its pid is not reused until its pidfile
+	 * is removed. Its rusage is already final.
+	 */
+	(void)memset(&siginfo, 0, sizeof(siginfo));
+	(void)memset(&ru, 0, sizeof(ru));
+	if (__waitid(idtype, id, &siginfo, WEXITED|WNOHANG|WNOWAIT,
+		     &ru) == -1) {
+		if (errno != ECHILD)
+			perror("waitid");
+		return -1;
+	}
+
+	pid = siginfo.si_pid;
+	if (pid == 0)
+		return 0;
+
+	verbose("pid %i exited with status %i\n", (int)pid, siginfo.si_status);
+	PROBE2(reap, pid, siginfo.si_status);
+
+	watchdog_release(pid);
+	standby_remove(pid);
+	if (pid_respawn(pid, siginfo.si_status, &ru) != 0)
+		fdstore_remove(pid);
+
+	if (siginfo.si_code == CLD_EXITED)
+		*status = W_EXITCODE(siginfo.si_status, 0);
+	else
+		*status = W_EXITCODE(0, siginfo.si_status);
+
+	if (waitid(P_PID, pid, &siginfo, WEXITED) == -1)
+		perror("waitid");
+
+	for (i = 0; i < nrunners; i++) {
+		if (runners[i] != pid)
+			continue;
+
+		runners[i] = runners[--nrunners];
+		(void)netlink_throttle();
+		uevent_settle();
+		break;
+	}
+
+	return pid;
+}
+
+static int reap_zombies(pid_t pid, int *status)
+{
+	int reaped = 0;
+
+	for (;;) {
+		int wstatus;
+		pid_t p;
+
+		p = child_reap(P_ALL, 0, &wstatus);
+		if (p <= 0)
+			break;
+
+		if (p == pid) {
+			*status = wstatus;
+			reaped = 1;
+		}
+	}
+
+	return reaped;
+}
+
+static int pidfile_freeze(const char *path, struct dirent *entry, void *data)
+{
+	struct proc proc;
+	char pidfile[BUFSIZ];
+	int ret = 0;
+
+	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+
+	(void)memset(&proc, 0, sizeof(proc));
+	proc.oldstatus = -1;
+	proc.pid = -1;
+	proc.oldpid = -1;
+	if (pidfile_parse(pidfile, &proc) == -1) {
+		free(proc.buf);
+		return 0;
+	}
+
+	if (proc.lowprio &&
+	    pidfile_kill(pidfile, &proc, *(int *)data, 0) == 0)
+		ret = 1;
+
+	free(proc.buf);
+	return ret;
+}
+
+/* The online CPUs, as listed by the kernel (e.g. 0-3,6) */
+static int cpus_online(cpu_set_t *set)
+{
+	char buf[BUFSIZ], *s, *n;
+	ssize_t l;
+	int fd;
+
+	CPU_ZERO(set);
+	fd = open(CPUS_ONLINE, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return sched_getaffinity(0, sizeof(*set), set);
+
+	l = read(fd, buf, sizeof(buf) - 1);
+	if (l == -1) {
+		perror("read");
+		close_and_ignore_error(fd);
+		return -1;
+	}
+	buf[l] = '\0';
+	close_and_ignore_error(fd);
+
+	for (s = buf; *s && *s != '\n'; s = n) {
+		long first, last;
+
+		first = last = strtol(s, &n, 10);
+		if (n == s)
+			break;
+		if (*n == '-')
+			last = strtol(n + 1, &n, 10);
+		if (*n == ',')
+			n++;
+
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+	}
+
+	return 0;
+}
+
+/* The nth CPU of the set, round robin */
+static int cpu_nth(const cpu_set_t *set, int n)
+{
+	int cpu, count = CPU_COUNT(set);
+
+	if (count == 0)
+		return 0;
+
+	n %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, set) && n-- == 0)
+			return cpu;
+
+	return 0;
+}
+
+/* Respawns every instance of the pool; prints one pid per line */
+static int replicas_respawn(const struct proc *proc)
+{
+	int i, n, ret = EXIT_SUCCESS;
+	cpu_set_t set;
+
+	if (cpus_online(&set) == -1)
+		return EXIT_FAILURE;
+
+	n = proc->replicas;
+	if (n == REPLICAS_CPUS)
+		n = CPU_COUNT(&set);
+
+	for (i = 0; i < n; i++) {
+		struct proc p = *proc;
+
+		p.cpu = cpu_nth(&set, i);
+		p.instance = i;
+		if (proc->replicas == REPLICAS_CPUS)
+			p.instance = p.cpu;
+
+		if (respawn(&p) != EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		/* Not to be flushed again by the next forks */
+		printf("%i\n", (int)p.pid);
+		fflush(stdout);
+
+		/* Hot standby: one per instance, promoted in its place */
+		if (p.standby != 0) {
+			p.waiting = 1;
+			(void)respawn(&p);
+		}
+	}
+
+	return ret;
+}
+
+struct pool {
+	uint64_t hash; /* of args */
+	int covered; /* has an instance on the CPU */
+	char pidfile[PATH_MAX]; /* of an instance */
+};
+
+struct hotplug {
+	int cpu;
+	int online;
+	struct pool *pools;
+	int npools;
+};
+
+static int pidfile_hotplug(const char *path, struct dirent *entry, void *data)
+{
+	struct hotplug *h = (struct hotplug *)data;
+	struct proc proc;
+	char pidfile[PATH_MAX];
+	struct pool *p;
+	int i, ret = 0;
+
+	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+
+	(void)memset(&proc, 0, sizeof(proc));
+	proc.oldstatus = -1;
+	proc.pid = -1;
+	proc.oldpid = -1;
+	if (pidfile_parse(pidfile, &proc) == -1 ||
+	    proc.replicas != REPLICAS_CPUS)
+		goto exit;
+
+	/* Scale down: the instance of the CPU is not to be respawned */
+	if (!h->online) {
+		if (proc.cpu == h->cpu &&
+		    pidfile_kill(pidfile, &proc, SIGTERM, 1) == 0) {
+			verbose("pid %i scaled down\n", (int)proc.pid);
+			ret = 1;
+		}
+		goto exit;
+	}
+
+	/* Scale up: one instance per pool, unless the CPU has one already */
+	for (i = 0; i < h->npools; i++)
+		if (h->pools[i].hash == proc.hash)
+			break;
+
+	if (i == h->npools) {
+		p = realloc(h->pools, (h->npools + 1) * sizeof(*p));
+		if (!p) {
+			perror("realloc");
+			goto exit;
+		}
+		h->pools = p;
+
+		p = &h->pools[h->npools++];
+		p->hash = proc.hash;
+		p->covered = 0;
+		(void)strcpy(p->pidfile, pidfile);
+	}
+
+	if (proc.cpu == h->cpu)
+		h->pools[i].covered = 1;
+
+exit:
+	free(proc.buf);
+	return ret;
+}
+
+/* Scales the pools of one instance per CPU on CPU hotplug */
+static int replicas_hotplug(const struct uevent *uevent)
+{
+	struct hotplug h;
+	const char *s;
+	char *endptr;
+	int i;
+
+	if (strcmp(uevent->action, "online") == 0)
+		h.online = 1;
+	else if (strcmp(uevent->action, "offline") == 0)
+		h.online = 0;
+	else
+		return 0;
+
+	s = strrchr(uevent->devpath, '/');
+	if (!s || __strncmp(s, "/cpu") != 0)
+		return 0;
+
+	h.cpu = strtol(s + 4, &endptr, 10);
+	if (endptr == s + 4 || *endptr != '\0')
+		return 0;
+
+	h.pools = NULL;
+	h.npools = 0;
+	if (dir_parse("/run/tini", pidfile_hotplug, &h) == -1)
+		return -1;
+
+	for (i = 0; i < h.npools; i++) {
+		struct proc proc;
+
+		if (h.pools[i].covered)
+			continue;
+
+		(void)memset(&proc, 0, sizeof(proc));
+		if (pidfile_parse(h.pools[i].pidfile, &proc) == -1) {
+			free(proc.buf);
+			continue;
+		}
+
+		/* A new life, restart tracking included */
+		proc.counter = 0;
+		proc.oldstatus = -1;
+		proc.pid = -1;
+		proc.oldpid = -1;
+		proc.started = 0;
+		proc.utime = 0;
+		proc.stime = 0;
+		proc.maxrss = 0;
+		proc.majflt = 0;
+		proc.nvcsw = 0;
+		proc.nivcsw = 0;
+		proc.instance = h.cpu;
+		proc.cpu = h.cpu;
+		proc.waiting = 0;
+		if (respawn(&proc) == EXIT_SUCCESS)
+			verbose("pid %i scaled up\n", (int)proc.pid);
+
+		/* Hot standby: one per instance, as replicas_respawn() */
+		if (proc.standby != 0) {
+			proc.waiting = 1;
+			(void)respawn(&proc);
+		}
+		free(proc.buf);
+	}
+
+	free(h.pools);
+	return 0;
+}
+
+/* The entries are kept across re-executions, as the processes are */
+static int watchdog_open(void)
+{
+	const char *s;
+	char *end;
+
+	watchdog.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (watchdog.tfd == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	if (epoll_watch(watchdog.tfd) == -1) {
+		close_and_ignore_error(watchdog.tfd);
+		watchdog.tfd = -1;
+		return -1;
+	}
+
+	/* PID:FD:TIMEOUT, space-separated */
+	for (s = __getenv("TINI_WATCHDOG", ""); *s; s = end) {
+		unsigned long timeout;
+		pid_t pid;
+		int fd;
+
+		pid = strtol(s, &end, 10);
+		if (*end++ != ':')
+			break;
+		fd = strtol(end, &end, 10);
+		if (*end++ != ':')
+			break;
+		timeout = strtoul(end, &end, 10);
+		while (*end == ' ')
+			end++;
+
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+			perror("fcntl");
+			continue;
+		}
+
+		(void)watchdog_add(pid, fd, timeout);
+	}
+	__unsetenv("TINI_WATCHDOG");
+
+	return 0;
+}
+
+static void watchdog_arm(int tick)
+{
+	struct itimerspec its;
+
+	if (watchdog.tfd == -1 || tick == watchdog.ticking)
+		return;
+
+	(void)memset(&its, 0, sizeof(its));
+	if (tick) {
+		its.it_value.tv_nsec = WATCHDOG_TICK_MS * 1000000L;
+		its.it_interval = its.it_value;
+	}
+
+	if (timerfd_settime(watchdog.tfd, 0, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		return;
+	}
+
+	watchdog.ticking = tick;
+}
+
+static void watchdog_remove(int i)
+{
+	close_and_ignore_error(watchdog.entries[i].fd);
+	close_and_ignore_error(watchdog.entries[i].pidfd);
+	(void)memmove(&watchdog.entries[i], &watchdog.entries[i + 1],
+		      (watchdog.nentries - i - 1) * sizeof(*watchdog.entries));
+	watchdog.nentries--;
+}
+
+/* Kills the processes without a heartbeat since their timeout; respawned */
+static void watchdog_tick(void)
+{
+	uint64_t expirations, now = now_ms();
+	int i;
+
+	if (read(watchdog.tfd, &expirations, sizeof(expirations)) == -1 &&
+	    errno != EAGAIN)
+		perror("read");
+
+	for (i = 0; i < watchdog.nentries; i++) {
+		struct watchdog_entry *e = &watchdog.entries[i];
+		uint64_t beats;
+
+		/* A heartbeat since the last tick */
+		if (read(e->fd, &beats, sizeof(beats)) == sizeof(beats)) {
+			e->deadline = now + e->timeout;
+			continue;
+		}
+
+		if (now < e->deadline)
+			continue;
+
+		fprintf(stderr, "pid %i: No heartbeat for %u ms!\n",
+			(int)e->pid, e->timeout);
+		if (__pidfd_send_signal(e->pidfd, SIGKILL, NULL, 0) == -1) {
+			if (errno != ESRCH)
+				perror("pidfd_send_signal");
+			watchdog_remove(i--);
+			continue;
+		}
+		e->deadline = now + e->timeout;
+	}
+
+	if (watchdog.nentries == 0)
+		watchdog_arm(0);
+}
+
+/* In pid 1: the pid is the peer's, as the kernel tells; never the sender's */
+static int watchdog_add(pid_t pid, int fd, uint32_t timeout)
+{
+	struct watchdog_entry *e;
+	int pidfd;
+
+	pidfd = __pidfd_open(pid, 0);
+	if (pidfd == -1) {
+		int err = errno;
+
+		fprintf(stderr, "pid %i: pidfd_open: %s\n", (int)pid,
+			strerror(err));
+		close_and_ignore_error(fd);
+		errno = err;
+		return -1;
+	}
+
+	e = realloc(watchdog.entries, (watchdog.nentries + 1) * sizeof(*e));
+	if (!e) {
+		perror("realloc");
+		close_and_ignore_error(pidfd);
+		close_and_ignore_error(fd);
+		return -1;
+	}
+	watchdog.entries = e;
+
+	e = &e[watchdog.nentries++];
+	e->pid = pid;
+	e->fd = fd;
+	e->pidfd = pidfd;
+	e->timeout = timeout;
+	e->deadline = now_ms() + timeout;
+	watchdog_arm(1);
+
+	return 0;
+}
+
+static void watchdog_release(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < watchdog.nentries; i++)
+		if (watchdog.entries[i].pid == pid)
+			watchdog_remove(i--);
+}
+
+/* Left open across the execution, as the watched processes are */
+static void watchdog_keep(void)
+{
+	char buf[BUFSIZ];
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < watchdog.nentries; i++) {
+		struct watchdog_entry *e = &watchdog.entries[i];
+		int l;
+
+		l = snprintf(&buf[len], sizeof(buf) - len, "%s%i:%i:%u",
+			     len ? " " : "", (int)e->pid, e->fd, e->timeout);
+		if (l < 0 || (size_t)l >= sizeof(buf) - len) {
+			fprintf(stderr, "pid %i: Too many watched processes!\n",
+				(int)e->pid);
+			break;
+		}
+
+		if (fcntl(e->fd, F_SETFD, 0) == -1) {
+			perror("fcntl");
+			continue;
+		}
+
+		len += l;
+	}
+	buf[len] = '\0';
+
+	if (len > 0 && setenv("TINI_WATCHDOG", buf, 1) == -1)
+		perror("setenv");
+}
+
+/*
+ * Sends a control message to pid 1, and the descriptor fd unless -1; and
+ * waits for the errno it replies with, if any.
+ */
+static int control_send(const char *buf, int fd, int reply)
+{
+	struct timeval tv = {
+		.tv_sec = CONTROL_TIMEOUT_MS / 1000,
+		.tv_usec = (CONTROL_TIMEOUT_MS % 1000) * 1000,
+	};
+	char rbuf[sizeof("-2147483648")];
+	ssize_t l;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct sockaddr_un addr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	socklen_t addrlen;
+	int sfd, ret = -1;
+
+	sfd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (sfd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	/* Not to hang if pid 1 does not accept, the send bounds connect too */
+	if (setsockopt(sfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1 ||
+	    setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+		perror("setsockopt");
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = strlen(buf);
+	(void)memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd != -1) {
+		(void)memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		(void)memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	addrlen = uevent_address(&addr);
+	if (connect(sfd, (struct sockaddr *)&addr, addrlen) == -1)
+		perror("connect");
+	else if (sendmsg(sfd, &msg, 0) == -1)
+		perror("sendmsg");
+	else
+		ret = 0;
+
+	if (ret == 0 && reply) {
+		l = recv(sfd, rbuf, sizeof(rbuf) - 1, 0);
+		if (l <= 0) {
+			errno = l == 0 ? ECONNRESET : errno;
+			ret = -1;
+		} else {
+			rbuf[l] = '\0';
+			errno = strtol(rbuf, NULL, 0);
+			ret = errno ? -1 : 0;
+		}
+	}
+
+	close_and_ignore_error(sfd);
+	return ret;
+}
+
+/*
+ * In the process to watch, before it executes: its eventfd is sent to pid 1,
+ * which tells the pid from the socket; it is left open for the heartbeats.
+ */
+static int watchdog_claim(int timeout)
+{
+	char buf[sizeof("!watchdog ") + 11];
+	int fd;
+
+	fd = eventfd(0, EFD_NONBLOCK);
+	if (fd == -1) {
+		perror("eventfd");
+		return -1;
+	}
+
+	(void)snprintf(buf, sizeof(buf), "!watchdog %i", timeout);
+	if (control_send(buf, fd, 1) == -1) {
+		fprintf(stderr, "watchdog: %s\n", strerror(errno));
+		close_and_ignore_error(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Pid 1 keeps the socket of the standby; the others send it there */
+static int standby_add(uint64_t hash, int instance, pid_t pid, int fd)
+{
+	char buf[sizeof("!standby ") + 11 + 1 + 16 + 1 + 11];
+	struct standby *s;
+	int ret;
+
+	if (ul_fd == -1) {
+		(void)snprintf(buf, sizeof(buf), "!standby %i %016" PRIx64 " %i",
+			       (int)pid, hash, instance);
+		ret = control_send(buf, fd, 0);
+		close_and_ignore_error(fd);
+		return ret;
+	}
+
+	s = realloc(standbys, (nstandbys + 1) * sizeof(*s));
+	if (!s) {
+		perror("realloc");
+		close_and_ignore_error(fd);
+		return -1;
+	}
+	standbys = s;
+
+	s = &standbys[nstandbys++];
+	s->hash = hash;
+	s->instance = instance;
+	s->pid = pid;
+	s->fd = fd;
+	debug("pid %i: standby\n", (int)pid);
+	return 0;
+}
+
+static void standby_remove(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < nstandbys; i++) {
+		if (standbys[i].pid != pid)
+			continue;
+
+		close_and_ignore_error(standbys[i].fd);
+		standbys[i] = standbys[--nstandbys];
+		return;
+	}
+}
+
+/*
+ * The active instance exited: its standby takes its pidfile over, and a new
+ * standby is started while the promoted instance is already serving. A
+ * watched standby gets its eventfd then, last and named @watchdog.
+ */
+static int standby_promote(struct proc *proc)
+{
+	char buf[sizeof("promote\n") +
+		 FDSTORE_MAX * sizeof(((struct fdstore *)0)->name) +
+		 sizeof(" @watchdog")];
+	char cbuf[CMSG_SPACE((FDSTORE_MAX + 1) * sizeof(int))];
+	int fds[FDSTORE_MAX + 1], nfds = 0, i, wd = -1;
+	char pidfile[PATH_MAX];
+	struct cmsghdr *cmsg;
+	struct standby s;
+	struct msghdr msg;
+	struct iovec iov;
+	char *b = buf;
+	FILE *f;
+
+	/* The standby of that very replica */
+	for (i = 0; i < nstandbys; i++)
+		if (standbys[i].hash == proc->hash &&
+		    standbys[i].instance == proc->instance)
+			break;
+
+	if (i == nstandbys)
+		return -1;
+
+	s = standbys[i];
+	standbys[i] = standbys[--nstandbys];
+
+	/* The stored descriptors come along, named in order on the line */
+	b = stpcpy(b, "promote");
+	for (i = 0; i < nfdstores; i++) {
+		if (fdstores[i].pid != proc->oldpid)
+			continue;
+
+		b += sprintf(b, " %s", fdstores[i].name);
+		fds[nfds++] = fdstores[i].fd;
+	}
+
+	if (proc->watchdog > 0) {
+		wd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (wd == -1) {
+			perror("eventfd");
+		} else {
+			b = stpcpy(b, " @watchdog");
+			fds[nfds++] = wd;
+		}
+	}
+	b = stpcpy(b, "\n");
+
+	iov.iov_base = buf;
+	iov.iov_len = b - buf;
+	(void)memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds > 0) {
+		(void)memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		(void)memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	if (sendmsg(s.fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL) == -1) {
+		fprintf(stderr, "pid %i: sendmsg: %s\n", (int)s.pid,
+			strerror(errno));
+		close_and_ignore_error(s.fd);
+		if (wd != -1)
+			close_and_ignore_error(wd);
+		return -1;
+	}
+	close_and_ignore_error(s.fd);
+	if (wd != -1)
+		(void)watchdog_add(s.pid, wd, proc->watchdog);
+	fdstore_move(proc->oldpid, s.pid);
+	verbose("pid %i promoted\n", (int)s.pid);
+
+	proc->pid = s.pid;
+	proc->spawned = time(NULL);
+	proc->counter++;
+	(void)snprintf(pidfile, sizeof(pidfile), "/run/tini/%i", (int)s.pid);
+	f = fopen(pidfile, "w");
+	if (!f) {
+		fprintf(stderr, "%s: fopen: %s\n", pidfile, strerror(errno));
+	} else {
+		(void)pidfile_write(f, proc);
+
+		if (fclose(f) == -1)
+			perror("fclose");
+	}
+
+	proc->waiting = 1;
+	(void)respawn(proc);
+	proc->waiting = 0;
+	return 0;
+}
+
+/*
+ * Replaces the descriptor of that name, or removes it if fd is -1; only root
+ * or the user that stored it can.
+ */
+static int fdstore_add(pid_t pid, uid_t uid, const char *name, int fd)
+{
+	struct fdstore *e;
+	int i, n = 0;
+
+	for (i = 0; i < nfdstores; i++) {
+		e = &fdstores[i];
+		if (e->pid != pid)
+			continue;
+
+		if (strcmp(e->name, name) != 0) {
+			n++;
+			continue;
+		}
+
+		if (uid != 0 && uid != e->uid) {
+			if (fd != -1)
+				close_and_ignore_error(fd);
+			errno = EPERM;
+			return -1;
+		}
+
+		close_and_ignore_error(e->fd);
+		if (fd == -1) {
+			fdstores[i] = fdstores[--nfdstores];
+			return 0;
+		}
+
+		e->uid = uid;
+		e->fd = fd;
+		return 0;
+	}
+
+	if (fd == -1)
+		return 0;
+
+	if (n == FDSTORE_MAX) {
+		close_and_ignore_error(fd);
+		errno = EMFILE;
+		return -1;
+	}
+
+	e = realloc(fdstores, (nfdstores + 1) * sizeof(*e));
+	if (!e) {
+		close_and_ignore_error(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+	fdstores = e;
+
+	e = &fdstores[nfdstores++];
+	e->pid = pid;
+	e->uid = uid;
+	(void)snprintf(e->name, sizeof(e->name), "%s", name);
+	e->fd = fd;
+	debug("pid %i: stored %s\n", (int)pid, name);
+	return 0;
+}
+
+static void fdstore_move(pid_t from, pid_t to)
+{
+	int i;
+
+	for (i = 0; i < nfdstores; i++)
+		if (fdstores[i].pid == from)
+			fdstores[i].pid = to;
+}
+
+/* The process is not respawned: its descriptors are released */
+static void fdstore_remove(pid_t pid)
+{
+	int i = 0;
+
+	while (i < nfdstores) {
+		if (fdstores[i].pid != pid) {
+			i++;
+			continue;
+		}
+
+		close_and_ignore_error(fdstores[i].fd);
+		fdstores[i] = fdstores[--nfdstores];
+	}
+}
+
+/* In the new instance, before it executes; above where they are moved to */
+static int fdstore_dup(pid_t pid, int fds[], const char *names[])
+{
+	int i, n = 0;
+
+	for (i = 0; i < nfdstores && n < FDSTORE_MAX; i++) {
+		if (fdstores[i].pid != pid)
+			continue;
+
+		fds[n] = fcntl(fdstores[i].fd, F_DUPFD_CLOEXEC,
+			       FDSTORE_FILENO + FDSTORE_MAX);
+		if (fds[n] == -1) {
+			perror("fcntl");
+			continue;
+		}
+		names[n++] = fdstores[i].name;
+	}
+
+	return n;
+}
+
+/* Left open across the execution, as the processes they belong to are */
+static void fdstore_keep(void)
+{
+	size_t size, len = 0;
+	char *buf;
+	int i;
+
+	if (nfdstores == 0)
+		return;
+
+	size = nfdstores * (sizeof("-2147483648:2147483647:4294967295: ") +
+			    sizeof(((struct fdstore *)0)->name));
+	buf = malloc(size);
+	if (!buf) {
+		perror("malloc");
+		return;
+	}
+
+	buf[0] = '\0';
+	for (i = 0; i < nfdstores; i++) {
+		if (fcntl(fdstores[i].fd, F_SETFD, 0) == -1) {
+			perror("fcntl");
+			continue;
+		}
+
+		len += snprintf(&buf[len], size - len, "%s%i:%i:%u:%s",
+				len ? " " : "", (int)fdstores[i].pid,
+				fdstores[i].fd, (unsigned int)fdstores[i].uid,
+				fdstores[i].name);
+	}
+
+	if (len > 0 && setenv("TINI_FDSTORE", buf, 1) == -1)
+		perror("setenv");
+	free(buf);
+}
+
+/* The descriptors left open by the previous execution, if any */
+static void fdstore_resume(void)
+{
+	const char *s;
+	char *end;
+
+	/* PID:FD:UID:NAME, space-separated */
+	for (s = __getenv("TINI_FDSTORE", ""); *s; s = end) {
+		char name[sizeof(((struct fdstore *)0)->name)];
+		size_t l;
+		pid_t pid;
+		uid_t uid;
+		int fd;
+
+		pid = strtol(s, &end, 10);
+		if (*end++ != ':')
+			break;
+		fd = strtol(end, &end, 10);
+		if (*end++ != ':')
+			break;
+		uid = strtoul(end, &end, 10);
+		if (*end++ != ':')
+			break;
+		l = strcspn(end, " ");
+		if (l >= sizeof(name))
+			break;
+		(void)memcpy(name, end, l);
+		name[l] = '\0';
+		end += l;
+		while (*end == ' ')
+			end++;
+
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+			perror("fcntl");
+			continue;
+		}
+
+		if (fdstore_name(name) == -1) {
+			close_and_ignore_error(fd);
+			continue;
+		}
+
+		(void)fdstore_add(pid, uid, name, fd);
+	}
+	__unsetenv("TINI_FDSTORE");
+}
+
+/* A part of the name of a variable */
+static int fdstore_name(const char *name)
+{
+	if (*name == '\0' ||
+	    strlen(name) >= sizeof(((struct fdstore *)0)->name) ||
+	    name[strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+			      "abcdefghijklmnopqrstuvwxyz"
+			      "0123456789_")] != '\0') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The supervised process the peer is, or descends from */
+static pid_t fdstore_owner(pid_t pid)
+{
+	char path[PATH_MAX], buf[BUFSIZ], *s;
+	ssize_t l;
+	int fd;
+
+	while (pid > 1) {
+		(void)snprintf(path, sizeof(path), "/run/tini/%i", (int)pid);
+		if (access(path, F_OK) == 0)
+			return pid;
+
+		(void)snprintf(path, sizeof(path), "/proc/%i/stat", (int)pid);
+		fd = open(path, O_RDONLY|O_CLOEXEC);
+		if (fd == -1)
+			return -1;
+
+		l = read(fd, buf, sizeof(buf) - 1);
+		close_and_ignore_error(fd);
+		if (l <= 0)
+			return -1;
+		buf[l] = '\0';
+
+		/* The comm may have spaces and parentheses */
+		s = strrchr(buf, ')');
+		if (!s || sscanf(s + 1, " %*c %i", &pid) != 1)
+			return -1;
+	}
+
+	return -1;
+}
+
+/* Root, or the user the supervised process runs as */
+static int fdstore_permitted(pid_t pid, uid_t uid)
+{
+	char path[sizeof("/proc/2147483647")];
+	struct stat statbuf;
+
+	if (uid == 0)
+		return 0;
+
+	(void)snprintf(path, sizeof(path), "/proc/%i", (int)pid);
+	if (stat(path, &statbuf) == -1)
+		return -1;
+
+	if (statbuf.st_uid != uid) {
+		errno = EPERM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The file, or the directory and what is in it, not crossing mountpoints */
+static void initramfs_remove(int dfd, const char *name, dev_t dev)
+{
+	struct dirent *entry;
+	struct stat statbuf;
+	DIR *dir;
+	int fd;
+
+	if (fstatat(dfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1 ||
+	    statbuf.st_dev != dev)
+		return;
+
+	if (S_ISDIR(statbuf.st_mode)) {
+		fd = openat(dfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+		if (fd == -1)
+			return;
+
+		dir = fdopendir(fd);
+		if (!dir) {
+			close_and_ignore_error(fd);
+			return;
+		}
+
+		while ((entry = readdir(dir))) {
+			if (strcmp(entry->d_name, ".") == 0 ||
+			    strcmp(entry->d_name, "..") == 0)
+				continue;
+
+			initramfs_remove(fd, entry->d_name, dev);
+		}
+
+		if (closedir(dir) == -1)
+			perror("closedir");
+	}
+
+	(void)unlinkat(dfd, name, S_ISDIR(statbuf.st_mode) ? AT_REMOVEDIR : 0);
+}
+
+/* Every directory of the old root in a process of its own; not waited */
+static void initramfs_free(int dfd, dev_t dev)
+{
+	struct dirent *entry;
+	DIR *dir;
+	pid_t pid;
+	int fd;
+
+	fd = dup(dfd);
+	if (fd == -1) {
+		perror("dup");
+		return;
+	}
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		perror("fdopendir");
+		close_and_ignore_error(fd);
+		return;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		if (entry->d_type != DT_DIR) {
+			initramfs_remove(dfd, entry->d_name, dev);
+			continue;
+		}
+
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			initramfs_remove(dfd, entry->d_name, dev);
+			continue;
+		} else if (pid > 0) {
+			continue;
+		}
+
+		/* Not to keep the sockets of pid 1 open */
+		if (dup2(dfd, STDERR_FILENO + 1) == -1)
+			_exit(EXIT_FAILURE);
+		(void)__close_range(STDERR_FILENO + 2, ~0U, 0);
+
+		initramfs_remove(STDERR_FILENO + 1, entry->d_name, dev);
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (closedir(dir) == -1)
+		perror("closedir");
+}
+
+/* The tree of a directory into another: directories, files and links */
+static int tree_copy(int sfd, int dfd)
+{
+	struct dirent *entry;
+	struct stat statbuf;
+	int fd, ret = 0;
+	DIR *dir;
+
+	fd = dup(sfd);
+	if (fd == -1) {
+		perror("dup");
+		return -1;
+	}
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		perror("fdopendir");
+		close_and_ignore_error(fd);
+		return -1;
+	}
+
+	while ((entry = readdir(dir))) {
+		const char *name = entry->d_name;
+		int s = -1, d = -1;
+
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+
+		if (fstatat(sfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1)
+			goto error;
+
+		if (S_ISDIR(statbuf.st_mode)) {
+			if (mkdirat(dfd, name, 0700) == -1 && errno != EEXIST)
+				goto error;
+
+			s = openat(sfd, name,
+				   O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+			d = openat(dfd, name,
+				   O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+			if (s == -1 || d == -1)
+				goto error;
+
+			if (tree_copy(s, d) == -1)
+				ret = -1;
+		} else if (S_ISREG(statbuf.st_mode)) {
+			off_t off = 0;
+			ssize_t l;
+
+			s = openat(sfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+			if (s == -1)
+				goto error;
+
+			d = openat(dfd, name,
+				   O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC,
+				   0600);
+			if (d == -1)
+				goto error;
+
+			while (off < statbuf.st_size) {
+				l = sendfile(d, s, &off, statbuf.st_size - off);
+				if (l == -1)
+					goto error;
+				else if (l == 0)
+					break;
+			}
+		} else if (S_ISLNK(statbuf.st_mode)) {
+			char link[PATH_MAX];
+			ssize_t l;
+
+			l = readlinkat(sfd, name, link, sizeof(link) - 1);
+			if (l == -1)
+				goto error;
+			link[l] = '\0';
+
+			if (symlinkat(link, dfd, name) == -1 && errno != EEXIST)
+				goto error;
+		} else {
+			/* Sockets and FIFOs are bound to their inode */
+			debug("%s: Not copied\n", name);
+			continue;
+		}
+
+		if (fchownat(dfd, name, statbuf.st_uid, statbuf.st_gid,
+			     AT_SYMLINK_NOFOLLOW) == -1 ||
+		    (!S_ISLNK(statbuf.st_mode) &&
+		     fchmodat(dfd, name, statbuf.st_mode & 07777, 0) == -1))
+			goto error;
+
+		if (s != -1)
+			close_and_ignore_error(s);
+		if (d != -1)
+			close_and_ignore_error(d);
+		continue;
+
+	error:
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		if (s != -1)
+			close_and_ignore_error(s);
+		if (d != -1)
+			close_and_ignore_error(d);
+		ret = -1;
+	}
+
+	if (closedir(dir) == -1)
+		perror("closedir");
+
+	return ret;
+}
+
+/* A tmpfs on target, with the tree of source, that is no mountpoint */
+static int switch_root_copy(const char *source, const char *target)
+{
+	int sfd = -1, dfd = -1, ret = -1;
+
+	if (mount("tmpfs", target, "tmpfs", MS_NOSUID|MS_NODEV,
+		  "mode=0755") == -1) {
+		fprintf(stderr, "%s: mount: %s\n", target, strerror(errno));
+		return -1;
+	}
+
+	sfd = open(source, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (sfd == -1) {
+		fprintf(stderr, "%s: open: %s\n", source, strerror(errno));
+		goto exit;
+	}
+
+	dfd = open(target, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd == -1) {
+		fprintf(stderr, "%s: open: %s\n", target, strerror(errno));
+		goto exit;
+	}
+
+	ret = tree_copy(sfd, dfd);
+	if (ret == -1)
+		fprintf(stderr, "%s: Cannot copy!\n", source);
+
+exit:
+	if (dfd != -1)
+		close_and_ignore_error(dfd);
+	if (sfd != -1)
+		close_and_ignore_error(sfd);
+
+	if (ret == -1 && umount2(target, 0) == -1)
+		fprintf(stderr, "%s: umount2: %s\n", target, strerror(errno));
+
+	return ret;
+}
+
+/* The path NAME under the new root PATH, or ENAMETOOLONG */
+static int switch_root_path(char *buf, const char *path, const char *name)
+{
+	if ((size_t)snprintf(buf, PATH_MAX, "%s%s%s", path,
+			     *name == '/' ? "" : "/", name) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static const char * const switch_root_mounts[] = {
+	"/dev", "/proc", "/sys", "/run"
+};
+
+/*
+ * The new root is a mountpoint with init in there, and every target is a
+ * directory, created if missing; it is checked before tini is re-executed.
+ * The mounts to skip, and to copy, are returned.
+ */
+static int switch_root_check(const char *path, const char *init,
+			     unsigned int *skipped, unsigned int *copied)
+{
+	struct stat root, statbuf;
+	char target[PATH_MAX];
+	unsigned int i;
+
+	*skipped = 0;
+	*copied = 0;
+
+	if (stat("/", &root) == -1 || stat(path, &statbuf) == -1) {
+		fprintf(stderr, "%s: stat: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (!S_ISDIR(statbuf.st_mode)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(ENOTDIR));
+		errno = ENOTDIR;
+		return -1;
+	} else if (statbuf.st_dev == root.st_dev) {
+		fprintf(stderr, "%s: Not a mountpoint!\n", path);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (switch_root_path(target, path, init) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (access(target, X_OK) == -1) {
+		fprintf(stderr, "%s: access: %s\n", target, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(switch_root_mounts) /
+			sizeof(*switch_root_mounts); i++) {
+		const char *mnt = switch_root_mounts[i];
+
+		if (stat(mnt, &statbuf) == -1) {
+			*skipped |= 1U << i;
+			continue;
+		} else if (statbuf.st_dev == root.st_dev &&
+			   strcmp(mnt, "/run") == 0) {
+			*copied |= 1U << i;
+		} else if (statbuf.st_dev == root.st_dev) {
+			debug("%s: Not mounted\n", mnt);
+			*skipped |= 1U << i;
+			continue;
+		}
+
+		if (switch_root_path(target, path, mnt) == -1) {
+			fprintf(stderr, "%s%s: %s\n", path, mnt,
+				strerror(errno));
+			return -1;
+		}
+
+		if (mkdir(target, 0755) == -1 && errno != EEXIST) {
+			fprintf(stderr, "%s: mkdir: %s\n", target,
+				strerror(errno));
+			return -1;
+		}
+
+		if (stat(target, &statbuf) == -1) {
+			fprintf(stderr, "%s: stat: %s\n", target,
+				strerror(errno));
+			return -1;
+		} else if (!S_ISDIR(statbuf.st_mode)) {
+			fprintf(stderr, "%s: %s\n", target, strerror(ENOTDIR));
+			errno = ENOTDIR;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Moves /dev, /proc, /sys and /run to the new root and makes it the root;
+ * nothing is moved unless it passes the checks above, and what was moved is
+ * moved back on failure. A /run that is no mountpoint is copied to a tmpfs
+ * instead, as it has the pidfiles. The old root is then freed if it is the
+ * initramfs.
+ */
+static int switch_root(const char *path, const char *init)
+{
+	const char * const *mounts = switch_root_mounts;
+	unsigned int i, skipped, copied, moved = 0;
+	char target[PATH_MAX];
+	struct statfs fs;
+	struct stat root;
+	int dfd = -1;
+
+	/* Every target first, not to be left halfway */
+	if (stat("/", &root) == -1 ||
+	    switch_root_check(path, init, &skipped, &copied) == -1)
+		return -1;
+
+	if (statfs("/", &fs) == 0 &&
+	    (fs.f_type == RAMFS_MAGIC || fs.f_type == TMPFS_MAGIC)) {
+		dfd = open("/", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		if (dfd == -1)
+			perror("open");
+	}
+
+	for (i = 0; i < sizeof(switch_root_mounts) /
+			sizeof(*switch_root_mounts); i++) {
+		if (skipped & (1U << i))
+			continue;
+
+		(void)switch_root_path(target, path, mounts[i]);
+		if (copied & (1U << i)) {
+			if (switch_root_copy(mounts[i], target) == -1)
+				goto restore;
+			moved |= 1U << i;
+			continue;
+		}
+
+		if (mount(mounts[i], target, NULL, MS_MOVE, NULL) == -1) {
+			fprintf(stderr, "%s: mount: %s\n", target,
+				strerror(errno));
+			goto restore;
+		}
+		moved |= 1U << i;
+	}
+
+	if (chdir(path) == -1) {
+		perror("chdir");
+		goto restore;
+	}
+
+	if (mount(path, "/", NULL, MS_MOVE, NULL) == -1) {
+		perror("mount");
+		if (chdir("/") == -1)
+			perror("chdir");
+		goto restore;
+	}
+
+	if (chroot(".") == -1 || chdir("/") == -1) {
+		perror("chroot");
+		goto error;
+	}
+	stage("switch-root");
+
+	if (dfd != -1) {
+		initramfs_free(dfd, root.st_dev);
+		close_and_ignore_error(dfd);
+	}
+
+	return 0;
+
+restore:
+	/* Back where they were, rather than detached */
+	for (i = sizeof(switch_root_mounts) / sizeof(*switch_root_mounts);
+	     i-- > 0; ) {
+		if (!(moved & (1U << i)))
+			continue;
+
+		(void)switch_root_path(target, path, mounts[i]);
+		if (copied & (1U << i)) {
+			if (umount2(target, 0) == -1)
+				fprintf(stderr, "%s: umount2: %s\n", target,
+					strerror(errno));
+			continue;
+		}
+
+		if (mount(target, mounts[i], NULL, MS_MOVE, NULL) == -1)
+			fprintf(stderr, "%s: mount: %s\n", mounts[i],
+				strerror(errno));
+	}
+
+error:
+	if (dfd != -1)
+		close_and_ignore_error(dfd);
+	return -1;
+}
+
+static int psi_open(void)
+{
+	unsigned long window;
+	unsigned int i;
+	int n = 0;
+
+	for (i = 0; i < sizeof(psis) / sizeof(*psis); i++) {
+		struct psi *p = &psis[i];
+
+		p->fd = open(p->path, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+		if (p->fd == -1) {
+			/* CONFIG_PSI=n */
+			debug("%s: open: %s\n", p->path, strerror(errno));
+			continue;
+		}
+
+		if (write(p->fd, p->trigger, strlen(p->trigger) + 1) == -1) {
+			fprintf(stderr, "%s: write: %s\n", p->path,
+				strerror(errno));
+			goto close;
+		}
+
+		/* some|full STALL WINDOW, in us */
+		if (sscanf(p->trigger, "%*s %*u %lu", &window) == 1 &&
+		    (long)(window / 1000) > psi_hold / 2)
+			psi_hold = window / 1000 * 2;
+
+		if (epoll_watch_events(p->fd, EPOLLPRI) == -1)
+			goto close;
+
+		n++;
+		continue;
+
+	close:
+		close_and_ignore_error(p->fd);
+		p->fd = -1;
+	}
+
+	if (n == 0)
+		return -1;
+
+	psi_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (psi_tfd == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	if (epoll_watch(psi_tfd) == -1) {
+		close_and_ignore_error(psi_tfd);
+		psi_tfd = -1;
+		return -1;
+	}
+
+	return n;
+}
+
+static int psi_lookup(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(psis) / sizeof(*psis); i++)
+		if (psis[i].fd != -1 && psis[i].fd == fd)
+			return i;
+
+	return -1;
+}
+
+/*
+ * The triggers fire at most once per window; hold the pressure for two of the
+ * longest, so that it is not released between two triggers.
+ */
+static void psi_hold_arm(void)
+{
+	struct itimerspec its;
+
+	(void)memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = psi_hold / 1000;
+	its.it_value.tv_nsec = (psi_hold % 1000) * 1000000;
+	if (timerfd_settime(psi_tfd, 0, &its, NULL) == -1)
+		perror("timerfd_settime");
+}
+
+static void psi_trigger(void)
+{
+	psi_hold_arm();
+
+	if (pressure)
+		return;
+
+	pressure = 1;
+	verbose("pressure: on\n");
+
+	if (psi_freeze) {
+		int sig = SIGSTOP;
+
+		(void)dir_parse("/run/tini", pidfile_freeze, &sig);
+	}
+
+	(void)netlink_throttle();
+}
+
+static void psi_release(void)
+{
+	uint64_t expirations;
+
+	if (read(psi_tfd, &expirations, sizeof(expirations)) == -1) {
+		if (errno != EAGAIN)
+			perror("read");
+		return;
+	}
+
+	pressure = 0;
+	verbose("pressure: off\n");
+
+	if (psi_freeze) {
+		int sig = SIGCONT;
+
+		(void)dir_parse("/run/tini", pidfile_freeze, &sig);
+	}
+
+	proc_release();
+	(void)netlink_throttle();
+}
+
+/*
+ * Hold the uevents back while the handlers are at their limit; the socket is
+ * still drained, so that the kernel does not drop them (ENOBUFS).
+ */
+static int netlink_throttle(void)
+{
+	int throttle = pressure && nrunners >= UEVENT_HANDLERS_UNDER_PRESSURE;
+
+	if (throttle == nl_throttled)
+		return throttle;
+
+	/* Release the uevents held meanwhile */
+	if (!throttle && co_tfd != -1)
+		held_arm(0);
+
+	nl_throttled = throttle;
+	debug("uevents: %s\n", throttle ? "throttled" : "unthrottled");
+	return throttle;
+}
+
+struct readahead_file {
+	dev_t dev;
+	ino_t ino;
+	char *path;
+};
+
+struct readahead_range {
+	dev_t dev;
+	uint64_t physical;
+	off_t offset;
+	off_t length;
+	const char *path;
+};
+
+static uint64_t fiemap_physical(int fd, off_t offset, off_t length)
+{
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} fm;
+
+	(void)memset(&fm, 0, sizeof(fm));
+	fm.map.fm_start = offset;
+	fm.map.fm_length = length;
+	fm.map.fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm) == -1 ||
+	    fm.map.fm_mapped_extents == 0 ||
+	    (uint64_t)offset < fm.extent.fe_logical)
+		return 0;
+
+	return fm.extent.fe_physical + (offset - fm.extent.fe_logical);
+}
+
+static int readahead_range_cmp(const void *p1, const void *p2)
+{
+	const struct readahead_range *r1 = p1, *r2 = p2;
+
+	if (r1->dev != r2->dev)
+		return r1->dev < r2->dev ? -1 : 1;
+
+	if (r1->physical != r2->physical)
+		return r1->physical < r2->physical ? -1 : 1;
+
+	if (r1->path != r2->path)
+		return strcmp(r1->path, r2->path);
+
+	return r1->offset < r2->offset ? -1 : r1->offset > r2->offset;
+}
+
+/* Append the page cache resident ranges of the file */
+static int readahead_ranges(const struct readahead_file *file,
+			    struct readahead_range **ranges, int *nranges)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	unsigned char *vec = NULL;
+	void *addr = MAP_FAILED;
+	struct stat st;
+	size_t i, pages;
+	int fd, ret = -1;
+
+	fd = open(file->path, O_RDONLY|O_NOATIME|O_CLOEXEC);
+	if (fd == -1)
+		fd = open(file->path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		goto exit;
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto exit;
+
+	pages = (st.st_size + pagesize - 1) / pagesize;
+	vec = malloc(pages);
+	if (!vec || mincore(addr, st.st_size, vec) == -1)
+		goto exit;
+
+	for (i = 0; i < pages; i++) {
+		struct readahead_range *r;
+		size_t first = i;
+
+		if (!(vec[i] & 1))
+			continue;
+
+		while (i + 1 < pages && (vec[i + 1] & 1))
+			i++;
+
+		r = realloc(*ranges, (*nranges + 1) * sizeof(*r));
+		if (!r)
+			goto exit;
+		*ranges = r;
+
+		r = &(*ranges)[(*nranges)++];
+		r->dev = st.st_dev;
+		r->offset = (off_t)first * pagesize;
+		r->length = (off_t)(i - first + 1) * pagesize;
+		if (r->offset + r->length > st.st_size)
+			r->length = st.st_size - r->offset;
+		r->physical = fiemap_physical(fd, r->offset, r->length);
+		r->path = file->path;
+	}
+
+	ret = 0;
+
+exit:
+	free(vec);
+	if (addr != MAP_FAILED)
+		(void)munmap(addr, st.st_size);
+	close_and_ignore_error(fd);
+	return ret;
+}
+
+/*
+ * Record the files opened during the first seconds, then the ranges that
+ * are in the page cache, in the on-disk order: PHYSICAL OFFSET LENGTH PATH.
+ */
+static int readahead_record(const char *list, int seconds)
+{
+	struct readahead_range *ranges = NULL;
+	struct readahead_file *files = NULL;
+	int fd, i, nfiles = 0, nranges = 0;
+	char tmp[PATH_MAX];
+	struct timespec end;
+	FILE *f;
+
+	fd = fanotify_init(FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK,
+			   O_RDONLY|O_LARGEFILE|O_CLOEXEC);
+	if (fd == -1) {
+		perror("fanotify_init");
+		return -1;
+	}
+
+	if (fanotify_mark(fd, FAN_MARK_ADD|FAN_MARK_MOUNT,
+			  FAN_OPEN|FAN_ACCESS, AT_FDCWD, "/") == -1) {
+		perror("fanotify_mark");
+		close_and_ignore_error(fd);
+		return -1;
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += seconds;
+
+	for (;;) {
+		char buf[4096]
+		   __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+		struct fanotify_event_metadata *m;
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		struct timespec now;
+		ssize_t l;
+		int ms;
+
+		(void)clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (end.tv_sec - now.tv_sec) * 1000 +
+		     (end.tv_nsec - now.tv_nsec) / 1000000;
+		if (ms <= 0)
+			break;
+
+		if (poll(&pfd, 1, ms) <= 0)
+			continue;
+
+		l = read(fd, buf, sizeof(buf));
+		if (l <= 0)
+			continue;
+
+		for (m = (struct fanotify_event_metadata *)buf;
+		     FAN_EVENT_OK(m, l); m = FAN_EVENT_NEXT(m, l)) {
+			char path[PATH_MAX], proc[64];
+			struct readahead_file *file;
+			struct stat st;
+			ssize_t len;
+
+			if (m->fd < 0)
+				continue;
+
+			if (fstat(m->fd, &st) == -1 || !S_ISREG(st.st_mode))
+				goto next;
+
+			for (i = 0; i < nfiles; i++)
+				if (files[i].dev == st.st_dev &&
+				    files[i].ino == st.st_ino)
+					break;
+			if (i < nfiles)
+				goto next;
+
+			(void)snprintf(proc, sizeof(proc), "/proc/self/fd/%i",
+				       m->fd);
+			len = readlink(proc, path, sizeof(path) - 1);
+			if (len <= 0)
+				goto next;
+			path[len] = '\0';
+
+			/* The list is line based */
+			if (strchr(path, '\n'))
+				goto next;
+
+			file = realloc(files, (nfiles + 1) * sizeof(*file));
+			if (!file)
+				goto next;
+			files = file;
+
+			file = &files[nfiles];
+			file->dev = st.st_dev;
+			file->ino = st.st_ino;
+			file->path = strdup(path);
+			if (file->path)
+				nfiles++;
+
+		next:
+			close_and_ignore_error(m->fd);
+		}
+	}
+
+	close_and_ignore_error(fd);
+
+	for (i = 0; i < nfiles; i++)
+		(void)readahead_ranges(&files[i], &ranges, &nranges);
+
+	qsort(ranges, nranges, sizeof(*ranges), readahead_range_cmp);
+
+	(void)snprintf(tmp, sizeof(tmp), "%s.tmp", list);
+	mkdir_parents(tmp);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror("fopen");
+		goto exit;
+	}
+
+	for (i = 0; i < nranges; i++)
+		fprintf(f, "%" PRIu64 " %lli %lli %s\n", ranges[i].physical,
+			(long long)ranges[i].offset,
+			(long long)ranges[i].length, ranges[i].path);
+
+	if (fclose(f) == EOF || rename(tmp, list) == -1) {
+		perror("readahead");
+		(void)unlink(tmp);
+		goto exit;
+	}
+
+	verbose("%s: %i files, %i ranges\n", list, nfiles, nranges);
+
+exit:
+	for (i = 0; i < nfiles; i++)
+		free(files[i].path);
+	free(files);
+	free(ranges);
+	return 0;
+}
+
+static int readahead_replay(const char *list)
+{
+	char *line = NULL, *path = NULL;
+	int fd = -1, n = 0;
+	size_t size = 0;
+	FILE *f;
+
+	f = fopen(list, "r");
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+
+	while (getline(&line, &size, f) != -1) {
+		long long offset, length;
+		int pos;
+
+		if (sscanf(line, "%*u %lli %lli %n", &offset, &length,
+			   &pos) != 2)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+
+		/* The ranges of a file are likely to follow each other */
+		if (!path || strcmp(path, &line[pos]) != 0) {
+			if (fd != -1)
+				close_and_ignore_error(fd);
+			free(path);
+			path = strdup(&line[pos]);
+			fd = open(&line[pos], O_RDONLY|O_CLOEXEC);
+		}
+
+		if (fd != -1 && readahead(fd, offset, length) == 0)
+			n++;
+	}
+
+	if (fd != -1)
+		close_and_ignore_error(fd);
+	free(path);
+	free(line);
+	fclose(f);
+
+	verbose("%s: %i ranges read ahead\n", list, n);
+	return 0;
+}
+
+/* In the background, at idle priority, while rcS runs */
+static pid_t readahead_start(const char *list, int seconds)
+{
+	pid_t pid;
+	int ret;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	} else if (pid > 0) {
+		return pid;
+	}
+
+	(void)netlink_close(nl_fd);
+	if (__ioprio_set(IOPRIO_WHO_PROCESS, 0,
+			 IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+		perror("ioprio_set");
+	if (setpriority(PRIO_PROCESS, 0, 19) == -1)
+		perror("setpriority");
+
+	if (access(list, R_OK) == 0)
+		ret = readahead_replay(list);
+	else
+		ret = readahead_record(list, seconds);
+
+	_exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+#ifndef KEXEC_KERNEL
+#define KEXEC_KERNEL "/boot/vmlinuz-%s"
+#endif
+
+#ifndef KEXEC_INITRD
+#define KEXEC_INITRD "/boot/initrd.img-%s"
+#endif
+
+#ifndef KEXEC_LOADED
+#define KEXEC_LOADED "/sys/kernel/kexec_loaded"
+#endif
+
+/* The value queued with SIGINT by reboot --kexec */
+#define REBOOT_KEXEC 1
+
+/* Loads the kernel to jump to at reboot; no initrd if NULL */
+static int kexec_load(const char *kernel, const char *initrd,
+		      const char *cmdline)
+{
+	unsigned long flags = 0;
+	int kfd, ifd = -1;
+	int ret = -1;
+
+	kfd = open(kernel, O_RDONLY|O_CLOEXEC);
+	if (kfd == -1) {
+		fprintf(stderr, "%s: %s\n", kernel, strerror(errno));
+		return -1;
+	}
+
+	if (!initrd) {
+		flags |= KEXEC_FILE_NO_INITRAMFS;
+	} else {
+		ifd = open(initrd, O_RDONLY|O_CLOEXEC);
+		if (ifd == -1) {
+			fprintf(stderr, "%s: %s\n", initrd, strerror(errno));
+			goto exit;
+		}
+	}
+
+	if (__kexec_file_load(kfd, ifd, strlen(cmdline) + 1, cmdline,
+			      flags) == -1) {
+		perror("kexec_file_load");
+		goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	if (ifd != -1)
+		close_and_ignore_error(ifd);
+	close_and_ignore_error(kfd);
+	return ret;
+}
+
+/* Not to be jumped to by a later reboot that did not ask for it */
+static void kexec_unload(void)
+{
+	if (__kexec_file_load(-1, -1, 0, NULL, KEXEC_FILE_UNLOAD) == -1)
+		perror("kexec_file_load");
+}
+
+static int kexec_loaded(void)
+{
+	char c = '0';
+	int fd;
+
+	fd = open(KEXEC_LOADED, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+
+	if (read(fd, &c, 1) == -1)
+		perror("read");
+	close_and_ignore_error(fd);
+
+	return c == '1';
+}
+
+#ifndef FSTAB
+#define FSTAB "/etc/fstab"
+#endif
+
+#ifndef FSCK
+#define FSCK "/sbin/fsck"
+#endif
+
+#ifndef FINDFS
+#define FINDFS "/sbin/findfs"
+#endif
+
+enum {
+	MOUNT_WAITING,
+	MOUNT_RUNNING,
+	MOUNT_DONE,
+	MOUNT_FAILED,
+};
+
+struct mount_entry {
+	char *fsname; /* the device, once resolved */
+	char *dir;
+	char *type;
+	char *opts;
+	int passno;
+	int nofail;
+	int parent; /* the entry mounted beneath, -1 if none */
+	dev_t disk; /* checked once at a time, 0 if not a block device */
+	int state;
+	pid_t pid;
+};
+
+static const struct {
+	const char *name;
+	unsigned long set;
+	unsigned long clear;
+} mount_flags[] = {
+	{ "defaults",    0,              0 },
+	{ "ro",          MS_RDONLY,      0 },
+	{ "rw",          0,              MS_RDONLY },
+	{ "nosuid",      MS_NOSUID,      0 },
+	{ "suid",        0,              MS_NOSUID },
+	{ "nodev",       MS_NODEV,       0 },
+	{ "dev",         0,              MS_NODEV },
+	{ "noexec",      MS_NOEXEC,      0 },
+	{ "exec",        0,              MS_NOEXEC },
+	{ "sync",        MS_SYNCHRONOUS, 0 },
+	{ "async",       0,              MS_SYNCHRONOUS },
+	{ "dirsync",     MS_DIRSYNC,     0 },
+	{ "noatime",     MS_NOATIME,     0 },
+	{ "atime",       0,              MS_NOATIME },
+	{ "nodiratime",  MS_NODIRATIME,  0 },
+	{ "diratime",    0,              MS_NODIRATIME },
+	{ "relatime",    MS_RELATIME,    0 },
+	{ "norelatime",  0,              MS_RELATIME },
+	{ "strictatime", MS_STRICTATIME, 0 },
+	{ "lazytime",    MS_LAZYTIME,    0 },
+	{ "bind",        MS_BIND,        0 },
+	{ "rbind",       MS_BIND|MS_REC, 0 },
+	/* For mount(8) rather than for the kernel */
+	{ "auto",        0,              0 },
+	{ "noauto",      0,              0 },
+	{ "nofail",      0,              0 },
+	{ "user",        0,              0 },
+	{ "nouser",      0,              0 },
+	{ "users",       0,              0 },
+	{ "_netdev",     0,              0 },
+};
+
+/* The flags, and the options left to the file-system as data */
+static unsigned long mount_options(const char *opts, char *data, size_t size)
+{
+	unsigned long flags = 0;
+	const char *s = opts;
+	size_t len = 0;
+
+	data[0] = '\0';
+	while (*s) {
+		size_t l = strcspn(s, ",");
+		unsigned int i;
+
+		for (i = 0; i < sizeof(mount_flags) / sizeof(*mount_flags); i++)
+			if (strlen(mount_flags[i].name) == l &&
+			    strncmp(s, mount_flags[i].name, l) == 0)
+				break;
+
+		if (i < sizeof(mount_flags) / sizeof(*mount_flags)) {
+			flags |= mount_flags[i].set;
+			flags &= ~mount_flags[i].clear;
+		} else if (__strncmp(s, "x-") != 0 && len + l + 2 <= size) {
+			if (len > 0)
+				data[len++] = ',';
+			(void)memcpy(&data[len], s, l);
+			len += l;
+			data[len] = '\0';
+		}
+
+		s += l;
+		if (*s == ',')
+			s++;
+	}
+
+	return flags;
+}
+
+static int mount_option(const char *opts, const char *opt)
+{
+	size_t l = strlen(opt);
+	const char *s;
+
+	for (s = opts; (s = strstr(s, opt)); s += l)
+		if ((s == opts || s[-1] == ',') && (s[l] == ',' || !s[l]))
+			return 1;
+
+	return 0;
+}
+
+/* The device findfs(8) finds for TAG=VALUE, as it reads the superblocks */
+static char *mount_findfs(const char *spec)
+{
+	char * const argv[] = { FINDFS, (char *)spec, NULL };
+	char buf[PATH_MAX];
+	ssize_t l, len = 0;
+	int fd[2], status;
+	pid_t pid;
+
+	if (access(argv[0], X_OK) == -1)
+		return NULL;
+
+	if (pipe2(fd, O_CLOEXEC) == -1) {
+		perror("pipe2");
+		return NULL;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close_and_ignore_error(fd[0]);
+		close_and_ignore_error(fd[1]);
+		return NULL;
+	} else if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY|O_CLOEXEC);
+
+		if (dup2(fd[1], STDOUT_FILENO) == -1 ||
+		    (null != -1 && dup2(null, STDERR_FILENO) == -1))
+			_exit(127);
+
+		(void)execv(argv[0], argv);
+		_exit(127);
+	}
+
+	close_and_ignore_error(fd[1]);
+	while ((size_t)len < sizeof(buf) - 1) {
+		l = read(fd[0], &buf[len], sizeof(buf) - 1 - len);
+		if (l == -1 && errno == EINTR)
+			continue;
+		if (l <= 0)
+			break;
+		len += l;
+	}
+	close_and_ignore_error(fd[0]);
+
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		return NULL;
+
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	if (*buf != '/')
+		return NULL;
+
+	return strdup(buf);
+}
+
+/*
+ * UUID=, LABEL=, PARTUUID= and PARTLABEL= as udev links them, or as findfs(8)
+ * finds them otherwise; -1 if neither does, with the spec as the fsname.
+ */
+static int mount_device(const char *spec, char **fsname)
+{
+	static const char * const tags[] = {
+		"UUID", "LABEL", "PARTUUID", "PARTLABEL", NULL
+	};
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; tags[i]; i++) {
+		size_t l = strlen(tags[i]);
+		char *s;
+
+		if (strncmp(spec, tags[i], l) != 0 || spec[l] != '=')
+			continue;
+
+		if (snprintf(path, sizeof(path), "/dev/disk/by-%s/%s",
+			     tags[i], &spec[l + 1]) < (int)sizeof(path)) {
+			for (s = &path[sizeof("/dev/disk/by-") - 1]; *s != '/';
+			     s++)
+				*s = tolower(*s);
+
+			if (access(path, F_OK) == 0) {
+				*fsname = strdup(path);
+				return 0;
+			}
+		}
+
+		*fsname = mount_findfs(spec);
+		if (*fsname)
+			return 0;
+
+		if (access(FINDFS, X_OK) == -1)
+			fprintf(stderr, "%s: No %s, and no %s to find it!\n",
+				spec, path, FINDFS);
+		else
+			fprintf(stderr, "%s: No such device!\n", spec);
+		*fsname = strdup(spec);
+		return -1;
+	}
+
+	*fsname = strdup(spec);
+	return 0;
+}
+
+/* The whole disk of a partition, as the ones of a disk are checked in turn */
+static dev_t mount_disk(const char *fsname)
+{
+	unsigned int maj, min;
+	char path[PATH_MAX];
+	struct stat st;
+	FILE *f;
+
+	if (stat(fsname, &st) == -1 || !S_ISBLK(st.st_mode))
+		return 0;
+
+	(void)snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+		       major(st.st_rdev), minor(st.st_rdev));
+	if (access(path, F_OK) == -1)
+		return st.st_rdev;
+
+	(void)snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev",
+		       major(st.st_rdev), minor(st.st_rdev));
+	f = fopen(path, "re");
+	if (!f)
+		return st.st_rdev;
+
+	if (fscanf(f, "%u:%u", &maj, &min) == 2)
+		st.st_rdev = makedev(maj, min);
+	fclose(f);
+
+	return st.st_rdev;
+}
+
+static int mount_mounted(const char *dir)
+{
+	struct mntent *m;
+	int ret = 0;
+	FILE *f;
+
+	f = setmntent("/proc/self/mounts", "re");
+	if (!f)
+		return 0;
+
+	while (!ret && (m = getmntent(f)))
+		ret = strcmp(m->mnt_dir, dir) == 0;
+	endmntent(f);
+
+	return ret;
+}
+
+static int mount_parse(const char *fstab, struct mount_entry **entries)
+{
+	struct mount_entry *e;
+	struct mntent *m;
+	int i, j, n = 0, ret;
+	FILE *f;
+
+	f = setmntent(fstab, "re");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", fstab, strerror(errno));
+		return -1;
+	}
+
+	*entries = NULL;
+	while ((m = getmntent(f))) {
+		if (strcmp(m->mnt_type, "swap") == 0 ||
+		    strcmp(m->mnt_dir, "none") == 0 ||
+		    mount_option(m->mnt_opts, "noauto"))
+			continue;
+
+		e = realloc(*entries, (n + 1) * sizeof(*e));
+		if (!e) {
+			perror("realloc");
+			break;
+		}
+		*entries = e;
+
+		e = &e[n];
+		(void)memset(e, 0, sizeof(*e));
+		ret = mount_device(m->mnt_fsname, &e->fsname);
+		e->dir = strdup(m->mnt_dir);
+		e->type = strdup(m->mnt_type);
+		e->opts = strdup(m->mnt_opts);
+		if (!e->fsname || !e->dir || !e->type || !e->opts) {
+			perror("strdup");
+			break;
+		}
+		e->passno = m->mnt_passno;
+		e->nofail = mount_option(m->mnt_opts, "nofail");
+		e->disk = e->passno > 0 ? mount_disk(e->fsname) : 0;
+		e->state = mount_mounted(e->dir) ? MOUNT_DONE :
+			   ret == -1 ? MOUNT_FAILED : MOUNT_WAITING;
+		n++;
+	}
+	endmntent(f);
+
+	/* The closest mountpoint above; the last listed before if several */
+	for (i = 0; i < n; i++) {
+		size_t best = 0;
+
+		e = &(*entries)[i];
+		e->parent = -1;
+		for (j = 0; j < n; j++) {
+			const char *dir = (*entries)[j].dir;
+			size_t l = strlen(dir);
+
+			if (j == i || strncmp(e->dir, dir, l) != 0)
+				continue;
+
+			if (e->dir[l] == '\0' ? j > i :
+			    e->dir[l] != '/' && dir[l - 1] != '/')
+				continue;
+
+			if (l > best || (l == best && j < i)) {
+				best = l;
+				e->parent = j;
+			}
+		}
+	}
+
+	return n;
+}
+
+/* Checks the file-system, unless fsck is missing, and mounts it */
+static void mount_worker(const struct mount_entry *e)
+{
+	char data[BUFSIZ];
+	unsigned long flags;
+
+	if (e->disk) {
+		char * const argv[] = { FSCK, "-a", e->fsname, NULL };
+		int status;
+		pid_t pid;
+
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			_exit(EXIT_FAILURE);
+		} else if (pid == 0) {
+			(void)execv(argv[0], argv);
+			_exit(127);
+		}
+
+		if (waitpid(pid, &status, 0) == -1) {
+			perror("waitpid");
+			_exit(EXIT_FAILURE);
+		}
+
+		/* Errors left uncorrected */
+		if (WIFSIGNALED(status) ||
+		    (WEXITSTATUS(status) >= 4 && WEXITSTATUS(status) != 127)) {
+			fprintf(stderr, "%s: fsck: Failed!\n", e->fsname);
+			_exit(EXIT_FAILURE);
+		}
+	}
+
+	flags = mount_options(e->opts, data, sizeof(data));
+	if (mount(e->fsname, e->dir, e->type, flags, data) == -1) {
+		fprintf(stderr, "%s: mount: %s\n", e->dir, strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+/* Whether another disk check would run on the same disk */
+static int mount_disk_busy(const struct mount_entry *entries, int n,
+			   dev_t disk)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (entries[i].state == MOUNT_RUNNING && entries[i].disk &&
+		    entries[i].disk == disk)
+			return 1;
+
+	return 0;
+}
+
+/* Whether a disk check of a lower pass is still to finish */
+static int mount_pass_busy(const struct mount_entry *entries, int n,
+			   int passno)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if ((entries[i].state == MOUNT_WAITING ||
+		     entries[i].state == MOUNT_RUNNING) && entries[i].disk &&
+		    entries[i].passno > 0 && entries[i].passno < passno)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Starts the entries ready to mount; returns the number of running ones. The
+ * checks of a pass wait for the ones of the lower passes, unless these wait
+ * for a mountpoint of a higher pass.
+ */
+static int mount_start(struct mount_entry *entries, int n)
+{
+	int i, changed, nrunning = 0, pass = 1;
+
+again:
+	do {
+		changed = 0;
+		for (i = 0; i < n; i++) {
+			struct mount_entry *e = &entries[i];
+			int p = e->parent;
+
+			if (e->state != MOUNT_WAITING)
+				continue;
+
+			if (p != -1 && entries[p].state == MOUNT_FAILED) {
+				fprintf(stderr, "%s: Not mounted: %s failed!\n",
+					e->dir, entries[p].dir);
+				e->state = MOUNT_FAILED;
+				changed = 1;
+				continue;
+			}
+
+			if ((p != -1 && entries[p].state != MOUNT_DONE) ||
+			    (e->disk && mount_disk_busy(entries, n, e->disk)) ||
+			    (pass && e->disk &&
+			     mount_pass_busy(entries, n, e->passno)))
+				continue;
+
+			e->pid = fork();
+			if (e->pid == -1) {
+				perror("fork");
+				e->state = MOUNT_FAILED;
+				changed = 1;
+				continue;
+			} else if (e->pid == 0) {
+				mount_worker(e);
+			}
+
+			e->state = MOUNT_RUNNING;
+		}
+	} while (changed);
+
+	for (i = 0; i < n; i++)
+		if (entries[i].state == MOUNT_RUNNING)
+			nrunning++;
+
+	if (nrunning == 0 && pass) {
+		pass = 0;
+		goto again;
+	}
+
+	return nrunning;
+}
+
+static int kill_pid1(int signum)
+{
+	if (kill(1, signum) == -1) {
+		perror("kill");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int main_kill(int signum)
+{
+	if (kill_pid1(signum) == -1)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+static int main_reboot(int argc, char * const argv[])
+{
+	char kernel[PATH_MAX], initrd[PATH_MAX], cmdline[BUFSIZ];
+	const char *i = NULL;
+	struct utsname uts;
+	union sigval value;
+	ssize_t l = 0;
+	int fd;
+
+	if (argc < 2 || strcmp(argv[1], "--kexec") != 0)
+		return main_kill(SIGINT);
+
+	/* The running kernel, its initrd if any, and its command line */
+	if (uname(&uts) == -1) {
+		perror("uname");
+		uts.release[0] = '\0';
+	}
+
+	(void)snprintf(kernel, sizeof(kernel), KEXEC_KERNEL, uts.release);
+	if (argc > 2)
+		(void)snprintf(kernel, sizeof(kernel), "%s", argv[2]);
+
+	(void)snprintf(initrd, sizeof(initrd), KEXEC_INITRD, uts.release);
+	if (argc > 3)
+		(void)snprintf(initrd, sizeof(initrd), "%s", argv[3]);
+	if ((argc > 3 && *initrd) || (argc <= 3 && access(initrd, R_OK) == 0))
+		i = initrd;
+
+	if (argc > 4) {
+		(void)snprintf(cmdline, sizeof(cmdline), "%s", argv[4]);
+	} else {
+		fd = open("/proc/cmdline", O_RDONLY|O_CLOEXEC);
+		if (fd != -1) {
+			l = read(fd, cmdline, sizeof(cmdline) - 1);
+			close_and_ignore_error(fd);
+		}
+		if (l < 0)
+			l = 0;
+		cmdline[l] = '\0';
+		if (l > 0 && cmdline[l-1] == '\n')
+			cmdline[l-1] = '\0';
+	}
+
+	/* pid 1 jumps to the loaded kernel at this reboot only */
+	if (kexec_load(kernel, i, cmdline) == -1) {
+		fprintf(stderr, "%s: Falling back to a normal reboot!\n",
+			kernel);
+		return main_kill(SIGINT);
+	}
+
+	value.sival_int = REBOOT_KEXEC;
+	if (sigqueue(1, SIGINT, value) == -1) {
+		perror("sigqueue");
+		kexec_unload();
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int main_spawn(int argc, char * const argv[])
+{
+	const char **arg = (const char **)argv;
+	const char *path;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s PATH [ARGV...]\n\n"
+				"Error: Too few arguments!\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Shift arguments to remove first argument (path), and append a NULL
+	 * pointer (execv) */
+	for (i = 0; i < (argc - 1); i++)
+		arg[i] = arg[i+1];
+	arg[i] = NULL;
 
-		verbose("pid %i assassinated\n", (int)proc.pid);
-		return 1;
-	}
+	path = argv[0];
+	/* The first argument, by convention, should point to the filename
+	 * associated with the file being executed. */
+	arg[0] = __getenv("ARGV0", path);
 
-	return 0;
+	__unsetenv("ARGV0");
+	return spawn(path, argv, environ, NULL);
 }
 
-static int pidfile_assassinate_by_pid(const char *path, struct dirent *entry,
-				      void *data)
+static int main_respawn(int argc, char * const argv[])
 {
 	struct proc proc;
-	char pidfile[BUFSIZ];
+	const char **arg = (const char **)argv;
+	const char *path;
 	pid_t pid;
+	int i;
 
-	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s PATH [ARGV...]\n\n"
+				"Error: Too few arguments!\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Shift arguments to remove first argument (path), and append a NULL
+	 * pointer (execv) */
+	for (i = 0; i < (argc - 1); i++)
+		arg[i] = arg[i+1];
+	arg[i] = NULL;
 
 	(void)memset(&proc, 0, sizeof(proc));
-	proc.oldstatus = -1;
+	proc.dev_stdin = __getenv("STDIN", "null");
+	proc.dev_stdout = __getenv("STDOUT", "null");
+	proc.dev_stderr = __getenv("STDERR", "null");
+	proc.counter = strtol(__getenv("COUNTER", "0"), NULL, 0);
+	proc.oldstatus = strtol(__getenv("OLDSTATUS", "-1"), NULL, 0);
 	proc.pid = -1;
-	proc.oldpid = -1;
-	(void)pidfile_parse(pidfile, pidfile_info, &proc);
+	proc.oldpid = strtol(__getenv("OLDPID", "-1"), NULL, 0);
+	proc.uid = strtol(__getenv("UID", "0"), NULL, 0);
+	proc.gid = strtol(__getenv("GID", "0"), NULL, 0);
+	proc.lowprio = strcmp(__getenv("PRIORITY", "normal"), "low") == 0;
+	proc.replicas = strtoreplicas(__getenv("REPLICAS", "0"));
+	proc.watchdog = strtol(__getenv("WATCHDOG", "0"), NULL, 0);
+	proc.standby = strtol(__getenv("STANDBY", "0"), NULL, 0);
 
-	pid = proc.oldpid;
-	if (pid == -1)
-		pid = proc.pid;
+	path = argv[0];
+	/* The first argument, by convention, should point to the filename
+	 * associated with the file being executed. */
+	arg[0] = __getenv("ARGV0", path);
 
-	if (pid == *(pid_t *)data) {
-		if (unlink(pidfile) == -1)
-			perror("unlink");
+	__unsetenv("ARGV0");
+	__unsetenv("STDIN");
+	__unsetenv("STDOUT");
+	__unsetenv("STDERR");
+	__unsetenv("COUNTER");
+	__unsetenv("OLDSTATUS");
+	__unsetenv("OLDPID");
+	__unsetenv("UID");
+	__unsetenv("GID");
+	__unsetenv("PRIORITY");
+	__unsetenv("REPLICAS");
+	__unsetenv("WATCHDOG");
+	__unsetenv("STANDBY");
+	if (proc_alloc(&proc, path, argv, environ) == -1)
+		return EXIT_FAILURE;
 
-		if (kill(proc.pid, SIGKILL) == -1)
-			perror("kill");
+	if (proc.replicas != 0) {
+		i = replicas_respawn(&proc);
+		free(proc.buf);
+		return i;
+	}
 
-		verbose("pid %i assassinated\n", (int)proc.pid);
-		return 1;
+	if (respawn(&proc) != EXIT_SUCCESS) {
+		free(proc.buf);
+		return EXIT_FAILURE;
 	}
+	pid = proc.pid;
 
-	return 0;
+	/* Hot standby: an instance started, but blocked until promoted */
+	if (proc.standby != 0) {
+		proc.waiting = 1;
+		(void)respawn(&proc);
+	}
+	free(proc.buf);
+	proc.buf = NULL;
+
+	printf("%i\n", (int)pid);
+	return EXIT_SUCCESS;
 }
 
-static int pidfile_status(const char *path, struct dirent *entry, void *data)
+static int main_dir_parse(int argc, char * const argv[],
+			  directory_cb_t *callback,
+			  directory_cb_t *callback_by_pid)
 {
+	char **arg = (char **)argv;
+	const char *arg0, *path;
 	struct proc proc;
-	char pidfile[BUFSIZ];
+	pid_t pid = -1;
+	int i, n, ret;
 
-	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+	if (argc == 1) {
+		pid_t pids[CPU_SETSIZE];
+
+		/* As many as the single pid would, summed up */
+		n = readpids(STDIN_FILENO, pids, CPU_SETSIZE);
+		for (i = 0, ret = 0; i < n; i++) {
+			int r = dir_parse("/run/tini", callback_by_pid,
+					  &pids[i]);
+			if (r == -1)
+				return -1;
+			ret += r;
+		}
+		if (n > 0)
+			return ret;
+	} else if (argc == 2) {
+		pid = strtopid(argv[1]);
+	}
+
+	if (pid != -1)
+		return dir_parse("/run/tini", callback_by_pid, &pid);
+
+	/* Shift arguments to remove first argument (path), and append a NULL
+	 * pointer (execv) */
+	for (i = 0; i < (argc - 1); i++)
+		arg[i] = arg[i+1];
+	arg[i] = NULL;
+
+	path = argv[0];
+	/* The first argument, by convention, should point to the filename
+	 * associated with the file being executed. */
+	arg0 = getenv("ARGV0");
+	if (arg0)
+		*arg = (char *)arg0;
 
 	(void)memset(&proc, 0, sizeof(proc));
-	proc.oldstatus = -1;
-	proc.pid = -1;
-	proc.oldpid = -1;
-	(void)pidfile_parse(pidfile, pidfile_info, &proc);
+	if (proc_alloc(&proc, path, arg, NULL) == -1)
+		return -1;
 
-	if (strcmp(proc.exec, (const char *)data) == 0) {
-		printf("%i\n", (int)proc.pid);
-		return 1;
+	ret = dir_parse("/run/tini", callback, &proc);
+	free(proc.buf);
+	return ret;
+}
+
+static int main_assassinate(int argc, char * const argv[])
+{
+	return main_dir_parse(argc, argv, pidfile_assassinate,
+			      pidfile_assassinate_by_pid);
+}
+
+static int main_status(int argc, char * const argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "--rusage") == 0) {
+		RUSAGE = 1;
+		argc--;
+		argv++;
 	}
 
-	return 0;
+	return main_dir_parse(argc, argv, pidfile_status,
+			      pidfile_status_by_pid);
 }
 
-static int pidfile_status_by_pid(const char *path, struct dirent *entry,
-				 void *data)
+static int main_zombize(int argc, char * const argv[])
 {
-	struct proc proc;
-	char pidfile[BUFSIZ];
-	pid_t pid;
+	const char **arg = (const char **)argv;
+	const char *path;
+	int i;
 
-	(void)snprintf(pidfile, sizeof(pidfile), "%s/%s", path, entry->d_name);
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s PATH [ARGV...]\n\n"
+				"Error: Too few arguments!\n", argv[0]);
+		return EXIT_FAILURE;
+	}
 
-	(void)memset(&proc, 0, sizeof(proc));
-	proc.oldstatus = -1;
-	proc.pid = -1;
-	proc.oldpid = -1;
-	(void)pidfile_parse(pidfile, pidfile_info, &proc);
+	/* Shift arguments to remove first argument (path), and append a NULL
+	 * pointer (execv) */
+	for (i = 0; i < (argc - 1); i++)
+		arg[i] = arg[i+1];
+	arg[i] = NULL;
 
-	pid = proc.oldpid;
-	if (pid == -1)
-		pid = proc.pid;
+	path = argv[0];
+	/* The first argument, by convention, should point to the filename
+	 * associated with the file being executed. */
+	arg[0] = __getenv("ARGV0", path);
 
-	if (pid == *(pid_t *)data) {
-		printf("%i\n", (int)proc.pid);
-		return 1;
+	__unsetenv("ARGV0");
+	return zombize(argv[0], argv, NULL);
+}
+
+static int main_monitor(int argc, char * const argv[])
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int fd, i;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return EXIT_FAILURE;
 	}
 
-	return 0;
+	addrlen = uevent_address(&addr);
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+		perror("connect");
+		goto error;
+	}
+
+	/* Every uevent unless filtered */
+	if (argc < 2 && send(fd, "*", 1, 0) == -1) {
+		perror("send");
+		goto error;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (send(fd, argv[i], strlen(argv[i]), 0) == -1) {
+			perror("send");
+			goto error;
+		}
+	}
+
+	for (;;) {
+		char buf[UEVENT_BUFFER_SIZE];
+		char *s, *n;
+		ssize_t l;
+
+		l = recv(fd, buf, sizeof(buf) - 1, 0);
+		if (l == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("recv");
+			goto error;
+		} else if (l == 0) {
+			break;
+		}
+		buf[l] = '\0';
+
+		for (s = buf; s < &buf[l]; s = n + 1) {
+			n = strchr(s, '\0');
+			printf("%s\n", s);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	close_and_ignore_error(fd);
+	return EXIT_SUCCESS;
+
+error:
+	close_and_ignore_error(fd);
+	return EXIT_FAILURE;
 }
 
-static int dir_parse(const char *path, directory_cb_t *callback, void *data)
+static int main_settle(int argc, char * const argv[])
+{
+	int timeout = SETTLE_TIMEOUT;
+	struct sockaddr_un addr;
+	char buf[BUFSIZ];
+	struct pollfd pfd;
+	socklen_t addrlen;
+	ssize_t l;
+	int fd;
+
+	if (argc > 2 && strcmp(argv[1], "--timeout") == 0) {
+		timeout = strtol(argv[2], NULL, 0);
+	} else if (argc > 1) {
+		fprintf(stderr, "Usage: %s [--timeout SECONDS]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+
+	addrlen = uevent_address(&addr);
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+		perror("connect");
+		goto error;
+	}
+
+	if (send(fd, "!settle", 7, 0) == -1) {
+		perror("send");
+		goto error;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		int n = poll(&pfd, 1, timeout * 1000);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			goto error;
+		} else if (n == 0) {
+			fprintf(stderr, "Error: Timed out!\n");
+			goto error;
+		}
+
+		break;
+	}
+
+	l = recv(fd, buf, sizeof(buf) - 1, 0);
+	if (l == -1) {
+		perror("recv");
+		goto error;
+	} else if (l == 0) {
+		fprintf(stderr, "Error: Connection closed!\n");
+		goto error;
+	}
+	buf[l] = '\0';
+	verbose("%s\n", buf);
+
+	close_and_ignore_error(fd);
+	return EXIT_SUCCESS;
+
+error:
+	close_and_ignore_error(fd);
+	return EXIT_FAILURE;
+}
+
+static int main_mountall(int argc, char * const argv[])
 {
-	struct dirent **namelist;
-	int n, ret = 0;
+	struct mount_entry *entries;
+	const char *fstab = FSTAB;
+	int i, n, ret = EXIT_SUCCESS;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [FSTAB]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	} else if (argc == 2) {
+		fstab = argv[1];
+	}
+
+	n = mount_parse(fstab, &entries);
+	if (n == -1)
+		return EXIT_FAILURE;
+
+	/* The independent subtrees are mounted concurrently */
+	while (mount_start(entries, n) > 0) {
+		char name[PATH_MAX];
+		int status;
+		pid_t pid;
+
+		pid = wait(&status);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+			if (entries[i].state == MOUNT_RUNNING &&
+			    entries[i].pid == pid)
+				break;
+		if (i == n)
+			continue;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			entries[i].state = MOUNT_FAILED;
+			continue;
+		}
 
-	n = scandir(path, &namelist, NULL, alphasort);
-	if (n == -1) {
-		perror("scandir");
-		return -1;
+		entries[i].state = MOUNT_DONE;
+
+		/* e.g. mount/data */
+		if (snprintf(name, sizeof(name), "mount%s",
+			     entries[i].dir) < (int)sizeof(name))
+			stage(name);
 	}
 
-	while (n-- > 0) {
-		if (strcmp(namelist[n]->d_name, ".") != 0 &&
-		    strcmp(namelist[n]->d_name, "..") != 0 ) {
-			if (callback(path, namelist[n], data) != 0)
-				ret++;
-		}
-		free(namelist[n]);
+	for (i = 0; i < n; i++) {
+		if (entries[i].state != MOUNT_DONE && !entries[i].nofail)
+			ret = EXIT_FAILURE;
+
+		free(entries[i].fsname);
+		free(entries[i].dir);
+		free(entries[i].type);
+		free(entries[i].opts);
 	}
-	free(namelist);
+	free(entries);
 
 	return ret;
 }
 
-static int kill_pid1(int signum)
+static int main_heartbeat(int argc, char * const argv[])
 {
-	if (kill(1, signum) == -1) {
-		perror("kill");
-		return -1;
-	}
+	uint64_t beat = 1;
+	int fd;
 
-	return 0;
-}
+	(void)argc;
+	(void)argv;
 
-static int main_kill(int signum)
-{
-	if (kill_pid1(signum) == -1)
+	fd = strtol(__getenv("WATCHDOG_FD", "-1"), NULL, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Not watched!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (write(fd, &beat, sizeof(beat)) == -1 && errno != EAGAIN) {
+		perror("write");
 		return EXIT_FAILURE;
+	}
 
 	return EXIT_SUCCESS;
 }
 
-static int main_spawn(int argc, char * const argv[])
+static int main_fdstore(int argc, char * const argv[])
 {
-	const char **arg = (const char **)argv;
-	const char *path;
-	int i;
+	char buf[sizeof("!fdstore ") + sizeof(((struct fdstore *)0)->name)];
+	int fd = STDIN_FILENO;
 
 	if (argc < 2) {
-		fprintf(stderr, "Usage: %s PATH [ARGV...]\n\n"
+		fprintf(stderr, "Usage: %s NAME [FD|-]\n\n"
 				"Error: Too few arguments!\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	/* Shift arguments to remove first argument (path), and append a NULL
-	 * pointer (execv) */
-	for (i = 0; i < (argc - 1); i++)
-		arg[i] = arg[i+1];
-	arg[i] = NULL;
+	/* - removes it */
+	if (argc > 2 && strcmp(argv[2], "-") == 0) {
+		fd = -1;
+	} else if (argc > 2) {
+		char *end;
+		long l;
+
+		errno = 0;
+		l = strtol(argv[2], &end, 0);
+		if (errno != 0 || end == argv[2] || *end != '\0' || l < 0 ||
+		    l > INT_MAX) {
+			fprintf(stderr, "%s: Invalid descriptor!\n", argv[2]);
+			return EXIT_FAILURE;
+		}
+		fd = l;
+	}
 
-	path = argv[0];
-	/* The first argument, by convention, should point to the filename
-	 * associated with the file being executed. */
-	arg[0] = __getenv("ARGV0", path);
+	if (fdstore_name(argv[1]) == -1) {
+		fprintf(stderr, "%s: Invalid name!\n", argv[1]);
+		return EXIT_FAILURE;
+	}
 
-	__unsetenv("ARGV0");
-	return spawn(path, argv, environ, NULL);
+	(void)snprintf(buf, sizeof(buf), "!fdstore %s", argv[1]);
+	if (control_send(buf, fd, 1) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
 }
 
-static int main_respawn(int argc, char * const argv[])
+static int main_switch_root(int argc, char * const argv[])
 {
-	struct proc proc;
-	const char **arg = (const char **)argv;
-	const char *path;
-	int i;
+	char buf[sizeof("!switch-root ") + PATH_MAX];
+	char path[PATH_MAX];
 
 	if (argc < 2) {
-		fprintf(stderr, "Usage: %s PATH [ARGV...]\n\n"
+		fprintf(stderr, "Usage: %s NEWROOT\n\n"
 				"Error: Too few arguments!\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	/* Shift arguments to remove first argument (path), and append a NULL
-	 * pointer (execv) */
-	for (i = 0; i < (argc - 1); i++)
-		arg[i] = arg[i+1];
-	arg[i] = NULL;
-
-	(void)memset(&proc, 0, sizeof(proc));
-	proc.dev_stdin = __getenv("STDIN", "null");
-	proc.dev_stdout = __getenv("STDOUT", "null");
-	proc.dev_stderr = __getenv("STDERR", "null");
-	proc.counter = strtol(__getenv("COUNTER", "0"), NULL, 0);
-	proc.oldstatus = strtol(__getenv("OLDSTATUS", "-1"), NULL, 0);
-	proc.pid = -1;
-	proc.oldpid = strtol(__getenv("OLDPID", "-1"), NULL, 0);
-	proc.uid = strtol(__getenv("UID", "0"), NULL, 0);
-	proc.gid = strtol(__getenv("GID", "0"), NULL, 0);
-
-	path = argv[0];
-	/* The first argument, by convention, should point to the filename
-	 * associated with the file being executed. */
-	arg[0] = __getenv("ARGV0", path);
+	if (!realpath(argv[1], path)) {
+		fprintf(stderr, "%s: realpath: %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
 
-	__unsetenv("ARGV0");
-	__unsetenv("STDIN");
-	__unsetenv("STDOUT");
-	__unsetenv("STDERR");
-	__unsetenv("COUNTER");
-	__unsetenv("OLDSTATUS");
-	__unsetenv("OLDPID");
-	__unsetenv("UID");
-	__unsetenv("GID");
-	if (respawn(path, argv, &proc) != EXIT_SUCCESS)
+	(void)snprintf(buf, sizeof(buf), "!switch-root %s", path);
+	if (control_send(buf, -1, 1) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
 		return EXIT_FAILURE;
+	}
 
-	printf("%i\n", (int)proc.pid);
 	return EXIT_SUCCESS;
 }
 
-static int main_dir_parse(int argc, char * const argv[],
-			  directory_cb_t *callback,
-			  directory_cb_t *callback_by_pid)
+static int main_modalias(int argc, char * const argv[])
 {
-	char **arg = (char **)argv;
-	const char *arg0, *path;
-	char execline[BUFSIZ];
-	pid_t pid = -1;
-	int i;
-
-	if (argc == 1)
-		pid = readpid(STDIN_FILENO);
-	else if (argc == 2)
-		pid = strtopid(argv[1]);
-
-	if (pid != -1)
-		return dir_parse("/run/tini", callback_by_pid, &pid);
+	const char *arg0 = argv[0];
+	int i, ret = EXIT_SUCCESS;
 
-	/* Shift arguments to remove first argument (path), and append a NULL
-	 * pointer (execv) */
-	for (i = 0; i < (argc - 1); i++)
-		arg[i] = arg[i+1];
-	arg[i] = NULL;
-
-	path = argv[0];
-	/* The first argument, by convention, should point to the filename
-	 * associated with the file being executed. */
-	arg0 = getenv("ARGV0");
-	if (arg0)
-		*arg = (char *)arg0;
+	if (argc > 2 && strcmp(argv[1], "--modules") == 0) {
+		modules.dir = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
 
-	(void)strargv(execline, sizeof(execline), path, arg);
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s [--modules DIR] MODALIAS...\n\n"
+				"Error: Too few arguments!\n", arg0);
+		return EXIT_FAILURE;
+	}
 
-	return dir_parse("/run/tini", callback, execline);
-}
+	/* Print the modules instead of loading them */
+	modules.dryrun = 1;
+	if (modules_open(&modules) == -1)
+		return EXIT_FAILURE;
 
-static int main_assassinate(int argc, char * const argv[])
-{
-	return main_dir_parse(argc, argv, pidfile_assassinate,
-			      pidfile_assassinate_by_pid);
-}
+	for (i = 1; i < argc; i++)
+		if (modalias_load(&modules, argv[i]) == -1) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			ret = EXIT_FAILURE;
+		}
 
-static int main_status(int argc, char * const argv[])
-{
-	return main_dir_parse(argc, argv, pidfile_status,
-			      pidfile_status_by_pid);
+	return ret;
 }
 
-static int main_zombize(int argc, char * const argv[])
+static int main_raise(int argc, char * const argv[])
 {
-	const char **arg = (const char **)argv;
-	const char *path;
-	int i;
+	const struct cache_record *r;
 
-	if (argc < 2) {
-		fprintf(stderr, "Usage: %s PATH [ARGV...]\n\n"
-				"Error: Too few arguments!\n", argv[0]);
-		return EXIT_FAILURE;
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s EVENT start|stop\n", argv[0]);
+		exit(EXIT_FAILURE);
 	}
 
-	/* Shift arguments to remove first argument (path), and append a NULL
-	 * pointer (execv) */
-	for (i = 0; i < (argc - 1); i++)
-		arg[i] = arg[i+1];
-	arg[i] = NULL;
-
-	path = argv[0];
-	/* The first argument, by convention, should point to the filename
-	 * associated with the file being executed. */
-	arg[0] = __getenv("ARGV0", path);
+	r = cache_lookup(&cache, HANDLERS_EVENT, argv[1]);
+	if (!r || r->mtime == 0) {
+		fprintf(stderr, "%s: No such event\n", argv[1]);
+		return EXIT_SUCCESS;
+	}
 
-	__unsetenv("ARGV0");
-	return zombize(argv[0], argv, NULL);
+	return run_parts(&cache, r, argv[2], environ);
 }
 
 static int main_applet(int argc, char * const argv[])
@@ -1242,7 +8857,7 @@ static int main_applet(int argc, char * const argv[])
 	const char *app = applet(argv[0]);
 
 	if (strcmp(app, "reboot") == 0)
-		return main_kill(SIGINT);
+		return main_reboot(argc, &argv[0]);
 	else if (strcmp(app, "poweroff") == 0)
 		return main_kill(SIGTERM);
 	else if (strcmp(app, "halt") == 0)
@@ -1259,6 +8874,22 @@ static int main_applet(int argc, char * const argv[])
 		return main_status(argc, &argv[0]);
 	else if (strcmp(app, "zombize") == 0)
 		return main_zombize(argc, &argv[0]);
+	else if (strcmp(app, "raise") == 0)
+		return main_raise(argc, &argv[0]);
+	else if (strcmp(app, "monitor") == 0)
+		return main_monitor(argc, &argv[0]);
+	else if (strcmp(app, "modalias") == 0)
+		return main_modalias(argc, &argv[0]);
+	else if (strcmp(app, "settle") == 0)
+		return main_settle(argc, &argv[0]);
+	else if (strcmp(app, "mountall") == 0)
+		return main_mountall(argc, &argv[0]);
+	else if (strcmp(app, "heartbeat") == 0)
+		return main_heartbeat(argc, &argv[0]);
+	else if (strcmp(app, "fdstore") == 0)
+		return main_fdstore(argc, &argv[0]);
+	else if (strcmp(app, "switch-root") == 0)
+		return main_switch_root(argc, &argv[0]);
 
 	return EXIT_FAILURE;
 }
@@ -1268,13 +8899,21 @@ static int main_tini(int argc, char * const argv[])
 	static struct options_t options;
 	struct sockaddr_nl addr;
 	static sigset_t sigset;
-	int fd, sig;
+	int status = EXIT_FAILURE;
+	int fd = -1, sfd, sig, kexec = 0;
+	pid_t pid = -1;
 
 	int argi = parse_arguments(&options, argc, argv);
 	if (argi < 0) {
 		fprintf(stderr, "Error: %s: Invalid argument!\n",
 				argv[optind-1]);
 		exit(EXIT_FAILURE);
+	} else if (options.subreaper == 1) {
+		if (argc - argi < 1) {
+			usage(stdout, argv[0]);
+			fprintf(stderr, "Error: Too few arguments!\n");
+			exit(EXIT_FAILURE);
+		}
 	} else if (argc - argi > 1) {
 		usage(stdout, argv[0]);
 		fprintf(stderr, "Error: Too many arguments!\n");
@@ -1296,12 +8935,19 @@ static int main_tini(int argc, char * const argv[])
 		return EXIT_SUCCESS;
 	}
 
-	/* Not supposed to be run when not pid 1 */
-	if (getpid() > 1) {
+	/* Not supposed to be run when not pid 1, unless child subreaper */
+	if (getpid() > 1 && options.subreaper == 0) {
 		fprintf(stderr, "Error: Not pid 1!\n");
 		exit(EXIT_FAILURE);
 	}
 
+	/* Adopt the orphaned descendants as pid 1 does */
+	if (options.subreaper == 1 &&
+	    prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) == -1) {
+		perror("prctl");
+		exit(EXIT_FAILURE);
+	}
+
 	if (sigemptyset(&sigset) == -1) {
 		perror("sigemptyset");
 		exit(EXIT_FAILURE);
@@ -1337,10 +8983,19 @@ static int main_tini(int argc, char * const argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	sig = SIGIO;
-	if (sigaddset(&sigset, sig) == -1) {
-		perror("perror");
-		exit(EXIT_FAILURE);
+	/* Signals forwarded to the process group of the child */
+	if (options.subreaper == 1) {
+		sig = SIGHUP;
+		if (sigaddset(&sigset, sig) == -1) {
+			perror("sigaddset");
+			exit(EXIT_FAILURE);
+		}
+
+		sig = SIGQUIT;
+		if (sigaddset(&sigset, sig) == -1) {
+			perror("sigaddset");
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	if (sigprocmask(SIG_SETMASK, &sigset, NULL) == -1) {
@@ -1348,44 +9003,226 @@ static int main_tini(int argc, char * const argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	if (mkdir("/run/tini", DEFFILEMODE) == -1)
+	if (mkdir("/run/tini", DEFFILEMODE) == -1 && errno != EEXIST)
 		perror("mkdir");
 
-	fd = netlink_open(&addr, SIGIO);
-	if (fd == -1)
-		return EXIT_FAILURE;
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	sfd = signalfd(-1, &sigset, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sfd == -1) {
+		perror("signalfd");
+		exit(EXIT_FAILURE);
+	}
+
+	if (epoll_watch(sfd) == -1)
+		exit(EXIT_FAILURE);
+
+	/* Child subreaper: no uevents, no rcS; run the command */
+	if (options.subreaper == 1) {
+		pid = subreap(argv[argi], &argv[argi]);
+		if (pid == -1)
+			exit(EXIT_FAILURE);
+
+		goto loop;
+	}
+
+	stage("tini");
+
+	if (options.readahead > 0)
+		(void)readahead_start(READAHEAD_LIST, options.readahead);
+
+	/* Not fatal: the uevent script still sets the nodes up */
+	(void)device_rules_load(DEVICE_RULES);
+
+	if (cache_open(&cache, HANDLERS_CACHE) == -1)
+		fprintf(stderr, "%s: Cannot open cache!\n", HANDLERS_CACHE);
+	else if (cache_watch(&cache) == -1)
+		fprintf(stderr, "%s: Cannot watch cache!\n", HANDLERS_CACHE);
+
+	/* Replay: the capture stands for the kernel socket */
+	if (options.replay) {
+		replay_dry = !options.replay_setup;
+		if (uevent_replay_open(options.replay, options.speed) == -1)
+			return EXIT_FAILURE;
+	} else {
+		/* Re-executed: the socket is kept, and so are the uevents */
+		fd = netlink_resume(&addr);
+		if (fd == -1)
+			fd = netlink_open(&addr);
+		if (fd == -1)
+			return EXIT_FAILURE;
+
+		if (epoll_watch(fd) == -1)
+			return EXIT_FAILURE;
+
+		/* Not fatal: the uevents are still handled */
+		if (options.capture)
+			(void)uevent_capture_open(options.capture);
+	}
+
+	/* Not fatal: uevents are then dispatched as they are received */
+	coalesce_ms = options.coalesce >= 0 ? options.coalesce : 0;
+	(void)uevent_coalesce_open();
+	held_resume();
+
+	/* Not fatal: uevents are still handled without subscribers */
+	(void)uevent_listen();
+
+	/* Not fatal: the processes are then unwatched */
+	(void)watchdog_open();
+
+	/* Re-executed: the stored descriptors are kept */
+	fdstore_resume();
+
+	/* Not fatal: admission control is off without PSI */
+	psi_freeze = options.freeze;
+	modules.dir = options.modules;
+	(void)psi_open();
+
+	/* Re-executed: still deferred until no pressure holds for a while */
+	if (access("/run/tini", F_OK) == 0 &&
+	    dir_parse("/run/tini", proc_undefer, NULL) > 0) {
+		if (psi_tfd != -1)
+			psi_hold_arm();
+		else
+			proc_release();
+	}
 
 	printf("tini started!\n");
+	stage("tini/started");
 
 	if (spawn("/lib/tini/scripts/rcS", rcS, environ, NULL) != EXIT_SUCCESS)
 		perror("spawn");
 
+loop:
+
 	for (;;) {
-		siginfo_t siginfo;
-		sig = sigwaitinfo(&sigset, &siginfo);
-		if (sig == -1) {
+		struct signalfd_siginfo siginfo;
+		struct epoll_event event;
+		ssize_t s;
+		int n;
+
+		sig = -1;
+		n = epoll_wait(epfd, &event, 1, -1);
+		if (n == -1) {
 			if (errno == EINTR)
 				continue;
 
-			perror("sigwaitinfo");
+			perror("epoll_wait");
 			break;
 		}
 
-		debug("sigwaitinfo(): %s\n", strsignal(sig));
+		/* Netlink uevent */
+		if (event.data.fd == fd) {
+			(void)netlink_recv(fd, &addr);
+			continue;
+		}
+
+		/* Held uevents are due */
+		if (event.data.fd == co_tfd) {
+			uevent_release();
+			continue;
+		}
+
+		/* No more uevent to wait for the kernel SEQNUM */
+		if (event.data.fd == st_tfd) {
+			uevent_settle_grace();
+			continue;
+		}
+
+		/* Captured uevents are due */
+		if (event.data.fd == rp_tfd) {
+			uevent_replay();
+			continue;
+		}
+
+		/* Watchdog tick */
+		if (event.data.fd == watchdog.tfd) {
+			watchdog_tick();
+			continue;
+		}
+
+		/* Uevent daemon acked, takes more uevents, or is late */
+		if (event.data.fd == udaemon.out) {
+			udaemon_ack();
+			continue;
+		} else if (event.data.fd == udaemon.in) {
+			udaemon_flush();
+			continue;
+		} else if (event.data.fd == udaemon.tfd) {
+			udaemon_timeout();
+			continue;
+		}
+
+		/* Pressure stall */
+		if (psi_lookup(event.data.fd) != -1) {
+			psi_trigger();
+			continue;
+		}
+
+		/* No pressure stall for a while */
+		if (event.data.fd == psi_tfd) {
+			psi_release();
+			continue;
+		}
+
+		/* Handler directories changed */
+		if (event.data.fd == in_fd) {
+			cache_notify(&cache, in_fd);
+			continue;
+		}
+
+		/* Uevent subscriber connected */
+		if (event.data.fd == ul_fd) {
+			(void)uevent_accept(ul_fd);
+			continue;
+		}
+
+		/* Uevent subscriber sent a filter, or hung up */
+		n = uevent_subscriber(event.data.fd);
+		if (n != -1) {
+			(void)uevent_subscribe(n);
+			continue;
+		}
+
+		/* Supervised child exited */
+		if (event.data.fd != sfd) {
+			int wstatus;
+
+			(void)child_reap(P_PIDFD, event.data.fd, &wstatus);
+			pidfd_unwatch(event.data.fd);
+			continue;
+		}
+
+		s = read(sfd, &siginfo, sizeof(siginfo));
+		if (s == -1) {
+			if (errno == EAGAIN)
+				continue;
+
+			perror("read");
+			break;
+		}
+
+		sig = siginfo.ssi_signo;
+		debug("signalfd(): %s\n", strsignal(sig));
+		kexec = sig == SIGINT && siginfo.ssi_code == SI_QUEUE &&
+			siginfo.ssi_int == REBOOT_KEXEC;
 
 		/* Reap zombies */
 		if (sig == SIGCHLD) {
-			verbose("pid %i exited with status %i\n",
-				(int)siginfo.si_pid, siginfo.si_status);
-
-			(void)pid_respawn(siginfo.si_pid, siginfo.si_status);
-			while (waitpid(-1, NULL, WNOHANG) > 0);
+			if (reap_zombies(pid, &status) && options.subreaper == 1)
+				break;
 			continue;
 		}
 
-		/* Netlink uevent */
-		if (sig == SIGIO) {
-			(void)netlink_recv(fd, &addr);
+		/* Forward to the process group of the child */
+		if (options.subreaper == 1) {
+			if (kill(-pid, sig) == -1)
+				perror("kill");
 			continue;
 		}
 
@@ -1398,14 +9235,39 @@ static int main_tini(int argc, char * const argv[])
 	/* Reap zombies */
 	while (waitpid(-1, NULL, WNOHANG) > 0);
 
-	(void)netlink_close(fd);
+	(void)uevent_close(ul_fd);
+	udaemon_stop(0);
+	if (sig == SIGUSR1) {
+		watchdog_keep();
+		fdstore_keep();
+	}
+	if (sig == SIGUSR1 && fd != -1 && options.subreaper == 0)
+		(void)netlink_keep(fd);
+	else
+		(void)netlink_close(fd);
 	fd = -1;
 
 	if (sigprocmask(SIG_UNBLOCK, &sigset, NULL) == -1)
 		perror("sigprocmask");
 
-	/* Re-execute itself */
+	/* Child subreaper: exit with the status of the child */
+	if (options.subreaper == 1) {
+		if (sig == -1)
+			exit(EXIT_FAILURE);
+
+		if (WIFSIGNALED(status) != 0)
+			exit(128 + WTERMSIG(status));
+
+		exit(WEXITSTATUS(status));
+	}
+
+	/* Re-execute itself, in the new root if switched to */
 	if (sig == SIGUSR1) {
+		if (*newroot && switch_root(newroot, argv[0]) == -1) {
+			fprintf(stderr, "%s: Cannot switch root!\n", newroot);
+			stage("switch-root/failed");
+		}
+
 		(void)execv(argv[0], argv);
 		perror("execv");
 		_exit(127);
@@ -1418,9 +9280,13 @@ static int main_tini(int argc, char * const argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	/* Reboot (Ctrl-Alt-Delete) */
+	/* Reboot (Ctrl-Alt-Delete), into the kexec loaded kernel if asked */
 	if (sig == SIGINT) {
 		sync();
+		if (kexec && kexec_loaded() && reboot(RB_KEXEC) == -1) {
+			perror("reboot");
+			kexec_unload();
+		}
 		if (reboot(RB_AUTOBOOT) == -1)
 			perror("reboot");
 		exit(EXIT_FAILURE);
@@ -1440,6 +9306,8 @@ int main(int argc, char * const argv[])
 {
 	const char *app = applet(argv[0]);
 
+	STAGES = strcmp(__getenv("TINI_STAGES", "0"), "0") != 0;
+
 	if (strcmp(app, "tini") == 0)
 		return main_tini(argc, argv);
 